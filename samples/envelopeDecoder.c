@@ -0,0 +1,77 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * This sample decodes a gateway envelope (event format "wenv"), published by a
+ * gateway using publishEnvelopeEvent(), and prints one line per device event.
+ * Backend applications can use decodeGatewayEnvelope() in the same way on the
+ * payload of received envelope events.
+ *
+ * SYNTAX:
+ * envelopeDecoder [envelope_file_path]     - reads stdin if file is not specified
+ *
+ */
+
+#include <stdio.h>
+#include <memory.h>
+#include <stdlib.h>
+
+#include "iotfclient.h"
+
+/* Print a decoded record */
+void recordCallback(void* context, char* deviceType, char* deviceId, char* eventType, long offsetMs, char* payload, int payloadlen)
+{
+    (void)context;
+    fprintf(stdout, "Type=%s ID=%s Event=%s Offset=%ldms Payload=%.*s\n", deviceType, deviceId, eventType, offsetMs, payloadlen, payload);
+}
+
+/* Main program */
+int main(int argc, char *argv[])
+{
+    FILE *fp = stdin;
+    char *buf = NULL;
+    int len = 0;
+    int size = 0;
+    int n;
+
+    if ( argc > 1 && (fp = fopen(argv[1], "r")) == NULL ) {
+        fprintf(stderr, "ERROR: Failed to open envelope file: %s\n", argv[1]);
+        exit(1);
+    }
+
+    /* read whole envelope */
+    do {
+        if ( len == size ) {
+            size = size ? size * 2 : 4096;
+            if ( (buf = realloc(buf, size)) == NULL ) {
+                fprintf(stderr, "ERROR: Out of memory\n");
+                exit(1);
+            }
+        }
+        n = fread(buf + len, 1, size - len, fp);
+        len += n;
+    } while ( n > 0 );
+
+    n = decodeGatewayEnvelope(buf, len, recordCallback, NULL);
+    if ( n < 0 ) {
+        fprintf(stderr, "ERROR: Malformed envelope\n");
+        exit(1);
+    }
+    fprintf(stdout, "Decoded %d records\n", n);
+
+    free(buf);
+    if ( fp != stdin ) fclose(fp);
+
+    return 0;
+}
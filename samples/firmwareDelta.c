@@ -0,0 +1,286 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * This sample creates a firmware delta on a host, to be served as the firmware
+ * URI of a device management firmware update instead of the full image. The
+ * device rebuilds the image from its installed image, see setFirmwareBaseImage().
+ * It also applies a delta with applyFirmwareDelta(), as the device does, and
+ * prints the size of the delta and the time taken.
+ *
+ * Regions of the image are matched with the base image by hashes of 8 bytes,
+ * and extended over bytes that differ while most bytes still match, like code
+ * with shifted addresses. Such a region is sent as the difference to the base,
+ * mostly zero bytes that are sent as run lengths. Unmatched bytes are sent as is.
+ *
+ * SYNTAX:
+ * firmwareDelta create <base_image> <new_image> <delta>
+ * firmwareDelta apply <base_image> <delta> <new_image>
+ *
+ */
+
+#include <stdio.h>
+#include <memory.h>
+#include <stdlib.h>
+#include <time.h>
+#include <openssl/evp.h>
+
+#include "iotfclient.h"
+
+#define MIN_MATCH       8
+#define MIN_REGION      16
+#define MAX_CANDIDATES  64
+#define MAX_MISMATCH    32
+
+/* Growing output buffer */
+typedef struct {
+    unsigned char *data;
+    size_t len;
+    size_t size;
+} buffer;
+
+static void put(buffer *b, const void *data, size_t len)
+{
+    if ( b->len + len > b->size ) {
+        b->size = (b->len + len) * 2;
+        if ( (b->data = realloc(b->data, b->size)) == NULL ) {
+            fprintf(stderr, "ERROR: Out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+}
+
+static void putByte(buffer *b, unsigned char v)
+{
+    put(b, &v, 1);
+}
+
+static void putVarint(buffer *b, unsigned long long v)
+{
+    while ( v >= 0x80 ) {
+        putByte(b, (unsigned char)(v | 0x80));
+        v >>= 7;
+    }
+    putByte(b, (unsigned char)v);
+}
+
+static void putLE64(buffer *b, unsigned long long v)
+{
+    int i;
+    for (i = 0; i < 8; i++)
+        putByte(b, (unsigned char)(v >> (8 * i)));
+}
+
+static unsigned char * readFile(const char *path, size_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    unsigned char *data;
+    long size;
+
+    if ( fp == NULL || fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) < 0 ) {
+        fprintf(stderr, "ERROR: Failed to open file: %s\n", path);
+        exit(1);
+    }
+    rewind(fp);
+    if ( (data = malloc(size + 1)) == NULL || fread(data, 1, size, fp) != (size_t)size ) {
+        fprintf(stderr, "ERROR: Failed to read file: %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+    *len = size;
+
+    return data;
+}
+
+static unsigned int hash8(const unsigned char *p, int bits)
+{
+    unsigned long long v;
+    memcpy(&v, p, 8);
+    return (unsigned int)((v * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+static void putInsert(buffer *b, const unsigned char *data, size_t len)
+{
+    if ( len == 0 )
+        return;
+    putByte(b, 2);
+    putVarint(b, len);
+    put(b, data, len);
+}
+
+/* Region of the image as difference to the base: runs of unchanged and changed bytes */
+static void putAdd(buffer *b, const unsigned char *base, size_t baseOffset, const unsigned char *image, size_t len)
+{
+    size_t k = 0;
+
+    putByte(b, 1);
+    putVarint(b, baseOffset);
+    putVarint(b, len);
+    while ( k < len ) {
+        size_t same = 0, changed = 0, i;
+
+        while ( k + same < len && image[k + same] == base[k + same] )
+            same++;
+        /* a changed run takes in short unchanged gaps */
+        for (i = k + same; i < len; i++) {
+            if ( image[i] == base[i] && (i + 1 >= len || image[i + 1] == base[i + 1]) &&
+                 (i + 2 >= len || image[i + 2] == base[i + 2]) )
+                break;
+        }
+        changed = i - k - same;
+        putVarint(b, same);
+        putVarint(b, changed);
+        for (i = k + same; i < k + same + changed; i++)
+            putByte(b, (unsigned char)(image[i] - base[i]));
+        k += same + changed;
+    }
+}
+
+static int create(const char *basePath, const char *imagePath, const char *deltaPath)
+{
+    size_t baseLen, imageLen, i, j, last = 0;
+    unsigned char *base = readFile(basePath, &baseLen);
+    unsigned char *image = readFile(imagePath, &imageLen);
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen;
+    int bits = 10, *head, *next;
+    buffer delta = { NULL, 0, 0 };
+    clock_t start = clock();
+    FILE *fp;
+
+    /* index base positions by hash of 8 bytes */
+    while ( (1UL << bits) < baseLen && bits < 28 )
+        bits++;
+    head = malloc(sizeof(int) << bits);
+    next = malloc(sizeof(int) * (baseLen + 1));
+    if ( head == NULL || next == NULL ) {
+        fprintf(stderr, "ERROR: Out of memory\n");
+        exit(1);
+    }
+    memset(head, 0xff, sizeof(int) << bits);
+    for (i = 0; i + MIN_MATCH <= baseLen; i++) {
+        unsigned int h = hash8(base + i, bits);
+        next[i] = head[h];
+        head[h] = (int)i;
+    }
+
+    put(&delta, "WDELTA01", 8);
+    putLE64(&delta, baseLen);
+    putLE64(&delta, imageLen);
+    EVP_Digest(image, imageLen, digest, &digestLen, EVP_sha256(), NULL);
+    put(&delta, digest, 32);
+
+    j = 0;
+    while ( j + MIN_MATCH <= imageLen ) {
+        size_t bestLen = 0, bestPos = 0, fwd, back;
+        long score, bestScore;
+        int p, n = 0;
+
+        for (p = head[hash8(image + j, bits)]; p >= 0 && n < MAX_CANDIDATES; p = next[p], n++) {
+            size_t len = 0;
+            while ( j + len < imageLen && p + len < baseLen && image[j + len] == base[p + len] )
+                len++;
+            if ( len > bestLen ) {
+                bestLen = len;
+                bestPos = p;
+            }
+        }
+        if ( bestLen < MIN_REGION ) {
+            j++;
+            continue;
+        }
+
+        /* extend forward while matches outweigh mismatches */
+        fwd = bestLen;
+        for (score = 0, bestScore = 0, i = bestLen; j + i < imageLen && bestPos + i < baseLen; i++) {
+            score += (image[j + i] == base[bestPos + i]) ? 1 : -1;
+            if ( score > bestScore ) {
+                bestScore = score;
+                fwd = i + 1;
+            }
+            if ( i + 1 - fwd > MAX_MISMATCH )
+                break;
+        }
+
+        /* and backward into the unmatched bytes */
+        back = 0;
+        for (score = 0, bestScore = 0, i = 1; i <= j - last && i <= bestPos; i++) {
+            score += (image[j - i] == base[bestPos - i]) ? 1 : -1;
+            if ( score > bestScore ) {
+                bestScore = score;
+                back = i;
+            }
+            if ( i - back > MAX_MISMATCH )
+                break;
+        }
+
+        putInsert(&delta, image + last, j - back - last);
+        putAdd(&delta, base + bestPos - back, bestPos - back, image + j - back, back + fwd);
+        j += fwd;
+        last = j;
+    }
+    putInsert(&delta, image + last, imageLen - last);
+    putByte(&delta, 0);
+
+    if ( (fp = fopen(deltaPath, "wb")) == NULL || fwrite(delta.data, 1, delta.len, fp) != delta.len || fclose(fp) != 0 ) {
+        fprintf(stderr, "ERROR: Failed to write delta: %s\n", deltaPath);
+        exit(1);
+    }
+
+    fprintf(stdout, "Base %zu bytes, image %zu bytes, delta %zu bytes (%.1f%%) in %.0f ms\n",
+        baseLen, imageLen, delta.len, imageLen ? 100.0 * delta.len / imageLen : 0.0,
+        (clock() - start) * 1000.0 / CLOCKS_PER_SEC);
+
+    free(head);
+    free(next);
+    free(base);
+    free(image);
+    free(delta.data);
+
+    return 0;
+}
+
+static int apply(char *basePath, char *deltaPath, char *imagePath)
+{
+    struct timespec t0, t1;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    rc = applyFirmwareDelta(basePath, deltaPath, imagePath);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if ( rc != 0 ) {
+        fprintf(stderr, "ERROR: Failed to apply delta: rc=%d\n", rc);
+        return 1;
+    }
+    fprintf(stdout, "Image rebuilt and verified in %.1f ms\n",
+        (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+    return 0;
+}
+
+/* Main program */
+int main(int argc, char *argv[])
+{
+    if ( argc == 5 && !strcmp(argv[1], "create") )
+        return create(argv[2], argv[3], argv[4]);
+    if ( argc == 5 && !strcmp(argv[1], "apply") )
+        return apply(argv[2], argv[3], argv[4]);
+
+    fprintf(stderr, "Usage: %s create <base_image> <new_image> <delta>\n", argv[0]);
+    fprintf(stderr, "       %s apply <base_image> <delta> <new_image>\n", argv[0]);
+    return 1;
+}
@@ -150,6 +150,14 @@ void gatewayCommandCallback (char* type, char* id, char* commandName, char *form
     fprintf(stdout, "Payload: %s\n", (char *)payload);
 }
 
+/* Callback function to process Gateway Notifications */
+void gatewayNotifyCallback (char* type, char* id, GatewayNotifyError error, int rc, char* request, char* message)
+{
+    fprintf(stdout, "Gateway Notification Received -----\n");
+    fprintf(stdout, "Type=%s ID=%s Error=%d RC=%d Request=%s\n", type?type:"", id?id:"", (int)error, rc, request?request:"");
+    fprintf(stdout, "Message: %s\n", message?message:"");
+}
+
 
 /* Main program */
 int main(int argc, char *argv[])
@@ -224,6 +232,10 @@ int main(int argc, char *argv[])
         /* Set gateway command callback */
         setCommandHandler(&client, gatewayCommandCallback);
 
+        /* Set gateway notification callback and back off rejected devices */
+        setGatewayNotificationHandler(&client, gatewayNotifyCallback);
+        setGatewayDeviceBackoff(&client, 10, 600);
+
         /* Subscribe to gateway notifications */
         rc = subscribeToGatewayNotification(&client);
         fprintf(stdout, "RC from subscribeToGatewayNotification(): %d\n", rc);
@@ -49,6 +49,8 @@
 #include <fcntl.h>
 #include <openssl/ssl.h>
 #include <openssl/engine.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
 
 #include "ax_api.h"
 #include "HLSEAPI.h"
@@ -59,6 +61,7 @@
 #define OBJECT_CLASS(OBJECT_TYPE)     (U8)((OBJECT_TYPE & 0x00FF0000) >> 16)
 #define OBJECT_INDEX(OBJECT_HANDLE)   (U8)((OBJECT_HANDLE & 0x000000FF))
 #define HLSE_CERTIFICATE    0x00090000
+#define SE_CACHE_VERSION    "SECACHE1"
 
 int dbgPrint = 0;
 
@@ -77,12 +80,9 @@ static void printDataAsHex(U8* data, U16 dataLen)
 }
 
 /* Retrieve Reference key and write to file */
-static int getReferenceKey(int keyIndex, int storageClass, char *keyFilepath)
+static int getReferenceKey(int keyIndex, int storageClass, U8 *pubkey, U16 pubkeyLen, char *keyFilepath)
 {
     int i, j;
-    U16 retCode = 0;
-    U8 pubkey[4098];
-    U16 pubkeyLen = sizeof(pubkey);
     EC_GROUP *group = NULL;
     EC_POINT *pub_key = NULL;
     int key_field_len;
@@ -94,53 +94,49 @@ static int getReferenceKey(int keyIndex, int storageClass, char *keyFilepath)
     BIO *out = NULL;
     U8 privKey[96];
     U16 privKeyLen;
-
-    retCode = A71_GetPublicKeyEccKeyPair(0, pubkey, &pubkeyLen);
-    if ( retCode != SW_OK ) {
-        printf("Failed to get public key: %d\n", (int)retCode);
-        return 1;
-    } else {
-        if ( dbgPrint == 1) printf("Public key length: %d\n", (int)pubkeyLen);
-        printDataAsHex(pubkey, pubkeyLen);
-
-        eckey = EC_KEY_new();
-        group = EC_GROUP_new_by_curve_name(nid);
-        EC_KEY_set_group(eckey, group);
-        key_field_len = (EC_GROUP_get_degree(group)+7)/8;
-        EC_KEY_generate_key(eckey);
-        privKeyLen = (U16)BN_bn2bin( EC_KEY_get0_private_key(eckey), privKey);
-        privKey[privKeyLen-1] = keyIndex;
-        privKey[privKeyLen-2] = storageClass;
-        for (j=0; j<2; j++) {
-            for (i=3; i<7; i++) {
-                privKey[privKeyLen-i-(j*4)] = (U8)(0xA5A6B5B6 >> 8*(i-3));
-            }
+    int rc = 0;
+
+    if ( dbgPrint == 1) printf("Public key length: %d\n", (int)pubkeyLen);
+    printDataAsHex(pubkey, pubkeyLen);
+
+    eckey = EC_KEY_new();
+    group = EC_GROUP_new_by_curve_name(nid);
+    EC_KEY_set_group(eckey, group);
+    key_field_len = (EC_GROUP_get_degree(group)+7)/8;
+    EC_KEY_generate_key(eckey);
+    privKeyLen = (U16)BN_bn2bin( EC_KEY_get0_private_key(eckey), privKey);
+    privKey[privKeyLen-1] = keyIndex;
+    privKey[privKeyLen-2] = storageClass;
+    for (j=0; j<2; j++) {
+        for (i=3; i<7; i++) {
+            privKey[privKeyLen-i-(j*4)] = (U8)(0xA5A6B5B6 >> 8*(i-3));
         }
-        privKey[0] = 0x10;
-        for (i=11; i<(privKeyLen); i++) { privKey[privKeyLen-i] = 0x00; }
-        bn_priv = BN_bin2bn(privKey, privKeyLen, NULL);
-        EC_KEY_set_private_key(eckey, bn_priv);
-        X = BN_bin2bn(&pubkey[1], key_field_len, NULL);
-        Y = BN_bin2bn(&pubkey[1+key_field_len], key_field_len, NULL);
-        pub_key = EC_POINT_new(group);
-        EC_POINT_set_affine_coordinates_GFp(group, pub_key, X, Y, NULL);
-        EC_KEY_set_public_key(eckey, pub_key);
-        EC_KEY_set_asn1_flag(eckey, nid);
-        out = BIO_new(BIO_s_file());
-        BIO_write_filename(out, (void *)keyFilepath);
-        if (!PEM_write_bio_ECPrivateKey(out, eckey, NULL, NULL, 0, NULL, NULL)) {
-            printf("Unable to write Key\n");
-        }
-
-        EC_POINT_free(pub_key);
-        EC_GROUP_free(group);
-        BN_free(X);
-        BN_free(Y);
-        BIO_vfree(out);
-        EC_KEY_free(eckey);
     }
+    privKey[0] = 0x10;
+    for (i=11; i<(privKeyLen); i++) { privKey[privKeyLen-i] = 0x00; }
+    bn_priv = BN_bin2bn(privKey, privKeyLen, NULL);
+    EC_KEY_set_private_key(eckey, bn_priv);
+    X = BN_bin2bn(&pubkey[1], key_field_len, NULL);
+    Y = BN_bin2bn(&pubkey[1+key_field_len], key_field_len, NULL);
+    pub_key = EC_POINT_new(group);
+    EC_POINT_set_affine_coordinates_GFp(group, pub_key, X, Y, NULL);
+    EC_KEY_set_public_key(eckey, pub_key);
+    EC_KEY_set_asn1_flag(eckey, nid);
+    out = BIO_new(BIO_s_file());
+    BIO_write_filename(out, (void *)keyFilepath);
+    if (!PEM_write_bio_ECPrivateKey(out, eckey, NULL, NULL, 0, NULL, NULL)) {
+        printf("Unable to write Key\n");
+        rc = 1;
+    }
+
+    EC_POINT_free(pub_key);
+    EC_GROUP_free(group);
+    BN_free(X);
+    BN_free(Y);
+    BIO_vfree(out);
+    EC_KEY_free(eckey);
 
-    return 0;
+    return rc;
 }
 
 /* Get certificate file size */
@@ -168,6 +164,82 @@ static U16 GetFileSize(U8* data)
     return dataLen;
 }
 
+/* Certificate file path of device (index 0) or gateway (index 1) certificate */
+static void getCertFilePath(char *filePath, char *certDir, char *deviceId, int index)
+{
+    if ( index == 0 ) {
+        sprintf(filePath, "%s/%s_device_ec_pem.crt", certDir, deviceId);
+    } else {
+        sprintf(filePath, "%s/%s_gateway_ec_pem.crt", certDir, deviceId);
+    }
+}
+
+/* Fingerprint of SE content the certificate files are derived from, empty if it can't be computed */
+static void getCacheFingerprint(char *deviceId, U8 *gpDir, U16 gpDirLen, U8 *pubkey, U16 pubkeyLen, char *fingerprint)
+{
+    size_t idLen = strlen(deviceId);
+    size_t len = idLen + gpDirLen + pubkeyLen;
+    U8 digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+    U8 *data;
+    unsigned int i;
+
+    fingerprint[0] = '\0';
+    if ( (data = (U8 *)malloc(len)) == NULL )
+        return;
+    memcpy(data, deviceId, idLen);
+    memcpy(data + idLen, gpDir, gpDirLen);
+    memcpy(data + idLen + gpDirLen, pubkey, pubkeyLen);
+
+    if ( EVP_Digest(data, len, digest, &digestLen, EVP_sha256(), NULL) ) {
+        for (i=0; i<digestLen; i++) {
+            sprintf(fingerprint + i * 2, "%02x", digest[i]);
+        }
+    }
+    free(data);
+}
+
+/* Check if the cache matches the fingerprint and the cached files exist */
+static int isCacheValid(char *cachePath, char *fingerprint, char files[][2048], int nFiles)
+{
+    char line[128];
+    char expected[128];
+    FILE *fp;
+    int i;
+
+    if ( fingerprint[0] == '\0' ) return 0;
+    fp = fopen(cachePath, "r");
+    if ( fp == NULL ) return 0;
+    if ( fgets(line, sizeof(line), fp) == NULL ) line[0] = '\0';
+    fclose(fp);
+
+    snprintf(expected, sizeof(expected), "%s %s\n", SE_CACHE_VERSION, fingerprint);
+    if ( strcmp(line, expected) ) return 0;
+
+    for (i=0; i<nFiles; i++) {
+        if ( access(files[i], R_OK) != 0 ) return 0;
+    }
+
+    return 1;
+}
+
+/* Write cache file atomically */
+static void writeCache(char *cachePath, char *fingerprint)
+{
+    char tmpPath[2056];
+    FILE *fp;
+
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", cachePath);
+    fp = fopen(tmpPath, "w");
+    if ( fp == NULL ) return;
+    fprintf(fp, "%s %s\n", SE_CACHE_VERSION, fingerprint);
+    if ( fclose(fp) == 0 ) {
+        rename(tmpPath, cachePath);
+    } else {
+        unlink(tmpPath);
+    }
+}
+
 /* Get Unique ID */
 static char * getDeviceId(void) {
     U8 uid[8096];
@@ -235,6 +307,12 @@ char * a71ch_retrieveCertificatesFromSE(char *certDir)
     int i = 0;
     int devCertIndex = 0;
     int gwCertIndex = 1;
+    U8 pubkey[4098];
+    U16 pubkeyLen = sizeof(pubkey);
+    char fingerprint[SHA256_DIGEST_LENGTH * 2 + 1];
+    char cachePath[2048];
+    char cachedFiles[3][2048];
+    int nCachedFiles = 0;
 
     /* Connect to Security Module */
     retCode = SM_Connect(&commState, Atr, &AtrLen);
@@ -263,7 +341,35 @@ char * a71ch_retrieveCertificatesFromSE(char *certDir)
         goto done;
     }
 
+    /* Get public key of key pair for the reference key */
+    retCode = A71_GetPublicKeyEccKeyPair(0, pubkey, &pubkeyLen);
+    if ( retCode != SW_OK ) {
+        printf("Failed to get public key: %d\n", (int)retCode);
+        goto done;
+    }
+
     noEntries = dataRead[dataReadByteSize - 1];
+    if ( certDir == NULL ) certDir = ".";
+
+    /* Skip reading certificates if SE content is unchanged since the files were written */
+    for ( i=0; i<noEntries; i++) {
+        U8 class = dataRead[dataReadByteSize - 2 - (i + 1) * 6 + 0];
+        U8 index = dataRead[dataReadByteSize - 2 - (i + 1) * 6 + 1];
+        if ( class == OBJECT_CLASS(HLSE_CERTIFICATE) && ((int)index == devCertIndex || (int)index == gwCertIndex) && nCachedFiles < 2 ) {
+            getCertFilePath(cachedFiles[nCachedFiles++], certDir, deviceId, (int)index);
+        }
+    }
+    sprintf(cachedFiles[nCachedFiles++], "%s/%s.ref_key", certDir, deviceId);
+    sprintf(cachePath, "%s/%s.se_cache", certDir, deviceId);
+    getCacheFingerprint(deviceId, dataRead, dataReadByteSize, pubkey, pubkeyLen, fingerprint);
+
+    if ( isCacheValid(cachePath, fingerprint, cachedFiles, nCachedFiles) ) {
+        if ( dbgPrint == 1 ) printf("Using cached certificates for UID: %s\n", deviceId);
+        retCode = 0;
+        goto done;
+    }
+    unlink(cachePath);
+
     for ( i=0; i<noEntries; i++) {
         U8 class = dataRead[dataReadByteSize - 2 - nObj * 6 + 0];
         U8 index = dataRead[dataReadByteSize - 2 - nObj * 6 + 1];
@@ -293,12 +399,7 @@ char * a71ch_retrieveCertificatesFromSE(char *certDir)
                 printDataAsHex(objData, certLength);
 
                 /* Set certificate file path */
-                if ( certDir == NULL ) certDir = ".";
-                if ( (int)index == devCertIndex ) {
-                    sprintf(filePath, "%s/%s_device_ec_pem.crt", certDir, deviceId);
-                } else {
-                    sprintf(filePath, "%s/%s_gateway_ec_pem.crt", certDir, deviceId);
-                }
+                getCertFilePath(filePath, certDir, deviceId, (int)index);
 
                 fl = fopen(filePath, "w+");
                 bio = BIO_new_mem_buf((void *)objData, certLength);
@@ -322,12 +423,14 @@ char * a71ch_retrieveCertificatesFromSE(char *certDir)
     int keyIndex = 0;
     int storageClass = A71CH_SSI_KEY_PAIR;
     sprintf(filePath, "%s/%s.ref_key", certDir, deviceId);
-    retCode = getReferenceKey(keyIndex, storageClass, filePath);
+    retCode = getReferenceKey(keyIndex, storageClass, pubkey, pubkeyLen, filePath);
     if (retCode != SUCCESS) {
         printf("Failed to retrieve reference key.\n");
         goto done;
     }
 
+    if ( fingerprint[0] != '\0' ) writeCache(cachePath, fingerprint);
+
 done:
     if ( AtrLen > 0 ) {
         SM_Close(SMCOM_CLOSE_MODE_STD);
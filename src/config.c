@@ -27,6 +27,19 @@
 static int get_config(char * filename, Config * configstr);
 void freeConfig(Config *cfg);
 
+/* Start timing of startup phases */
+static void initStartupTimings(iotfclient *client)
+{
+    client->initMs = monotonicMs();
+    client->timings.configMs = -1;
+    client->timings.seCertMs = -1;
+    client->timings.clientCreateMs = -1;
+    client->timings.dnsMs = -1;
+    client->timings.connectMs = -1;
+    client->timings.totalConnectMs = -1;
+    client->timings.firstPublishMs = -1;
+}
+
 /**
  * Function used to initialize the IBM Watson IoT client using the config file which is
  * generated when you register your device.
@@ -41,7 +54,10 @@ int initialize_configfile(iotfclient  *client, char *configFilePath, int isGatew
 {
     LOG(TRACE, "entry::");
 
-    Config configstr = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1883, 0, 0, 0};
+    Config configstr = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1883, 0, 0, 0};
+
+    memset((void *)client, 0, sizeof(iotfclient));
+    initStartupTimings(client);
 
     int rc = get_config(configFilePath, &configstr);
     if (rc != 0) {
@@ -108,6 +124,7 @@ int initialize_configfile(iotfclient  *client, char *configFilePath, int isGatew
     }
 
     client->cfg = configstr;
+    client->timings.configMs = (long)(monotonicMs() - client->initMs);
 
 exit:
     LOG(TRACE,"exit:: rc=%d", rc);
@@ -142,9 +159,12 @@ int initialize(iotfclient  *client, char *orgId, char* domainName, char *deviceT
 {
     LOG(TRACE, "entry::");
 
-    Config configstr = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1883, 0, 0, 0};
+    Config configstr = {NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 1883, 0, 0, 0};
     int rc = 0;
 
+    memset((void *)client, 0, sizeof(iotfclient));
+    initStartupTimings(client);
+
     LOG(DEBUG, "org=%s, domain=%s, type=%s, id=%s, token= s, useCerts=%d, serverCertPath=%s useNXPEngine=%d useCertsFromSE=%d",
                orgId,domainName,deviceType,deviceId,authToken,useCerts,serverCertPath,useNXPEngine,useCertsFromSE);
 
@@ -238,6 +258,7 @@ int initialize(iotfclient  *client, char *orgId, char* domainName, char *deviceT
     }
 
     client->cfg = configstr;
+    client->timings.configMs = (long)(monotonicMs() - client->initMs);
 
 exit:
     LOG(TRACE,"exit:: rc=%d", rc);
@@ -355,6 +376,12 @@ static int get_config(char * filename, Config * configstr)
                 LOG(INFO, "clientKeyPath=%s", configstr->clientKeyPath);
             }
 
+        } else if (strcasecmp(prop, "endpoints") == 0){
+            if(strlen(value) > 1) {
+                strCopy(&configstr->endpoints, value);
+                LOG(INFO, "endpoints=%s", configstr->endpoints);
+            }
+
         } else if (strcasecmp(prop,"useClientCertificates") == 0){
             configstr->useClientCertificates = value[0] - '0';
             LOG(INFO, "useClientCertificates=%d", configstr->useClientCertificates);
@@ -392,6 +419,7 @@ void freeConfig(Config *cfg)
     freePtr(cfg->rootCACertPath);
     freePtr(cfg->clientCertPath);
     freePtr(cfg->clientKeyPath);
+    freePtr(cfg->endpoints);
 
     LOG(TRACE, "exit::");
 }
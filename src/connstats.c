@@ -0,0 +1,432 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Connection quality statistics: connects, lost connections and the outage
+ * until reconnected, uptime, uplink throughput, and the round trip time of
+ * QoS 1 and 2 publishes, from the publish call to the delivery callback.
+ *
+ * The delivery callback can run before publishData() learned the token of
+ * its publish, so acknowledgements of unknown tokens are kept in a small
+ * table and matched when the publish is recorded.
+ *
+ * With setConnectionReport(), a thread publishes the statistics as an event
+ * of the client at a fixed interval.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include <MQTTClient.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define CONNSTATS_INFLIGHT      64
+#define CONNSTATS_EARLY_ACKS    8
+#define CONNSTATS_FLAP_SECS     60
+
+typedef struct {
+    int token;
+    long long ms;               /* time of publish, or of acknowledgement for early acks */
+} timedToken;
+
+typedef struct {
+    pthread_mutex_t lock;
+    ConnectionStats stats;
+    long long connectedMs;      /* 0 if not connected                       */
+    long long lostMs;           /* 0 if not lost since last connect         */
+    unsigned long long connectionBytes;
+    timedToken inflight[CONNSTATS_INFLIGHT];
+    int inflightNext;
+    timedToken earlyAcks[CONNSTATS_EARLY_ACKS];
+    int earlyAckNext;
+
+    /* self report */
+    iotfclient *client;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    int intervalSecs;
+    char *eventType;
+} connectionStats;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static connectionStats * getConnectionStatsState(iotfclient *client)
+{
+    connectionStats *cs;
+
+    pthread_mutex_lock(&createLock);
+    cs = (connectionStats *)client->connstats;
+    if ( cs == NULL ) {
+        cs = (connectionStats *)calloc(1, sizeof(connectionStats));
+        if ( cs != NULL ) {
+            pthread_condattr_t attr;
+
+            cs->client = client;
+            cs->stats.lastOutageMs = -1;
+            cs->stats.lastRttMs = -1;
+            cs->stats.minRttMs = -1;
+            pthread_mutex_init(&cs->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&cs->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            client->connstats = cs;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return cs;
+}
+
+/* Add a round trip sample. Called with lock held. */
+static void addRtt(connectionStats *cs, long rttMs)
+{
+    ConnectionStats *st = &cs->stats;
+
+    st->lastRttMs = rttMs;
+    if ( st->rttSamples == 0 )
+        st->avgRttMs = rttMs;
+    else
+        st->avgRttMs = 0.9 * st->avgRttMs + 0.1 * rttMs;
+    if ( st->minRttMs < 0 || rttMs < st->minRttMs )
+        st->minRttMs = rttMs;
+    if ( rttMs > st->maxRttMs )
+        st->maxRttMs = rttMs;
+    st->rttSamples++;
+}
+
+/* Copy statistics with current uptime and throughput. Called with lock held. */
+static void snapshotStats(connectionStats *cs, ConnectionStats *stats)
+{
+    long long now = monotonicMs();
+
+    *stats = cs->stats;
+    if ( cs->connectedMs ) {
+        long long upMs = now - cs->connectedMs;
+        stats->uptimeSecs = (long)(upMs / 1000);
+        stats->totalUptimeSecs += stats->uptimeSecs;
+        if ( upMs > 0 )
+            stats->uplinkBytesPerSec = cs->connectionBytes * 1000.0 / upMs;
+    }
+}
+
+/*
+ * Record the result of connectiotf()
+ */
+void statsConnect(iotfclient *client, int rc)
+{
+    connectionStats *cs = getConnectionStatsState(client);
+    long long now = monotonicMs();
+
+    if ( cs == NULL )
+        return;
+
+    pthread_mutex_lock(&cs->lock);
+    if ( rc != MQTTCLIENT_SUCCESS ) {
+        cs->stats.connectFailures++;
+    } else {
+        cs->stats.connects++;
+        cs->connectedMs = now;
+        cs->connectionBytes = 0;
+        cs->inflightNext = 0;
+        memset(cs->inflight, 0, sizeof(cs->inflight));
+        if ( cs->lostMs ) {
+            ConnectionStats *st = &cs->stats;
+            long outage = (long)(now - cs->lostMs);
+
+            st->lastOutageMs = outage;
+            if ( outage > st->maxOutageMs )
+                st->maxOutageMs = outage;
+            st->reconnects++;
+            st->avgOutageMs += (outage - st->avgOutageMs) / st->reconnects;
+            cs->lostMs = 0;
+            LOG(INFO, "Reconnected after %ld ms outage", outage);
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * Record a lost connection
+ */
+void statsConnectionLost(iotfclient *client)
+{
+    connectionStats *cs = (connectionStats *)client->connstats;
+    long long now = monotonicMs();
+
+    if ( cs == NULL )
+        return;
+
+    pthread_mutex_lock(&cs->lock);
+    if ( cs->connectedMs ) {
+        long upSecs = (long)((now - cs->connectedMs) / 1000);
+
+        cs->stats.disconnects++;
+        cs->stats.totalUptimeSecs += upSecs;
+        if ( upSecs < CONNSTATS_FLAP_SECS )
+            cs->stats.flaps++;
+        cs->connectedMs = 0;
+        cs->lostMs = now;
+        LOG(WARN, "Connection lost after %ld secs: disconnects=%lu flaps=%lu", upSecs, cs->stats.disconnects, cs->stats.flaps);
+    }
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * Record a publish. For QoS 1 and 2, its delivery gives a round trip sample.
+ */
+void statsPublish(iotfclient *client, int rc, int bytes, int qos, int token, long long sentMs)
+{
+    connectionStats *cs = (connectionStats *)client->connstats;
+    int i;
+
+    if ( cs == NULL )
+        return;
+
+    pthread_mutex_lock(&cs->lock);
+    if ( rc != MQTTCLIENT_SUCCESS ) {
+        cs->stats.publishFailures++;
+        goto unlock;
+    }
+
+    cs->stats.messagesSent++;
+    cs->stats.bytesSent += bytes;
+    cs->connectionBytes += bytes;
+    if ( qos == 0 || token == 0 )
+        goto unlock;
+
+    /* already acknowledged */
+    for (i = 0; i < CONNSTATS_EARLY_ACKS; i++) {
+        if ( cs->earlyAcks[i].token == token && cs->earlyAcks[i].ms >= sentMs ) {
+            addRtt(cs, (long)(cs->earlyAcks[i].ms - sentMs));
+            cs->earlyAcks[i].token = 0;
+            goto unlock;
+        }
+    }
+
+    cs->inflight[cs->inflightNext].token = token;
+    cs->inflight[cs->inflightNext].ms = sentMs;
+    cs->inflightNext = (cs->inflightNext + 1) % CONNSTATS_INFLIGHT;
+
+unlock:
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/*
+ * Record delivery of a QoS 1 or 2 publish
+ */
+void statsDelivered(iotfclient *client, int token)
+{
+    connectionStats *cs = (connectionStats *)client->connstats;
+    long long now = monotonicMs();
+    int i;
+
+    if ( cs == NULL || token == 0 )
+        return;
+
+    pthread_mutex_lock(&cs->lock);
+    for (i = 0; i < CONNSTATS_INFLIGHT; i++) {
+        if ( cs->inflight[i].token == token ) {
+            addRtt(cs, (long)(now - cs->inflight[i].ms));
+            cs->inflight[i].token = 0;
+            goto unlock;
+        }
+    }
+    cs->earlyAcks[cs->earlyAckNext].token = token;
+    cs->earlyAcks[cs->earlyAckNext].ms = now;
+    cs->earlyAckNext = (cs->earlyAckNext + 1) % CONNSTATS_EARLY_ACKS;
+
+unlock:
+    pthread_mutex_unlock(&cs->lock);
+}
+
+/* Publish statistics as an event of the client */
+static void publishReport(connectionStats *cs, char *eventType)
+{
+    iotfclient *client = cs->client;
+    ConnectionStats st;
+    char payload[512];
+    int rc;
+
+    pthread_mutex_lock(&cs->lock);
+    snapshotStats(cs, &st);
+    pthread_mutex_unlock(&cs->lock);
+
+    snprintf(payload, sizeof(payload),
+        "{\"d\":{\"uptime\":%ld,\"connects\":%lu,\"connectFailures\":%lu,\"disconnects\":%lu,\"flaps\":%lu,"
+        "\"lastOutageMs\":%ld,\"maxOutageMs\":%ld,\"rttMs\":%ld,\"avgRttMs\":%.1f,\"maxRttMs\":%ld,"
+        "\"messages\":%lu,\"bytes\":%llu,\"bytesPerSec\":%.1f}}",
+        st.uptimeSecs, st.connects, st.connectFailures, st.disconnects, st.flaps,
+        st.lastOutageMs, st.maxOutageMs, st.lastRttMs, st.avgRttMs, st.maxRttMs,
+        st.messagesSent, st.bytesSent, st.uplinkBytesPerSec);
+
+    if ( client->isGateway ) {
+        char topic[strlen(eventType) + strlen(client->cfg.id) + strlen(client->cfg.type) + 32];
+        sprintf(topic, "iot-2/type/%s/id/%s/evt/%s/fmt/json", client->cfg.type, client->cfg.id, eventType);
+        rc = publishData(client, topic, payload, QoS0);
+    } else {
+        char topic[strlen(eventType) + 24];
+        sprintf(topic, "iot-2/evt/%s/fmt/json", eventType);
+        rc = publishData(client, topic, payload, QoS0);
+    }
+    LOG(DEBUG, "Published connection report: rc=%d", rc);
+}
+
+static void * reportThread(void *arg)
+{
+    connectionStats *cs = (connectionStats *)arg;
+
+    pthread_mutex_lock(&cs->lock);
+    while ( !cs->stop ) {
+        struct timespec deadline;
+
+        if ( cs->intervalSecs == 0 ) {
+            pthread_cond_wait(&cs->cond, &cs->lock);
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += cs->intervalSecs;
+        if ( pthread_cond_timedwait(&cs->cond, &cs->lock, &deadline) != ETIMEDOUT || cs->stop )
+            continue;
+
+        /* Only report on a live connection, not into the offline queue */
+        if ( cs->connectedMs && cs->eventType ) {
+            char *eventType = strdup(cs->eventType);
+            pthread_mutex_unlock(&cs->lock);
+            if ( eventType && isConnected(cs->client) )
+                publishReport(cs, eventType);
+            free(eventType);
+            pthread_mutex_lock(&cs->lock);
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+
+    return NULL;
+}
+
+/**
+ * Function used to get the connection statistics.
+ */
+int getConnectionStats(iotfclient *client, ConnectionStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    connectionStats *cs;
+
+    if ( stats == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (cs = getConnectionStatsState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&cs->lock);
+    snapshotStats(cs, stats);
+    pthread_mutex_unlock(&cs->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to enable the periodic connection report.
+ */
+int setConnectionReport(iotfclient *client, int intervalSecs, char *eventType)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    connectionStats *cs;
+
+    if ( intervalSecs < 0 || (intervalSecs > 0 && (eventType == NULL || *eventType == '\0')) ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (cs = getConnectionStatsState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&cs->lock);
+    cs->intervalSecs = intervalSecs;
+    freePtr(cs->eventType);
+    cs->eventType = (intervalSecs > 0) ? strdup(eventType) : NULL;
+    pthread_cond_signal(&cs->cond);
+    pthread_mutex_unlock(&cs->lock);
+
+    if ( intervalSecs > 0 && !cs->threadStarted ) {
+        if ( pthread_create(&cs->thread, NULL, reportThread, cs) != 0 ) {
+            LOG(ERROR, "Failed to start connection report thread");
+            rc = -1;
+            goto exit;
+        }
+        cs->threadStarted = 1;
+    }
+
+    LOG(INFO, "Connection report: intervalSecs=%d eventType=%s", intervalSecs, eventType ? eventType : "");
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop the report thread, before the connection goes away
+ */
+void stopConnectionReport(iotfclient *client)
+{
+    connectionStats *cs = (connectionStats *)client->connstats;
+
+    if ( cs != NULL && cs->threadStarted ) {
+        pthread_mutex_lock(&cs->lock);
+        cs->stop = 1;
+        pthread_cond_signal(&cs->cond);
+        pthread_mutex_unlock(&cs->lock);
+        pthread_join(cs->thread, NULL);
+        cs->threadStarted = 0;
+    }
+}
+
+/*
+ * Free connection statistics
+ */
+void freeConnectionStats(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    connectionStats *cs = (connectionStats *)client->connstats;
+
+    if ( cs != NULL ) {
+        stopConnectionReport(client);
+        pthread_cond_destroy(&cs->cond);
+        pthread_mutex_destroy(&cs->lock);
+        freePtr(cs->eventType);
+        free(cs);
+        client->connstats = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -52,7 +52,7 @@ int publishEvent(iotfclient  *client, char *eventType, char *eventFormat, char*
 
     rc = publishData(client,publishTopic,data,qos);
 
-    if (rc != 0) {
+    if (rc != 0 && rc != QUEUE_FULL) {
  	LOG(WARN, "Connection lost, retry the connection \n");
         retry_connection(client);
         rc = publishData(client,publishTopic,data,qos);
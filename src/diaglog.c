@@ -0,0 +1,505 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Diagnostic log and error codes of a managed device. Entries are kept in a
+ * fixed ring and sent as device management requests by a flush thread, at
+ * most maxPerFlush requests every intervalSecs. An entry equal to a pending
+ * one is coalesced into it, a log entry is sent with its repeat count. When
+ * the ring is full the oldest entry is dropped, and the next flush reports
+ * the number of dropped entries. A burst of errors thus costs a bounded
+ * number of publishes.
+ *
+ * The first entry after an idle interval is sent right away. Entries wait
+ * in the ring while the client is not connected.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+#include "cJSON.h"
+
+#define DIAG_RING_SIZE          32
+#define DIAG_MESSAGE_SIZE       128
+#define DIAG_DATA_SIZE          256
+#define DIAG_FLUSH_SECS         10
+#define DIAG_MAX_PER_FLUSH      5
+
+enum { DIAG_LOG, DIAG_ERRORCODE };
+
+typedef struct {
+    int kind;
+    int severity;
+    int errorCode;
+    unsigned long repeats;
+    time_t timestamp;           /* of the first occurrence */
+    char message[DIAG_MESSAGE_SIZE];
+    char data[DIAG_DATA_SIZE];
+} diagEntry;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    iotfclient *client;
+    diagEntry ring[DIAG_RING_SIZE];
+    int head;
+    int count;
+    unsigned long droppedSinceFlush;
+    int intervalSecs;
+    int maxPerFlush;
+    long long lastFlushMs;
+    DiagStats stats;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+} diagLog;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static diagLog * getDiagLogState(iotfclient *client)
+{
+    diagLog *dl;
+
+    pthread_mutex_lock(&createLock);
+    dl = (diagLog *)client->diaglog;
+    if ( dl == NULL ) {
+        dl = (diagLog *)calloc(1, sizeof(diagLog));
+        if ( dl != NULL ) {
+            pthread_condattr_t attr;
+
+            dl->client = client;
+            dl->intervalSecs = DIAG_FLUSH_SECS;
+            dl->maxPerFlush = DIAG_MAX_PER_FLUSH;
+            dl->lastFlushMs = monotonicMs() - DIAG_FLUSH_SECS * 1000LL;
+            pthread_mutex_init(&dl->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&dl->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            client->diaglog = dl;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return dl;
+}
+
+static diagEntry * ringAt(diagLog *dl, int i)
+{
+    return &dl->ring[(dl->head + i) % DIAG_RING_SIZE];
+}
+
+/* Remove the entries of a kind. Called with lock held. */
+static void removeEntries(diagLog *dl, int kind)
+{
+    int i, n = 0;
+
+    for (i = 0; i < dl->count; i++) {
+        diagEntry *e = ringAt(dl, i);
+        if ( e->kind != kind ) {
+            if ( n != i )
+                *ringAt(dl, n) = *e;
+            n++;
+        }
+    }
+    dl->count = n;
+}
+
+static void * flushThread(void *arg);
+
+/* Coalesce an entry with a pending equal one, or append it. Called with lock held. */
+static int addEntry(diagLog *dl, diagEntry *entry)
+{
+    diagEntry *e;
+    int i;
+
+    dl->stats.added++;
+    for (i = 0; i < dl->count; i++) {
+        e = ringAt(dl, i);
+        if ( e->kind == entry->kind && e->severity == entry->severity && e->errorCode == entry->errorCode &&
+             !strcmp(e->message, entry->message) && !strcmp(e->data, entry->data) ) {
+            e->repeats++;
+            dl->stats.coalesced++;
+            return 0;
+        }
+    }
+
+    if ( dl->count == DIAG_RING_SIZE ) {
+        dl->head = (dl->head + 1) % DIAG_RING_SIZE;
+        dl->count--;
+        dl->droppedSinceFlush++;
+        dl->stats.dropped++;
+    }
+    *ringAt(dl, dl->count) = *entry;
+    dl->count++;
+
+    if ( !dl->threadStarted ) {
+        if ( pthread_create(&dl->thread, NULL, flushThread, dl) != 0 ) {
+            LOG(ERROR, "Failed to start diagnostic flush thread");
+            return -1;
+        }
+        dl->threadStarted = 1;
+    }
+    pthread_cond_signal(&dl->cond);
+
+    return 0;
+}
+
+static void diagResponse(void *context, char *reqId, int rc, char *payload, size_t payloadlen)
+{
+    (void)context;
+    (void)payload;
+    (void)payloadlen;
+
+    if ( rc < 200 || rc > 299 )
+        LOG(WARN, "Diagnostic request %s failed: rc=%d", reqId, rc);
+}
+
+/* Send an entry as a device management request */
+static int sendEntry(iotfclient *client, diagEntry *e, unsigned long dropped)
+{
+    cJSON *d = cJSON_CreateObject();
+    char *data = NULL;
+    int rc = -1;
+
+    if ( d == NULL )
+        return -1;
+
+    if ( e->kind == DIAG_ERRORCODE ) {
+        cJSON_AddNumberToObject(d, "errorCode", e->errorCode);
+    } else {
+        char message[DIAG_MESSAGE_SIZE + 64];
+        char timestamp[32];
+        struct tm tm;
+
+        if ( dropped )
+            snprintf(message, sizeof(message), "%lu diagnostic entries dropped", dropped);
+        else if ( e->repeats )
+            snprintf(message, sizeof(message), "%s (repeated %lu times)", e->message, e->repeats + 1);
+        else
+            snprintf(message, sizeof(message), "%s", e->message);
+        gmtime_r(&e->timestamp, &tm);
+        strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+        cJSON_AddStringToObject(d, "message", message);
+        cJSON_AddStringToObject(d, "timestamp", timestamp);
+        if ( e->data[0] )
+            cJSON_AddStringToObject(d, "data", e->data);
+        cJSON_AddNumberToObject(d, "severity", e->severity);
+    }
+
+    if ( (data = cJSON_PrintUnformatted(d)) != NULL )
+        rc = sendDMRequest(client, e->kind == DIAG_ERRORCODE ? CREATE_DIAG_ERRCODES : ADD_DIAG_LOG,
+                 data, 0, diagResponse, NULL, NULL);
+
+    free(data);
+    cJSON_Delete(d);
+    return rc;
+}
+
+/* Send up to maxPerFlush entries. Called with lock held, returns with lock held. */
+static void flushEntries(diagLog *dl)
+{
+    diagEntry batch[DIAG_MAX_PER_FLUSH * 4];
+    unsigned long dropped = dl->droppedSinceFlush;
+    int n = 0, sent = 0, max = dl->maxPerFlush;
+
+    /* a note on dropped entries takes a place of the batch */
+    if ( dropped ) {
+        memset(&batch[n], 0, sizeof(diagEntry));
+        batch[n].kind = DIAG_LOG;
+        batch[n].severity = DIAG_SEVERITY_WARNING;
+        batch[n].timestamp = time(NULL);
+        n++;
+        dl->droppedSinceFlush = 0;
+    }
+    while ( n < max && dl->count > 0 ) {
+        batch[n++] = *ringAt(dl, 0);
+        dl->head = (dl->head + 1) % DIAG_RING_SIZE;
+        dl->count--;
+    }
+    pthread_mutex_unlock(&dl->lock);
+
+    while ( sent < n ) {
+        if ( sendEntry(dl->client, &batch[sent], (sent == 0) ? dropped : 0) != 0 )
+            break;
+        sent++;
+    }
+
+    pthread_mutex_lock(&dl->lock);
+    dl->stats.sent += sent;
+    if ( sent < n ) {
+        int i;
+
+        /* put back the unsent entries in order, ahead of entries added meanwhile */
+        dl->stats.failed++;
+        for (i = n - 1; i >= sent; i--) {
+            if ( dropped && i == 0 ) {
+                dl->droppedSinceFlush += dropped;
+                continue;
+            }
+            if ( dl->count == DIAG_RING_SIZE ) {
+                dl->droppedSinceFlush++;
+                dl->stats.dropped++;
+                continue;
+            }
+            dl->head = (dl->head + DIAG_RING_SIZE - 1) % DIAG_RING_SIZE;
+            *ringAt(dl, 0) = batch[i];
+            dl->count++;
+        }
+        LOG(WARN, "Diagnostic flush sent %d of %d entries", sent, n);
+    }
+    dl->lastFlushMs = monotonicMs();
+}
+
+static void * flushThread(void *arg)
+{
+    diagLog *dl = (diagLog *)arg;
+
+    pthread_mutex_lock(&dl->lock);
+    while ( !dl->stop ) {
+        struct timespec deadline;
+        long long dueMs;
+
+        if ( dl->count == 0 && dl->droppedSinceFlush == 0 ) {
+            pthread_cond_wait(&dl->cond, &dl->lock);
+            continue;
+        }
+
+        dueMs = dl->lastFlushMs + dl->intervalSecs * 1000LL - monotonicMs();
+        if ( dueMs > 0 ) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += dueMs / 1000;
+            deadline.tv_nsec += (dueMs % 1000) * 1000000L;
+            if ( deadline.tv_nsec >= 1000000000L ) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&dl->cond, &dl->lock, &deadline);
+            continue;
+        }
+
+        /* entries wait in the ring, not in the offline queue */
+        if ( !isConnected(dl->client) ) {
+            dl->lastFlushMs = monotonicMs();
+            continue;
+        }
+        flushEntries(dl);
+    }
+    pthread_mutex_unlock(&dl->lock);
+
+    return NULL;
+}
+
+/**
+ * Function used to add an entry to the diagnostic log.
+ */
+int addDiagLog(iotfclient *client, char *message, char *data, int severity)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    diagLog *dl;
+    diagEntry entry;
+
+    if ( message == NULL || severity < DIAG_SEVERITY_INFO || severity > DIAG_SEVERITY_ERROR ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (dl = getDiagLogState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.kind = DIAG_LOG;
+    entry.severity = severity;
+    entry.timestamp = time(NULL);
+    snprintf(entry.message, sizeof(entry.message), "%s", message);
+    if ( data )
+        snprintf(entry.data, sizeof(entry.data), "%s", data);
+
+    pthread_mutex_lock(&dl->lock);
+    rc = addEntry(dl, &entry);
+    pthread_mutex_unlock(&dl->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to add an error code of the device.
+ */
+int addErrorCode(iotfclient *client, int errorCode)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    diagLog *dl;
+    diagEntry entry;
+
+    if ( (dl = getDiagLogState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    memset(&entry, 0, sizeof(entry));
+    entry.kind = DIAG_ERRORCODE;
+    entry.errorCode = errorCode;
+    entry.timestamp = time(NULL);
+
+    pthread_mutex_lock(&dl->lock);
+    rc = addEntry(dl, &entry);
+    pthread_mutex_unlock(&dl->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/* Drop pending entries of a kind and send the clear request */
+static int clearEntries(iotfclient *client, int kind, char *topic)
+{
+    diagLog *dl = (diagLog *)client->diaglog;
+
+    if ( dl != NULL ) {
+        pthread_mutex_lock(&dl->lock);
+        removeEntries(dl, kind);
+        pthread_mutex_unlock(&dl->lock);
+    }
+
+    return sendDMRequest(client, topic, NULL, 0, diagResponse, NULL, NULL);
+}
+
+/**
+ * Function used to clear the diagnostic log.
+ */
+int clearDiagLog(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = clearEntries(client, DIAG_LOG, CLEAR_DIAG_LOG);
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to clear the error codes.
+ */
+int clearErrorCodes(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = clearEntries(client, DIAG_ERRORCODE, CLEAR_DIAG_ERRCODES);
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the flush rate of diagnostic entries.
+ */
+int setDiagFlushRate(iotfclient *client, int intervalSecs, int maxPerFlush)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    diagLog *dl;
+
+    if ( intervalSecs < 1 || maxPerFlush < 1 || maxPerFlush > DIAG_MAX_PER_FLUSH * 4 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (dl = getDiagLogState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&dl->lock);
+    dl->intervalSecs = intervalSecs;
+    dl->maxPerFlush = maxPerFlush;
+    pthread_cond_signal(&dl->cond);
+    pthread_mutex_unlock(&dl->lock);
+
+    LOG(INFO, "Diagnostic flush rate: intervalSecs=%d maxPerFlush=%d", intervalSecs, maxPerFlush);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the statistics of diagnostic entries.
+ */
+int getDiagStats(iotfclient *client, DiagStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    diagLog *dl;
+
+    if ( stats == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (dl = getDiagLogState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&dl->lock);
+    *stats = dl->stats;
+    stats->pending = dl->count;
+    pthread_mutex_unlock(&dl->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop the flush thread and free the diagnostic entries, before the connection goes away
+ */
+void freeDiagLog(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    diagLog *dl = (diagLog *)client->diaglog;
+
+    if ( dl != NULL ) {
+        if ( dl->threadStarted ) {
+            pthread_mutex_lock(&dl->lock);
+            dl->stop = 1;
+            pthread_cond_signal(&dl->cond);
+            pthread_mutex_unlock(&dl->lock);
+            pthread_join(dl->thread, NULL);
+        }
+        if ( dl->count > 0 )
+            LOG(WARN, "Discarded %d unsent diagnostic entries", dl->count);
+        pthread_cond_destroy(&dl->cond);
+        pthread_mutex_destroy(&dl->lock);
+        free(dl);
+        client->diaglog = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
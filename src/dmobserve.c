@@ -0,0 +1,463 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Observe engine of device management attributes: mgmt.firmware, location,
+ * deviceInfo and metadata. Each attribute keeps its current value and the
+ * value last notified to the platform. A change of an observed attribute
+ * marks it dirty, and a notify thread publishes the dirty attributes of an
+ * interval in one notify message, at most one every minIntervalMs. Of an
+ * object value only the members that changed since the last notify are
+ * sent, like the state of mgmt.firmware alone.
+ *
+ * Values set by the platform, and location updates the device sent itself,
+ * are stored as notified, they are not sent back.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+#include "cJSON.h"
+
+#define OBSERVE_MIN_INTERVAL_MS     1000
+
+static const char *attributeNames[] = { "mgmt.firmware", "location", "deviceInfo", "metadata" };
+
+#define OBSERVE_ATTRIBUTES  (int)(sizeof(attributeNames) / sizeof(attributeNames[0]))
+
+typedef struct {
+    int observed;
+    int dirty;
+    cJSON *value;
+    cJSON *notified;            /* value of the last notify, NULL if none */
+} dmAttribute;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    iotfclient *client;
+    dmAttribute attributes[OBSERVE_ATTRIBUTES];
+    int dirty;                  /* number of dirty attributes */
+    int minIntervalMs;
+    long long lastNotifyMs;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+} dmObserve;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static dmObserve * getObserveState(iotfclient *client)
+{
+    dmObserve *ob;
+
+    pthread_mutex_lock(&createLock);
+    ob = (dmObserve *)client->observe;
+    if ( ob == NULL ) {
+        ob = (dmObserve *)calloc(1, sizeof(dmObserve));
+        if ( ob != NULL ) {
+            pthread_condattr_t attr;
+
+            ob->client = client;
+            ob->minIntervalMs = OBSERVE_MIN_INTERVAL_MS;
+            ob->lastNotifyMs = monotonicMs() - OBSERVE_MIN_INTERVAL_MS;
+            pthread_mutex_init(&ob->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&ob->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            client->observe = ob;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return ob;
+}
+
+static int findAttribute(const char *field)
+{
+    int i;
+
+    for (i = 0; field && i < OBSERVE_ATTRIBUTES; i++) {
+        if ( !strcmp(field, attributeNames[i]) )
+            return i;
+    }
+
+    return -1;
+}
+
+static void setDirty(dmObserve *ob, dmAttribute *a, int dirty)
+{
+    if ( a->dirty != dirty ) {
+        a->dirty = dirty;
+        ob->dirty += dirty ? 1 : -1;
+    }
+}
+
+/* Members of value that differ from notified, or value if not both objects */
+static cJSON * changedMembers(cJSON *value, cJSON *notified)
+{
+    cJSON *changed, *member;
+
+    if ( notified == NULL || !cJSON_IsObject(value) || !cJSON_IsObject(notified) )
+        return cJSON_Duplicate(value, 1);
+
+    if ( (changed = cJSON_CreateObject()) == NULL )
+        return NULL;
+    cJSON_ArrayForEach(member, value) {
+        cJSON *old = cJSON_GetObjectItemCaseSensitive(notified, member->string);
+        if ( old == NULL || !cJSON_Compare(member, old, 1) )
+            cJSON_AddItemToObject(changed, member->string, cJSON_Duplicate(member, 1));
+    }
+
+    return changed;
+}
+
+/*
+ * Build the notify message of the dirty attributes, and take copies of the
+ * values sent. Called with lock held.
+ */
+static char * buildNotify(dmObserve *ob, cJSON **sent)
+{
+    cJSON *root = cJSON_CreateObject();
+    cJSON *d = cJSON_CreateObject();
+    cJSON *fields = cJSON_CreateArray();
+    char *payload = NULL;
+    int i, n = 0;
+
+    if ( root == NULL || d == NULL || fields == NULL ) {
+        cJSON_Delete(root);
+        cJSON_Delete(d);
+        cJSON_Delete(fields);
+        return NULL;
+    }
+    cJSON_AddItemToObject(root, "d", d);
+    cJSON_AddItemToObject(d, "fields", fields);
+
+    for (i = 0; i < OBSERVE_ATTRIBUTES; i++) {
+        dmAttribute *a = &ob->attributes[i];
+        cJSON *field, *changed;
+
+        sent[i] = NULL;
+        if ( !a->dirty || !a->observed || a->value == NULL )
+            continue;
+        changed = changedMembers(a->value, a->notified);
+        if ( changed == NULL || (cJSON_IsObject(changed) && changed->child == NULL) ) {
+            /* changed back to the notified value */
+            cJSON_Delete(changed);
+            setDirty(ob, a, 0);
+            continue;
+        }
+        field = cJSON_CreateObject();
+        cJSON_AddStringToObject(field, "field", attributeNames[i]);
+        cJSON_AddItemToObject(field, "value", changed);
+        cJSON_AddItemToArray(fields, field);
+        sent[i] = cJSON_Duplicate(a->value, 1);
+        setDirty(ob, a, 0);
+        n++;
+    }
+
+    if ( n > 0 )
+        payload = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+
+    return payload;
+}
+
+/* Publish one notify of the dirty attributes. Called with lock held, returns with lock held. */
+static void notifyAttributes(dmObserve *ob)
+{
+    cJSON *sent[OBSERVE_ATTRIBUTES];
+    char *payload = buildNotify(ob, sent);
+    int i, rc = 0;
+
+    ob->lastNotifyMs = monotonicMs();
+    if ( payload == NULL )
+        return;
+
+    pthread_mutex_unlock(&ob->lock);
+    LOG(DEBUG, "Notify observed attributes: %s", payload);
+    rc = publishData(ob->client, NOTIFY, payload, QoS1);
+    free(payload);
+    pthread_mutex_lock(&ob->lock);
+
+    for (i = 0; i < OBSERVE_ATTRIBUTES; i++) {
+        dmAttribute *a = &ob->attributes[i];
+
+        if ( sent[i] == NULL )
+            continue;
+        if ( rc == 0 && a->observed ) {
+            cJSON_Delete(a->notified);
+            a->notified = sent[i];
+        } else {
+            /* sent again with the next notify */
+            cJSON_Delete(sent[i]);
+            if ( a->observed )
+                setDirty(ob, a, 1);
+        }
+    }
+    if ( rc != 0 )
+        LOG(WARN, "Failed to notify observed attributes: rc=%d", rc);
+}
+
+static void * notifyThread(void *arg)
+{
+    dmObserve *ob = (dmObserve *)arg;
+
+    pthread_mutex_lock(&ob->lock);
+    while ( !ob->stop ) {
+        struct timespec deadline;
+        long long dueMs;
+
+        if ( ob->dirty == 0 ) {
+            pthread_cond_wait(&ob->cond, &ob->lock);
+            continue;
+        }
+
+        dueMs = ob->lastNotifyMs + ob->minIntervalMs - monotonicMs();
+        if ( dueMs > 0 ) {
+            clock_gettime(CLOCK_MONOTONIC, &deadline);
+            deadline.tv_sec += dueMs / 1000;
+            deadline.tv_nsec += (dueMs % 1000) * 1000000L;
+            if ( deadline.tv_nsec >= 1000000000L ) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&ob->cond, &ob->lock, &deadline);
+            continue;
+        }
+
+        /* changes wait for the connection, the latest value is sent then */
+        if ( !isConnected(ob->client) ) {
+            ob->lastNotifyMs = monotonicMs();
+            continue;
+        }
+        notifyAttributes(ob);
+    }
+    pthread_mutex_unlock(&ob->lock);
+
+    return NULL;
+}
+
+/*
+ * Store the value of an attribute. With notify, an observed attribute is
+ * notified if it changed, otherwise the value is known to the platform.
+ */
+int storeDMAttribute(iotfclient *client, char *field, cJSON *value, int notify)
+{
+    dmObserve *ob;
+    dmAttribute *a;
+    int i = findAttribute(field);
+
+    if ( i < 0 || value == NULL ) {
+        cJSON_Delete(value);
+        return MISSING_INPUT_PARAM;
+    }
+    if ( (ob = getObserveState(client)) == NULL ) {
+        cJSON_Delete(value);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ob->lock);
+    a = &ob->attributes[i];
+    cJSON_Delete(a->value);
+    a->value = value;
+    if ( !notify ) {
+        cJSON_Delete(a->notified);
+        a->notified = cJSON_Duplicate(value, 1);
+        setDirty(ob, a, 0);
+    } else if ( a->observed && (a->notified == NULL || !cJSON_Compare(value, a->notified, 1)) ) {
+        setDirty(ob, a, 1);
+        if ( !ob->threadStarted ) {
+            if ( pthread_create(&ob->thread, NULL, notifyThread, ob) != 0 ) {
+                LOG(ERROR, "Failed to start observe notify thread");
+            } else {
+                ob->threadStarted = 1;
+            }
+        }
+        pthread_cond_signal(&ob->cond);
+    }
+    pthread_mutex_unlock(&ob->lock);
+
+    return 0;
+}
+
+/*
+ * Observe an attribute. Returns a copy of its current value for the
+ * response, NULL if not set. Returns -1 for an unknown attribute.
+ */
+int observeDMAttribute(iotfclient *client, char *field, cJSON **value)
+{
+    dmObserve *ob;
+    dmAttribute *a;
+    int i = findAttribute(field);
+
+    *value = NULL;
+    if ( i < 0 || (ob = getObserveState(client)) == NULL )
+        return -1;
+
+    pthread_mutex_lock(&ob->lock);
+    a = &ob->attributes[i];
+    a->observed = 1;
+    setDirty(ob, a, 0);
+    if ( a->value ) {
+        /* the response carries the current value */
+        *value = cJSON_Duplicate(a->value, 1);
+        cJSON_Delete(a->notified);
+        a->notified = cJSON_Duplicate(a->value, 1);
+    }
+    pthread_mutex_unlock(&ob->lock);
+
+    LOG(DEBUG, "Observe %s", field);
+    return 0;
+}
+
+/*
+ * Cancel the observation of an attribute, and drop its pending change.
+ * Returns -1 for an unknown attribute.
+ */
+int cancelDMAttribute(iotfclient *client, char *field)
+{
+    dmObserve *ob = (dmObserve *)client->observe;
+    int i = findAttribute(field);
+
+    if ( i < 0 )
+        return -1;
+
+    if ( ob != NULL ) {
+        dmAttribute *a = &ob->attributes[i];
+
+        pthread_mutex_lock(&ob->lock);
+        a->observed = 0;
+        setDirty(ob, a, 0);
+        cJSON_Delete(a->notified);
+        a->notified = NULL;
+        pthread_mutex_unlock(&ob->lock);
+    }
+
+    LOG(DEBUG, "Cancel observe of %s", field);
+    return 0;
+}
+
+/*
+ * Check if an attribute is observed
+ */
+int isDMAttributeObserved(iotfclient *client, char *field)
+{
+    dmObserve *ob = (dmObserve *)client->observe;
+    int i = findAttribute(field);
+    int observed = 0;
+
+    if ( i >= 0 && ob != NULL ) {
+        pthread_mutex_lock(&ob->lock);
+        observed = ob->attributes[i].observed;
+        pthread_mutex_unlock(&ob->lock);
+    }
+
+    return observed;
+}
+
+/**
+ * Function used to set the value of a device management attribute.
+ */
+int setDMAttribute(iotfclient *client, char *field, char *value)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    cJSON *json;
+
+    if ( findAttribute(field) < 0 || value == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (json = cJSON_Parse(value)) == NULL ) {
+        LOG(ERROR, "Value of %s is not valid json", field);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    rc = storeDMAttribute(client, field, json, 1);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the minimum interval between notifications of observed attributes.
+ */
+int setObserveInterval(iotfclient *client, int minIntervalMs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    dmObserve *ob;
+
+    if ( minIntervalMs < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (ob = getObserveState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&ob->lock);
+    ob->minIntervalMs = minIntervalMs;
+    pthread_cond_signal(&ob->cond);
+    pthread_mutex_unlock(&ob->lock);
+
+    LOG(INFO, "Observe notify interval: minIntervalMs=%d", minIntervalMs);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop the notify thread and free the attributes, before the connection goes away
+ */
+void freeDMObserve(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    dmObserve *ob = (dmObserve *)client->observe;
+    int i;
+
+    if ( ob != NULL ) {
+        if ( ob->threadStarted ) {
+            pthread_mutex_lock(&ob->lock);
+            ob->stop = 1;
+            pthread_cond_signal(&ob->cond);
+            pthread_mutex_unlock(&ob->lock);
+            pthread_join(ob->thread, NULL);
+        }
+        for (i = 0; i < OBSERVE_ATTRIBUTES; i++) {
+            cJSON_Delete(ob->attributes[i].value);
+            cJSON_Delete(ob->attributes[i].notified);
+        }
+        pthread_cond_destroy(&ob->cond);
+        pthread_mutex_destroy(&ob->lock);
+        free(ob);
+        client->observe = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
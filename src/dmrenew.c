@@ -0,0 +1,681 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Renewal of manage lifetimes. A device managed with a lifetime, by manage()
+ * or manageGatewayDevice(), is managed again before the lifetime runs out,
+ * at a random point between 75% and 85% of the lifetime, so that devices
+ * managed together do not renew together. A failed renewal is retried with
+ * backoff.
+ *
+ * Renewals are kept in a hash table by device, and in a timer wheel of one
+ * second slots by due time. The thread sleeps until the next occupied slot.
+ * At most maxPerSecond renewals are sent in a second, later ones are spread
+ * over the following seconds. The latency of a renewal is the time from its
+ * request to the response of the platform.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define RENEW_WHEEL_SLOTS       4096
+#define RENEW_MAX_PER_SECOND    5
+#define RENEW_RETRY_SECS        60
+#define RENEW_MAX_RETRY_SECS    900
+
+extern int renewGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, long lifetime, int supports,
+    dmResponseCallback cb, void *context);
+
+/* Renewal of a device, deviceType and deviceId are NULL for the client itself */
+typedef struct renewal {
+    struct renewal *hashNext;
+    struct renewal *slotNext;
+    unsigned long hash;
+    char *deviceType;
+    char *deviceId;
+    long lifetime;
+    unsigned char supports;     /* bit 0 device actions, bit 1 firmware actions */
+    unsigned char inWheel;      /* 0 while the renewal request is pending       */
+    int failures;
+    long long dueMs;
+} renewal;
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    int enabled;
+    int maxPerSecond;
+    unsigned int seed;
+    long long wheelSec;         /* second of the slot the wheel expires next */
+    long long wakeMs;           /* wake up time of the thread, 0 if idle     */
+    long long sentSec;          /* second of the last renewals sent          */
+    int sentInSec;
+    long long spreadSec;        /* second that takes deferred renewals       */
+    int spreadInSec;
+    int count;
+    int inWheel;
+    int nbuckets;               /* power of 2 */
+    renewal **buckets;
+    renewal *wheel[RENEW_WHEEL_SLOTS];
+    double latencySumMs;
+    unsigned long responses;
+    DMRenewalStats stats;
+} renewalScheduler;
+
+/* Context of a pending renewal request */
+typedef struct renewalRequest {
+    struct renewalRequest *next;
+    iotfclient *client;
+    char *deviceType;
+    char *deviceId;
+    long lifetime;
+    int supports;
+    long long sentMs;
+} renewalRequest;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Hash of device type and id */
+static unsigned long renewalHash(const char *deviceType, const char *deviceId)
+{
+    unsigned long h = 5381;
+    const char *p;
+
+    for (p = deviceType ? deviceType : ""; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+    h = (h << 5) + h + '/';
+    for (p = deviceId ? deviceId : ""; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+
+    return h;
+}
+
+static int sameString(const char *a, const char *b)
+{
+    return !strcmp(a ? a : "", b ? b : "");
+}
+
+/* Find renewal of a device. Called with lock held. */
+static renewal * findRenewal(renewalScheduler *rs, const char *deviceType, const char *deviceId, renewal ***prev)
+{
+    unsigned long hash = renewalHash(deviceType, deviceId);
+    renewal **pp;
+
+    if ( rs->nbuckets == 0 )
+        return NULL;
+
+    for (pp = &rs->buckets[hash & (rs->nbuckets - 1)]; *pp; pp = &(*pp)->hashNext) {
+        renewal *r = *pp;
+        if ( r->hash == hash && sameString(r->deviceId, deviceId) && sameString(r->deviceType, deviceType) ) {
+            if ( prev )
+                *prev = pp;
+            return r;
+        }
+    }
+
+    return NULL;
+}
+
+/* Link renewals into a bucket table of nbuckets. Called with lock held. */
+static int rehash(renewalScheduler *rs, int nbuckets)
+{
+    renewal **buckets = (renewal **)calloc(nbuckets, sizeof(renewal *));
+    int i;
+
+    if ( buckets == NULL )
+        return -1;
+
+    for (i = 0; i < rs->nbuckets; i++) {
+        while ( rs->buckets[i] ) {
+            renewal *r = rs->buckets[i];
+            rs->buckets[i] = r->hashNext;
+            r->hashNext = buckets[r->hash & (nbuckets - 1)];
+            buckets[r->hash & (nbuckets - 1)] = r;
+        }
+    }
+    free(rs->buckets);
+    rs->buckets = buckets;
+    rs->nbuckets = nbuckets;
+
+    return 0;
+}
+
+/* Put renewal into the wheel slot of its due time. Called with lock held. */
+static void insertWheel(renewalScheduler *rs, renewal *r, long long dueMs)
+{
+    renewal **slot;
+
+    /* a slot behind the wheel would only expire one round later */
+    if ( dueMs < rs->wheelSec * 1000 )
+        dueMs = rs->wheelSec * 1000;
+    r->dueMs = dueMs;
+    slot = &rs->wheel[(dueMs / 1000) % RENEW_WHEEL_SLOTS];
+    r->slotNext = *slot;
+    *slot = r;
+    r->inWheel = 1;
+    rs->inWheel++;
+
+    if ( rs->wakeMs == 0 || dueMs < rs->wakeMs )
+        pthread_cond_signal(&rs->cond);
+}
+
+/* Take renewal out of its wheel slot. Called with lock held. */
+static void removeWheel(renewalScheduler *rs, renewal *r)
+{
+    renewal **pp;
+
+    if ( !r->inWheel )
+        return;
+
+    for (pp = &rs->wheel[(r->dueMs / 1000) % RENEW_WHEEL_SLOTS]; *pp; pp = &(*pp)->slotNext) {
+        if ( *pp == r ) {
+            *pp = r->slotNext;
+            break;
+        }
+    }
+    r->slotNext = NULL;
+    r->inWheel = 0;
+    rs->inWheel--;
+}
+
+/* Due time of the next renewal, between 75% and 85% of the lifetime. Called with lock held. */
+static long long nextRenewalMs(renewalScheduler *rs, long lifetime, long long nowMs)
+{
+    return nowMs + lifetime * (750LL + rand_r(&rs->seed) % 100);
+}
+
+/* Due time of the retry of a failed renewal. Called with lock held. */
+static long long retryRenewalMs(renewalScheduler *rs, renewal *r, long long nowMs)
+{
+    long secs = RENEW_RETRY_SECS;
+    int i;
+
+    for (i = 1; i < r->failures && secs < RENEW_MAX_RETRY_SECS; i++)
+        secs *= 2;
+    if ( secs > RENEW_MAX_RETRY_SECS )
+        secs = RENEW_MAX_RETRY_SECS;
+
+    return nowMs + secs * 1000LL + rand_r(&rs->seed) % 1000;
+}
+
+static void freeRenewalRequest(renewalRequest *req)
+{
+    free(req->deviceType);
+    free(req->deviceId);
+    free(req);
+}
+
+/* Response of a renewal request, or its timeout */
+static void renewalResponse(void *context, char *reqId, int rc, char *payload, size_t payloadlen)
+{
+    renewalRequest *req = (renewalRequest *)context;
+    renewalScheduler *rs = (renewalScheduler *)req->client->dmrenewal;
+    renewal *r;
+
+    (void)reqId;
+    (void)payload;
+    (void)payloadlen;
+
+    if ( rs != NULL ) {
+        long long now = monotonicMs();
+
+        pthread_mutex_lock(&rs->lock);
+        if ( !rs->stop && (r = findRenewal(rs, req->deviceType, req->deviceId, NULL)) != NULL && !r->inWheel ) {
+            if ( rc == 200 ) {
+                double latency = (double)(now - req->sentMs);
+
+                r->failures = 0;
+                rs->responses++;
+                rs->latencySumMs += latency;
+                rs->stats.lastLatencyMs = latency;
+                rs->stats.avgLatencyMs = rs->latencySumMs / rs->responses;
+                if ( latency > rs->stats.maxLatencyMs )
+                    rs->stats.maxLatencyMs = latency;
+                insertWheel(rs, r, nextRenewalMs(rs, r->lifetime, now));
+            } else {
+                r->failures++;
+                rs->stats.failed++;
+                insertWheel(rs, r, retryRenewalMs(rs, r, now));
+            }
+        }
+        pthread_mutex_unlock(&rs->lock);
+    }
+
+    if ( rc == 200 ) {
+        LOG(DEBUG, "Renewed manage lifetime of device type=%s id=%s in %lld ms", req->deviceType ? req->deviceType : "",
+            req->deviceId ? req->deviceId : "", monotonicMs() - req->sentMs);
+    } else {
+        LOG(WARN, "Failed to renew manage lifetime of device type=%s id=%s: rc=%d",
+            req->deviceType ? req->deviceType : "", req->deviceId ? req->deviceId : "", rc);
+    }
+    freeRenewalRequest(req);
+}
+
+/* Send a renewal request, without lock */
+static int sendRenewal(renewalRequest *req)
+{
+    req->sentMs = monotonicMs();
+
+    if ( req->deviceType == NULL ) {
+        char data[128];
+
+        /* no deviceInfo, the renewal leaves the device attributes as they are */
+        snprintf(data, sizeof(data), "{\"lifetime\":%ld,\"supports\":{\"deviceActions\":%d,\"firmwareActions\":%d}}",
+            req->lifetime, req->supports & 1, (req->supports >> 1) & 1);
+        return sendDMRequest(req->client, MANAGE, data, 0, renewalResponse, req, NULL);
+    }
+
+    return renewGatewayDevice(req->client, req->deviceType, req->deviceId, req->lifetime, req->supports,
+        renewalResponse, req);
+}
+
+/*
+ * Take due renewals of elapsed wheel slots, up to the renewals allowed in this
+ * second. Later renewals are spread over the next seconds. Returns the list of
+ * requests to send. Called with lock held.
+ */
+static renewalRequest * takeDueRenewals(renewalScheduler *rs, long long nowMs)
+{
+    renewalRequest *list = NULL, **tail = &list;
+    renewal *due = NULL, *r;
+    long long nowSec = nowMs / 1000;
+    int budget, connected = isConnected(rs->client);
+
+    if ( rs->wheelSec + RENEW_WHEEL_SLOTS <= nowSec )
+        rs->wheelSec = nowSec - RENEW_WHEEL_SLOTS + 1;
+
+    while ( rs->wheelSec <= nowSec ) {
+        renewal **pp = &rs->wheel[rs->wheelSec % RENEW_WHEEL_SLOTS];
+
+        /* a slot also holds renewals of later rounds of the wheel */
+        while ( *pp ) {
+            r = *pp;
+            if ( r->dueMs <= nowMs ) {
+                *pp = r->slotNext;
+                r->inWheel = 0;
+                rs->inWheel--;
+                r->slotNext = due;
+                due = r;
+            } else {
+                pp = &r->slotNext;
+            }
+        }
+        if ( rs->wheelSec == nowSec )
+            break;
+        rs->wheelSec++;
+    }
+
+    if ( rs->sentSec != nowSec ) {
+        rs->sentSec = nowSec;
+        rs->sentInSec = 0;
+    }
+    budget = rs->maxPerSecond - rs->sentInSec;
+
+    while ( due ) {
+        renewalRequest *req;
+
+        r = due;
+        due = r->slotNext;
+        r->slotNext = NULL;
+
+        if ( !connected ) {
+            /* no renewal while disconnected, try again later */
+            insertWheel(rs, r, retryRenewalMs(rs, r, nowMs));
+            continue;
+        }
+        if ( budget <= 0 ) {
+            /* fill the next seconds up to the rate, after renewals deferred before */
+            if ( rs->spreadSec <= nowSec || rs->spreadInSec >= rs->maxPerSecond ) {
+                rs->spreadSec = rs->spreadSec <= nowSec ? nowSec + 1 : rs->spreadSec + 1;
+                rs->spreadInSec = 0;
+            }
+            rs->spreadInSec++;
+            insertWheel(rs, r, rs->spreadSec * 1000LL + rand_r(&rs->seed) % 1000);
+            rs->stats.deferred++;
+            continue;
+        }
+
+        req = (renewalRequest *)calloc(1, sizeof(renewalRequest));
+        if ( req == NULL || (r->deviceType && (req->deviceType = strdup(r->deviceType)) == NULL) ||
+             (r->deviceId && (req->deviceId = strdup(r->deviceId)) == NULL) ) {
+            LOG(ERROR, "Failed to allocate manage renewal request");
+            if ( req )
+                freeRenewalRequest(req);
+            insertWheel(rs, r, retryRenewalMs(rs, r, nowMs));
+            continue;
+        }
+        req->client = rs->client;
+        req->lifetime = r->lifetime;
+        req->supports = r->supports;
+        *tail = req;
+        tail = &req->next;
+        budget--;
+        rs->sentInSec++;
+        rs->stats.renewals++;
+    }
+
+    return list;
+}
+
+/* Due time of the next renewal in this round of the wheel, 0 if none. Called with lock held. */
+static long long nextWakeMs(renewalScheduler *rs)
+{
+    long long sec, wakeMs = 0;
+    renewal *r;
+
+    if ( rs->inWheel == 0 )
+        return 0;
+
+    for (sec = rs->wheelSec; sec < rs->wheelSec + RENEW_WHEEL_SLOTS && wakeMs == 0; sec++) {
+        for (r = rs->wheel[sec % RENEW_WHEEL_SLOTS]; r; r = r->slotNext) {
+            if ( r->dueMs / 1000 == sec && (wakeMs == 0 || r->dueMs < wakeMs) )
+                wakeMs = r->dueMs;
+        }
+    }
+
+    /* only renewals of later rounds, wake up at the end of this round */
+    return wakeMs ? wakeMs : (rs->wheelSec + RENEW_WHEEL_SLOTS) * 1000;
+}
+
+static void * renewalThread(void *arg)
+{
+    renewalScheduler *rs = (renewalScheduler *)arg;
+
+    pthread_mutex_lock(&rs->lock);
+    while ( !rs->stop ) {
+        struct timespec deadline;
+        renewalRequest *list;
+
+        rs->wakeMs = nextWakeMs(rs);
+        if ( rs->wakeMs == 0 || !rs->enabled ) {
+            rs->wakeMs = 0;
+            pthread_cond_wait(&rs->cond, &rs->lock);
+            continue;
+        }
+
+        if ( monotonicMs() < rs->wakeMs ) {
+            deadline.tv_sec = rs->wakeMs / 1000;
+            deadline.tv_nsec = (rs->wakeMs % 1000) * 1000000;
+            pthread_cond_timedwait(&rs->cond, &rs->lock, &deadline);
+            continue;
+        }
+
+        list = takeDueRenewals(rs, monotonicMs());
+        if ( list ) {
+            pthread_mutex_unlock(&rs->lock);
+            while ( list ) {
+                renewalRequest *req = list;
+                int rc;
+
+                list = req->next;
+                LOG(DEBUG, "Renew manage lifetime of device type=%s id=%s: lifetime=%ld",
+                    req->deviceType ? req->deviceType : "", req->deviceId ? req->deviceId : "", req->lifetime);
+                /* a failed request completes through renewalResponse() */
+                if ( (rc = sendRenewal(req)) != 0 ) {
+                    LOG(WARN, "Failed to send manage renewal: rc=%d", rc);
+                    renewalResponse(req, NULL, rc, NULL, 0);
+                }
+            }
+            pthread_mutex_lock(&rs->lock);
+        }
+    }
+    pthread_mutex_unlock(&rs->lock);
+
+    return NULL;
+}
+
+static renewalScheduler * getRenewalScheduler(iotfclient *client)
+{
+    renewalScheduler *rs;
+
+    pthread_mutex_lock(&createLock);
+    rs = (renewalScheduler *)client->dmrenewal;
+    if ( rs == NULL ) {
+        rs = (renewalScheduler *)calloc(1, sizeof(renewalScheduler));
+        if ( rs != NULL ) {
+            pthread_condattr_t attr;
+
+            rs->client = client;
+            rs->enabled = 1;
+            rs->maxPerSecond = RENEW_MAX_PER_SECOND;
+            rs->seed = (unsigned int)time(NULL) ^ (unsigned int)(size_t)rs;
+            rs->wheelSec = monotonicMs() / 1000;
+            pthread_mutex_init(&rs->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&rs->cond, &attr);
+            pthread_condattr_destroy(&attr);
+
+            if ( pthread_create(&rs->thread, NULL, renewalThread, rs) != 0 ) {
+                LOG(ERROR, "Failed to start manage renewal thread");
+                pthread_cond_destroy(&rs->cond);
+                pthread_mutex_destroy(&rs->lock);
+                free(rs);
+                rs = NULL;
+            } else {
+                rs->threadStarted = 1;
+                client->dmrenewal = rs;
+            }
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return rs;
+}
+
+/* Remove renewal from the table. Called with lock held. */
+static void removeRenewal(renewalScheduler *rs, renewal *r, renewal **prev)
+{
+    removeWheel(rs, r);
+    *prev = r->hashNext;
+    free(r->deviceType);
+    free(r->deviceId);
+    free(r);
+    rs->count--;
+}
+
+/*
+ * Cancel the renewal of the manage lifetime of a device, after its unmanage request
+ */
+void cancelDMRenewal(iotfclient *client, char *deviceType, char *deviceId)
+{
+    renewalScheduler *rs = (renewalScheduler *)client->dmrenewal;
+    renewal *r, **prev;
+
+    if ( rs == NULL )
+        return;
+
+    pthread_mutex_lock(&rs->lock);
+    if ( (r = findRenewal(rs, deviceType, deviceId, &prev)) != NULL ) {
+        removeRenewal(rs, r, prev);
+        rs->stats.scheduled = rs->count;
+    }
+    pthread_mutex_unlock(&rs->lock);
+}
+
+/*
+ * Schedule the renewal of the manage lifetime of a device, after its manage
+ * request. deviceType and deviceId NULL for the client itself. A lifetime of
+ * 0 cancels the renewal.
+ */
+int scheduleDMRenewal(iotfclient *client, char *deviceType, char *deviceId, long lifetime,
+    int supportDeviceActions, int supportFirmwareActions)
+{
+    renewalScheduler *rs;
+    renewal *r, **prev;
+    int rc = 0;
+
+    if ( lifetime <= 0 ) {
+        cancelDMRenewal(client, deviceType, deviceId);
+        return 0;
+    }
+
+    if ( (rs = getRenewalScheduler(client)) == NULL )
+        return -1;
+
+    pthread_mutex_lock(&rs->lock);
+    if ( !rs->enabled )
+        goto unlock;
+
+    if ( (r = findRenewal(rs, deviceType, deviceId, &prev)) != NULL ) {
+        removeWheel(rs, r);
+    } else {
+        if ( (r = (renewal *)calloc(1, sizeof(renewal))) == NULL ||
+             (deviceType && (r->deviceType = strdup(deviceType)) == NULL) ||
+             (deviceId && (r->deviceId = strdup(deviceId)) == NULL) ||
+             (rs->count >= rs->nbuckets && rehash(rs, rs->nbuckets ? rs->nbuckets * 2 : 16) != 0) ) {
+            if ( r ) {
+                free(r->deviceType);
+                free(r->deviceId);
+                free(r);
+            }
+            rc = -1;
+            goto unlock;
+        }
+        r->hash = renewalHash(deviceType, deviceId);
+        r->hashNext = rs->buckets[r->hash & (rs->nbuckets - 1)];
+        rs->buckets[r->hash & (rs->nbuckets - 1)] = r;
+        rs->count++;
+    }
+    r->lifetime = lifetime;
+    r->supports = (supportDeviceActions ? 1 : 0) | (supportFirmwareActions ? 2 : 0);
+    r->failures = 0;
+    insertWheel(rs, r, nextRenewalMs(rs, lifetime, monotonicMs()));
+    rs->stats.scheduled = rs->count;
+
+unlock:
+    pthread_mutex_unlock(&rs->lock);
+    return rc;
+}
+
+/**
+ * Function used to set the options of the manage lifetime renewal.
+ */
+int setDMRenewalOptions(iotfclient *client, int enabled, int maxPerSecond)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    renewalScheduler *rs;
+    int i;
+
+    if ( maxPerSecond < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (rs = getRenewalScheduler(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&rs->lock);
+    rs->enabled = enabled ? 1 : 0;
+    rs->maxPerSecond = maxPerSecond ? maxPerSecond : RENEW_MAX_PER_SECOND;
+    if ( !rs->enabled ) {
+        /* lifetimes managed from now on are not renewed either */
+        for (i = 0; i < rs->nbuckets; i++) {
+            while ( rs->buckets[i] )
+                removeRenewal(rs, rs->buckets[i], &rs->buckets[i]);
+        }
+        rs->stats.scheduled = 0;
+    }
+    pthread_cond_signal(&rs->cond);
+    pthread_mutex_unlock(&rs->lock);
+
+    LOG(INFO, "Manage renewal: enabled=%d maxPerSecond=%d", enabled ? 1 : 0, maxPerSecond);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the statistics of the manage lifetime renewal.
+ */
+int getDMRenewalStats(iotfclient *client, DMRenewalStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    renewalScheduler *rs;
+
+    if ( stats == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (rs = getRenewalScheduler(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&rs->lock);
+    *stats = rs->stats;
+    pthread_mutex_unlock(&rs->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop the renewal thread, before the connection goes away. Responses of
+ * pending renewals are ignored from now on.
+ */
+void stopDMRenewal(iotfclient *client)
+{
+    renewalScheduler *rs = (renewalScheduler *)client->dmrenewal;
+
+    if ( rs != NULL ) {
+        pthread_mutex_lock(&rs->lock);
+        rs->stop = 1;
+        pthread_cond_signal(&rs->cond);
+        pthread_mutex_unlock(&rs->lock);
+        if ( rs->threadStarted ) {
+            pthread_join(rs->thread, NULL);
+            rs->threadStarted = 0;
+        }
+    }
+}
+
+/*
+ * Free the renewal scheduler, after pending DM requests are completed
+ */
+void freeDMRenewal(iotfclient *client)
+{
+    renewalScheduler *rs = (renewalScheduler *)client->dmrenewal;
+    int i;
+
+    if ( rs != NULL ) {
+        stopDMRenewal(client);
+        for (i = 0; i < rs->nbuckets; i++) {
+            while ( rs->buckets[i] )
+                removeRenewal(rs, rs->buckets[i], &rs->buckets[i]);
+        }
+        free(rs->buckets);
+        pthread_cond_destroy(&rs->cond);
+        pthread_mutex_destroy(&rs->lock);
+        free(rs);
+        client->dmrenewal = NULL;
+    }
+}
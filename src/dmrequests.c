@@ -0,0 +1,402 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Correlation of device management requests sent by the device with the
+ * responses of the platform, so several requests can be in flight at once.
+ *
+ * Pending requests are kept in a hash table by reqId, and in a timer wheel
+ * of one second slots by deadline. A thread advances the wheel while
+ * requests are pending; requests without response by their deadline
+ * complete with DM_REQUEST_TIMEOUT.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define DMREQ_BUCKETS           64
+#define DMREQ_WHEEL_SLOTS       64
+#define DMREQ_DEFAULT_TIMEOUT   30
+
+typedef struct dmRequest {
+    struct dmRequest *hashNext;
+    struct dmRequest *slotNext;
+    char reqId[40];
+    long long deadlineMs;
+    dmResponseCallback cb;
+    void *context;
+} dmRequest;
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    int timeoutSecs;
+    int pending;
+    long long wheelSec;         /* second of the slot the wheel expires next */
+    dmRequest *buckets[DMREQ_BUCKETS];
+    dmRequest *wheel[DMREQ_WHEEL_SLOTS];
+} dmRequestTable;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static unsigned int hashReqId(const char *reqId)
+{
+    unsigned int h = 2166136261u;
+
+    while ( *reqId )
+        h = (h ^ (unsigned char)*reqId++) * 16777619u;
+
+    return h % DMREQ_BUCKETS;
+}
+
+/* Unlink request from its hash bucket and wheel slot. Called with lock held. */
+static void unlinkRequest(dmRequestTable *tab, dmRequest *req)
+{
+    dmRequest **pp;
+
+    for (pp = &tab->buckets[hashReqId(req->reqId)]; *pp; pp = &(*pp)->hashNext) {
+        if ( *pp == req ) {
+            *pp = req->hashNext;
+            break;
+        }
+    }
+    for (pp = &tab->wheel[(req->deadlineMs / 1000) % DMREQ_WHEEL_SLOTS]; *pp; pp = &(*pp)->slotNext) {
+        if ( *pp == req ) {
+            *pp = req->slotNext;
+            break;
+        }
+    }
+    tab->pending--;
+}
+
+/* Expire requests of elapsed wheel slots. Returns list of expired requests. Called with lock held. */
+static dmRequest * expireRequests(dmRequestTable *tab, long long nowMs)
+{
+    dmRequest *expired = NULL;
+    long long nowSec = nowMs / 1000;
+
+    while ( tab->wheelSec <= nowSec ) {
+        dmRequest **pp = &tab->wheel[tab->wheelSec % DMREQ_WHEEL_SLOTS];
+
+        /* a slot also holds requests of later rounds of the wheel */
+        while ( *pp ) {
+            dmRequest *req = *pp;
+            if ( req->deadlineMs <= nowMs ) {
+                *pp = req->slotNext;
+                req->slotNext = NULL;
+                unlinkRequest(tab, req);
+                req->hashNext = expired;
+                expired = req;
+            } else {
+                pp = &req->slotNext;
+            }
+        }
+        if ( tab->wheelSec == nowSec )
+            break;
+        tab->wheelSec++;
+    }
+
+    return expired;
+}
+
+/* Complete requests of a list, without lock */
+static void completeList(dmRequest *list, int rc)
+{
+    while ( list ) {
+        dmRequest *req = list;
+        list = req->hashNext;
+        if ( rc == DM_REQUEST_TIMEOUT )
+            LOG(WARN, "DM request timed out: reqId=%s", req->reqId);
+        if ( req->cb )
+            (*req->cb)(req->context, req->reqId, rc, NULL, 0);
+        free(req);
+    }
+}
+
+static void * wheelThread(void *arg)
+{
+    dmRequestTable *tab = (dmRequestTable *)arg;
+
+    pthread_mutex_lock(&tab->lock);
+    while ( !tab->stop ) {
+        struct timespec deadline;
+        dmRequest *expired;
+
+        if ( tab->pending == 0 ) {
+            pthread_cond_wait(&tab->cond, &tab->lock);
+            continue;
+        }
+
+        /* wake up at the start of the next second */
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec++;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&tab->cond, &tab->lock, &deadline);
+        if ( tab->stop )
+            break;
+
+        expired = expireRequests(tab, monotonicMs());
+        if ( expired ) {
+            pthread_mutex_unlock(&tab->lock);
+            completeList(expired, DM_REQUEST_TIMEOUT);
+            pthread_mutex_lock(&tab->lock);
+        }
+    }
+    pthread_mutex_unlock(&tab->lock);
+
+    return NULL;
+}
+
+static dmRequestTable * getRequestTable(iotfclient *client)
+{
+    dmRequestTable *tab;
+
+    pthread_mutex_lock(&createLock);
+    tab = (dmRequestTable *)client->dmrequests;
+    if ( tab == NULL ) {
+        tab = (dmRequestTable *)calloc(1, sizeof(dmRequestTable));
+        if ( tab != NULL ) {
+            pthread_condattr_t attr;
+
+            tab->client = client;
+            tab->timeoutSecs = DMREQ_DEFAULT_TIMEOUT;
+            tab->wheelSec = monotonicMs() / 1000;
+            pthread_mutex_init(&tab->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&tab->cond, &attr);
+            pthread_condattr_destroy(&attr);
+
+            if ( pthread_create(&tab->thread, NULL, wheelThread, tab) != 0 ) {
+                LOG(ERROR, "Failed to start DM request timer thread");
+                pthread_cond_destroy(&tab->cond);
+                pthread_mutex_destroy(&tab->lock);
+                free(tab);
+                tab = NULL;
+            } else {
+                tab->threadStarted = 1;
+                client->dmrequests = tab;
+            }
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return tab;
+}
+
+/*
+ * Add a pending request. timeoutSecs 0 for the default timeout.
+ */
+int addDMRequest(iotfclient *client, char *reqId, int timeoutSecs, dmResponseCallback cb, void *context)
+{
+    dmRequestTable *tab = getRequestTable(client);
+    dmRequest *req;
+    unsigned int b;
+
+    if ( tab == NULL || (req = (dmRequest *)calloc(1, sizeof(dmRequest))) == NULL )
+        return -1;
+
+    snprintf(req->reqId, sizeof(req->reqId), "%s", reqId);
+    req->cb = cb;
+    req->context = context;
+
+    pthread_mutex_lock(&tab->lock);
+    if ( timeoutSecs <= 0 )
+        timeoutSecs = tab->timeoutSecs;
+    req->deadlineMs = monotonicMs() + timeoutSecs * 1000LL;
+    b = hashReqId(req->reqId);
+    req->hashNext = tab->buckets[b];
+    tab->buckets[b] = req;
+    b = (req->deadlineMs / 1000) % DMREQ_WHEEL_SLOTS;
+    req->slotNext = tab->wheel[b];
+    tab->wheel[b] = req;
+    if ( tab->pending++ == 0 ) {
+        tab->wheelSec = monotonicMs() / 1000;
+        pthread_cond_signal(&tab->cond);
+    }
+    pthread_mutex_unlock(&tab->lock);
+
+    return 0;
+}
+
+/* Remove a pending request. Returns it, NULL if not pending. */
+static dmRequest * takeDMRequest(iotfclient *client, char *reqId)
+{
+    dmRequestTable *tab = (dmRequestTable *)client->dmrequests;
+    dmRequest *req;
+
+    if ( tab == NULL || reqId == NULL )
+        return NULL;
+
+    pthread_mutex_lock(&tab->lock);
+    for (req = tab->buckets[hashReqId(reqId)]; req; req = req->hashNext) {
+        if ( !strcmp(req->reqId, reqId) ) {
+            unlinkRequest(tab, req);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tab->lock);
+
+    return req;
+}
+
+/*
+ * Drop a pending request without completing it, if its publish failed
+ */
+void cancelDMRequest(iotfclient *client, char *reqId)
+{
+    free(takeDMRequest(client, reqId));
+}
+
+/*
+ * Complete a pending request with the response of the platform. Returns -1
+ * if the request is not pending, 0 if its callback was called, 1 if the
+ * request has no callback.
+ */
+int completeDMRequest(iotfclient *client, char *reqId, int rc, char *payload, size_t payloadlen)
+{
+    dmRequest *req = takeDMRequest(client, reqId);
+    int ret = 1;
+
+    if ( req == NULL )
+        return -1;
+
+    if ( req->cb ) {
+        (*req->cb)(req->context, req->reqId, rc, payload, payloadlen);
+        ret = 0;
+    }
+    free(req);
+
+    return ret;
+}
+
+/**
+ * Function used to send a device management request.
+ */
+int sendDMRequest(iotfclient *client, char *topic, char *data, int timeoutSecs, dmResponseCallback cb, void *context, char *reqId)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    char uuid_str[40];
+    char *payload;
+
+    if ( topic == NULL || timeoutSecs < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    generateUUID(uuid_str);
+    payload = (char *)malloc((data ? strlen(data) : 0) + 64);
+    if ( payload == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+    if ( data && *data )
+        sprintf(payload, "{\"d\":%s,\"reqId\":\"%s\"}", data, uuid_str);
+    else
+        sprintf(payload, "{\"reqId\":\"%s\"}", uuid_str);
+
+    /* register first, the response can arrive before publishData() returns */
+    if ( addDMRequest(client, uuid_str, timeoutSecs, cb, context) != 0 ) {
+        free(payload);
+        rc = -1;
+        goto exit;
+    }
+
+    LOG(DEBUG, "Send DM request: topic=%s payload=%s", topic, payload);
+    rc = publishData(client, topic, payload, QoS1);
+    free(payload);
+
+    if ( rc != 0 ) {
+        cancelDMRequest(client, uuid_str);
+        LOG(WARN, "Failed to send DM request: topic=%s rc=%d", topic, rc);
+    } else if ( reqId ) {
+        strcpy(reqId, uuid_str);
+    }
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the default timeout of device management requests.
+ */
+int setDMRequestTimeout(iotfclient *client, int timeoutSecs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    dmRequestTable *tab;
+
+    if ( timeoutSecs <= 0 ) {
+        rc = MISSING_INPUT_PARAM;
+    } else if ( (tab = getRequestTable(client)) == NULL ) {
+        rc = -1;
+    } else {
+        pthread_mutex_lock(&tab->lock);
+        tab->timeoutSecs = timeoutSecs;
+        pthread_mutex_unlock(&tab->lock);
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop the timer thread and complete pending requests with CLIENT_DISCONNECTED
+ */
+void freeDMRequests(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    dmRequestTable *tab = (dmRequestTable *)client->dmrequests;
+    dmRequest *pending = NULL;
+    int i;
+
+    if ( tab != NULL ) {
+        pthread_mutex_lock(&tab->lock);
+        tab->stop = 1;
+        pthread_cond_signal(&tab->cond);
+        pthread_mutex_unlock(&tab->lock);
+        if ( tab->threadStarted )
+            pthread_join(tab->thread, NULL);
+
+        for (i = 0; i < DMREQ_BUCKETS; i++) {
+            while ( tab->buckets[i] ) {
+                dmRequest *req = tab->buckets[i];
+                tab->buckets[i] = req->hashNext;
+                req->hashNext = pending;
+                pending = req;
+            }
+        }
+        client->dmrequests = NULL;
+        completeList(pending, CLIENT_DISCONNECTED);
+
+        pthread_cond_destroy(&tab->cond);
+        pthread_mutex_destroy(&tab->lock);
+        free(tab);
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -0,0 +1,345 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Broker endpoints. By default the client connects to the single broker host
+ * built from org and domain. With a list of endpoints in the configuration,
+ * connectiotf() tries all of them in one call, healthiest first, so a failed
+ * endpoint fails over to the next one without waiting for a reconnect delay.
+ *
+ * Health is tracked per endpoint: a moving average of the connect latency,
+ * and a penalty for consecutive failures that halves with time, so a failed
+ * endpoint is tried again once it had time to recover. Endpoints are listed
+ * in order of preference; a later endpoint is preferred only when it is
+ * ENDPOINT_ORDER_BIAS_MS faster, or the ones before have failed recently.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define ENDPOINT_MAX                8
+#define ENDPOINT_ORDER_BIAS_MS      1000
+#define ENDPOINT_FAILURE_PENALTY_MS 30000
+#define ENDPOINT_PENALTY_HALFLIFE   60
+
+typedef struct {
+    char host[256];
+    int port;
+    unsigned long attempts;
+    unsigned long failures;
+    unsigned long failovers;
+    int consecutiveFailures;
+    time_t lastFailure;
+    long lastConnectMs;
+    double avgConnectMs;
+} brokerEndpoint;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int count;
+    brokerEndpoint eps[ENDPOINT_MAX];
+    int active;                 /* endpoint of the current connection, -1 if none */
+    long lastFailoverMs;
+} endpointSet;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Parse "host", "host:port" or "[address]:port" */
+static int parseEndpoint(char *spec, int defaultPort, brokerEndpoint *ep)
+{
+    char *host = spec, *port = NULL, *p;
+
+    if ( *spec == '[' ) {
+        host = spec + 1;
+        if ( (p = strchr(host, ']')) == NULL )
+            return -1;
+        *p++ = '\0';
+        if ( *p == ':' )
+            port = p + 1;
+        else if ( *p != '\0' )
+            return -1;
+    } else if ( (p = strchr(spec, ':')) != NULL && strchr(p + 1, ':') == NULL ) {
+        *p = '\0';
+        port = p + 1;
+    }
+
+    if ( *host == '\0' || strlen(host) >= sizeof(ep->host) )
+        return -1;
+
+    memset(ep, 0, sizeof(brokerEndpoint));
+    strcpy(ep->host, host);
+    ep->port = port ? atoi(port) : defaultPort;
+    ep->lastConnectMs = -1;
+    if ( ep->port <= 0 || ep->port > 65535 )
+        return -1;
+
+    return 0;
+}
+
+static endpointSet * getEndpointSet(iotfclient *client, char *defaultHost, int defaultPort)
+{
+    endpointSet *set;
+
+    pthread_mutex_lock(&createLock);
+    set = (endpointSet *)client->endpoints;
+    if ( set != NULL )
+        goto exit;
+
+    set = (endpointSet *)calloc(1, sizeof(endpointSet));
+    if ( set == NULL )
+        goto exit;
+    pthread_mutex_init(&set->lock, NULL);
+    set->active = -1;
+    set->lastFailoverMs = -1;
+
+    if ( client->cfg.endpoints ) {
+        char *list = strdup(client->cfg.endpoints);
+        char *save = NULL, *tok;
+
+        for (tok = strtok_r(list, ", ", &save); tok && set->count < ENDPOINT_MAX; tok = strtok_r(NULL, ", ", &save)) {
+            if ( parseEndpoint(tok, defaultPort, &set->eps[set->count]) == 0 )
+                set->count++;
+            else
+                LOG(WARN, "Ignoring invalid broker endpoint: %s", tok);
+        }
+        free(list);
+    }
+
+    /* No endpoints configured - use the broker host of the organization */
+    if ( set->count == 0 ) {
+        snprintf(set->eps[0].host, sizeof(set->eps[0].host), "%s", defaultHost);
+        set->eps[0].port = defaultPort;
+        set->eps[0].lastConnectMs = -1;
+        set->count = 1;
+    }
+
+    LOG(INFO, "Broker endpoints: %d", set->count);
+    client->endpoints = set;
+
+exit:
+    pthread_mutex_unlock(&createLock);
+    return set;
+}
+
+/* Lower is healthier */
+static long endpointScore(brokerEndpoint *ep, int index, time_t now)
+{
+    long score = (long)ep->avgConnectMs + (long)index * ENDPOINT_ORDER_BIAS_MS;
+
+    if ( ep->consecutiveFailures > 0 ) {
+        long penalty = (long)ENDPOINT_FAILURE_PENALTY_MS * ep->consecutiveFailures;
+        long halvings = (long)(now - ep->lastFailure) / ENDPOINT_PENALTY_HALFLIFE;
+        score += (halvings >= 31) ? 0 : (penalty >> halvings);
+    }
+
+    return score;
+}
+
+/*
+ * Get endpoints to connect to, healthiest first. Returns the number of
+ * endpoints in order, -1 on allocation failure.
+ */
+int getBrokerEndpoints(iotfclient *client, char *defaultHost, int defaultPort, int *order, int maxOrder)
+{
+    endpointSet *set = getEndpointSet(client, defaultHost, defaultPort);
+    long score[ENDPOINT_MAX];
+    int sorted[ENDPOINT_MAX];
+    time_t now = time(NULL);
+    int i, j, n;
+
+    if ( set == NULL )
+        return -1;
+
+    pthread_mutex_lock(&set->lock);
+    for (i = 0; i < set->count; i++)
+        score[i] = endpointScore(&set->eps[i], i, now);
+
+    /* insertion sort keeps configured order on equal scores */
+    for (i = 0; i < set->count; i++) {
+        for (j = i; j > 0 && score[sorted[j - 1]] > score[i]; j--)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = i;
+    }
+    n = (set->count < maxOrder) ? set->count : maxOrder;
+    memcpy(order, sorted, n * sizeof(int));
+    pthread_mutex_unlock(&set->lock);
+
+    return n;
+}
+
+/*
+ * Get host and port of an endpoint
+ */
+void getEndpointAddress(iotfclient *client, int index, char *host, int hostLen, int *port)
+{
+    endpointSet *set = (endpointSet *)client->endpoints;
+
+    pthread_mutex_lock(&set->lock);
+    snprintf(host, hostLen, "%s", set->eps[index].host);
+    *port = set->eps[index].port;
+    pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * Record the result of a connect attempt to an endpoint. failoverMs is the
+ * time since the first failed attempt of this connect, -1 if none failed.
+ */
+void recordEndpointConnect(iotfclient *client, int index, int rc, long connectMs, long failoverMs)
+{
+    endpointSet *set = (endpointSet *)client->endpoints;
+    brokerEndpoint *ep;
+
+    if ( set == NULL )
+        return;
+
+    pthread_mutex_lock(&set->lock);
+    ep = &set->eps[index];
+    ep->attempts++;
+    if ( rc == 0 ) {
+        ep->consecutiveFailures = 0;
+        if ( ep->lastConnectMs < 0 )
+            ep->avgConnectMs = connectMs;
+        else
+            ep->avgConnectMs = 0.7 * ep->avgConnectMs + 0.3 * connectMs;
+        ep->lastConnectMs = connectMs;
+        if ( failoverMs >= 0 ) {
+            ep->failovers++;
+            set->lastFailoverMs = failoverMs;
+            LOG(INFO, "Failed over to %s:%d in %ld ms", ep->host, ep->port, failoverMs);
+        }
+        set->active = index;
+    } else {
+        ep->failures++;
+        ep->consecutiveFailures++;
+        ep->lastFailure = time(NULL);
+        LOG(WARN, "Connect to %s:%d failed: rc=%d consecutiveFailures=%d", ep->host, ep->port, rc, ep->consecutiveFailures);
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+/*
+ * Count a lost connection as a failure of its endpoint, so the reconnect
+ * prefers another endpoint
+ */
+void recordEndpointLost(iotfclient *client)
+{
+    endpointSet *set = (endpointSet *)client->endpoints;
+
+    if ( set == NULL )
+        return;
+
+    pthread_mutex_lock(&set->lock);
+    if ( set->active >= 0 ) {
+        brokerEndpoint *ep = &set->eps[set->active];
+        ep->failures++;
+        ep->consecutiveFailures++;
+        ep->lastFailure = time(NULL);
+        set->active = -1;
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+/**
+ * Function used to set the broker endpoints.
+ */
+int setBrokerEndpoints(iotfclient *client, char *endpoints)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+
+    if ( client->c != NULL ) {
+        LOG(WARN, "Broker endpoints can not be changed after connect");
+        rc = -1;
+        goto exit;
+    }
+
+    freePtr(client->cfg.endpoints);
+    client->cfg.endpoints = NULL;
+    if ( endpoints && *endpoints )
+        strCopy(&client->cfg.endpoints, endpoints);
+    LOG(INFO, "endpoints=%s", endpoints ? endpoints : "");
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the statistics of the broker endpoints.
+ */
+int getEndpointStats(iotfclient *client, EndpointStats *stats, int *count, long *lastFailoverMs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    endpointSet *set = (endpointSet *)client->endpoints;
+    int i;
+
+    if ( stats == NULL || count == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( lastFailoverMs )
+        *lastFailoverMs = -1;
+    if ( set == NULL ) {
+        *count = 0;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&set->lock);
+    for (i = 0; i < set->count && i < *count; i++) {
+        brokerEndpoint *ep = &set->eps[i];
+        snprintf(stats[i].host, sizeof(stats[i].host), "%s", ep->host);
+        stats[i].port = ep->port;
+        stats[i].attempts = ep->attempts;
+        stats[i].failures = ep->failures;
+        stats[i].failovers = ep->failovers;
+        stats[i].consecutiveFailures = ep->consecutiveFailures;
+        stats[i].lastConnectMs = ep->lastConnectMs;
+        stats[i].avgConnectMs = ep->avgConnectMs;
+        stats[i].connected = (i == set->active);
+    }
+    *count = i;
+    if ( lastFailoverMs )
+        *lastFailoverMs = set->lastFailoverMs;
+    pthread_mutex_unlock(&set->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Free endpoint state
+ */
+void freeBrokerEndpoints(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    endpointSet *set = (endpointSet *)client->endpoints;
+
+    if ( set != NULL ) {
+        pthread_mutex_destroy(&set->lock);
+        free(set);
+        client->endpoints = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -0,0 +1,311 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Firmware delta. A delta rebuilds a firmware image from the installed
+ * (base) image, as created by the firmwareDelta sample:
+ *
+ *   magic "WDELTA01", base size, image size (8 bytes little endian each),
+ *   SHA-256 of the image, then operations:
+ *
+ *   0x01 ADD     varint base offset, varint length, then runs of
+ *                varint unchanged bytes, varint changed bytes, changed
+ *                bytes to add to the base bytes - shifted code differs
+ *                from the base in few bytes
+ *   0x02 INSERT  varint length, bytes
+ *   0x00 END
+ *
+ * The delta is applied in one pass, reading the delta in order and the
+ * base at the offsets of the operations, through fixed buffers. The
+ * rebuilt image is verified with the SHA-256 of the header.
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define DELTA_MAGIC         "WDELTA01"
+#define DELTA_HEADER_SIZE   56
+#define DELTA_BUFSIZE       16384
+
+enum { DELTA_END = 0, DELTA_ADD = 1, DELTA_INSERT = 2 };
+
+typedef struct {
+    FILE *delta;
+    int base;
+    int image;
+    unsigned long long baseSize;
+    unsigned long long imageSize;
+    unsigned long long written;
+    EVP_MD_CTX *sha;
+    EVP_MD_CTX *verify;
+    char baseBuf[DELTA_BUFSIZE];
+    char outBuf[DELTA_BUFSIZE];
+    int outLen;
+} deltaState;
+
+
+static int readVarint(FILE *fp, unsigned long long *value)
+{
+    int shift, ch;
+
+    *value = 0;
+    for (shift = 0; shift < 64; shift += 7) {
+        if ( (ch = getc(fp)) == EOF )
+            return -1;
+        *value |= (unsigned long long)(ch & 0x7f) << shift;
+        if ( !(ch & 0x80) )
+            return 0;
+    }
+
+    return -1;
+}
+
+static unsigned long long getLE64(const unsigned char *p)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 7; i >= 0; i--)
+        v = (v << 8) | p[i];
+
+    return v;
+}
+
+static int flushImage(deltaState *ds)
+{
+    char *p = ds->outBuf;
+
+    while ( ds->outLen > 0 ) {
+        int n = write(ds->image, p, ds->outLen);
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            return -1;
+        }
+        p += n;
+        ds->outLen -= n;
+    }
+
+    return 0;
+}
+
+/* Append to the image, the out buffer has room for n bytes */
+static int emitImage(deltaState *ds, const char *data, int n)
+{
+    EVP_DigestUpdate(ds->sha, data, n);
+    if ( ds->verify )
+        EVP_DigestUpdate(ds->verify, data, n);
+    if ( data != ds->outBuf + ds->outLen )
+        memcpy(ds->outBuf + ds->outLen, data, n);
+    ds->outLen += n;
+    ds->written += n;
+
+    return (ds->outLen == DELTA_BUFSIZE) ? flushImage(ds) : 0;
+}
+
+/* Copy base bytes, adding changed bytes of the delta if changed */
+static int copyBase(deltaState *ds, unsigned long long offset, unsigned long long len, int changed)
+{
+    while ( len > 0 ) {
+        int n = DELTA_BUFSIZE - ds->outLen;
+        char *out = ds->outBuf + ds->outLen;
+        int i;
+
+        if ( (unsigned long long)n > len )
+            n = (int)len;
+        if ( pread(ds->base, out, n, (off_t)offset) != n )
+            return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+        if ( changed ) {
+            for (i = 0; i < n; i++) {
+                int ch = getc(ds->delta);
+                if ( ch == EOF )
+                    return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+                out[i] = (char)(out[i] + ch);
+            }
+        }
+        if ( emitImage(ds, out, n) != 0 )
+            return FIRMWAREUPDATE_OUTOFMEMORY;
+        offset += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static int applyOps(deltaState *ds)
+{
+    unsigned long long offset, len, same, changed;
+    int op, rc;
+
+    for (;;) {
+        if ( (op = getc(ds->delta)) == EOF )
+            return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+
+        switch ( op ) {
+        case DELTA_END:
+            return (ds->written == ds->imageSize) ? 0 : FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+
+        case DELTA_ADD:
+            if ( readVarint(ds->delta, &offset) || readVarint(ds->delta, &len) ||
+                 offset > ds->baseSize || len > ds->baseSize - offset || len > ds->imageSize - ds->written )
+                return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+            while ( len > 0 ) {
+                if ( readVarint(ds->delta, &same) || readVarint(ds->delta, &changed) || same > len || changed > len - same )
+                    return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+                if ( (rc = copyBase(ds, offset, same, 0)) != 0 ||
+                     (rc = copyBase(ds, offset + same, changed, 1)) != 0 )
+                    return rc;
+                offset += same + changed;
+                len -= same + changed;
+            }
+            break;
+
+        case DELTA_INSERT:
+            if ( readVarint(ds->delta, &len) || len > ds->imageSize - ds->written )
+                return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+            while ( len > 0 ) {
+                int n = DELTA_BUFSIZE - ds->outLen;
+                if ( (unsigned long long)n > len )
+                    n = (int)len;
+                if ( fread(ds->outBuf + ds->outLen, 1, n, ds->delta) != (size_t)n )
+                    return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+                if ( emitImage(ds, ds->outBuf + ds->outLen, n) != 0 )
+                    return FIRMWAREUPDATE_OUTOFMEMORY;
+                len -= n;
+            }
+            break;
+
+        default:
+            return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+        }
+    }
+}
+
+/*
+ * Check if a file is a firmware delta
+ */
+int isFirmwareDelta(char *path)
+{
+    char magic[8];
+    FILE *fp = fopen(path, "rb");
+    int delta = 0;
+
+    if ( fp != NULL ) {
+        delta = (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && !memcmp(magic, DELTA_MAGIC, sizeof(magic)));
+        fclose(fp);
+    }
+
+    return delta;
+}
+
+/*
+ * Apply a delta. verify, if not NULL, is updated with the image. Returns 0
+ * or the FIRMWAREUPDATE_* status of the failure.
+ */
+int applyDelta(char *basePath, char *deltaPath, char *imagePath, EVP_MD_CTX *verify)
+{
+    unsigned char header[DELTA_HEADER_SIZE];
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLen = 0;
+    deltaState *ds;
+    struct stat st;
+    int rc = FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+
+    if ( (ds = (deltaState *)calloc(1, sizeof(deltaState))) == NULL )
+        return FIRMWAREUPDATE_OUTOFMEMORY;
+    ds->base = -1;
+    ds->image = -1;
+    ds->verify = verify;
+
+    if ( (ds->delta = fopen(deltaPath, "rb")) == NULL ) {
+        LOG(ERROR, "Failed to open firmware delta %s: errno=%d", deltaPath, errno);
+        goto exit;
+    }
+    if ( fread(header, 1, sizeof(header), ds->delta) != sizeof(header) || memcmp(header, DELTA_MAGIC, 8) ) {
+        LOG(ERROR, "Invalid firmware delta %s", deltaPath);
+        goto exit;
+    }
+    ds->baseSize = getLE64(header + 8);
+    ds->imageSize = getLE64(header + 16);
+
+    if ( (ds->base = open(basePath, O_RDONLY)) < 0 || fstat(ds->base, &st) != 0 ||
+         (unsigned long long)st.st_size != ds->baseSize ) {
+        LOG(ERROR, "Firmware delta does not apply to base image %s", basePath);
+        goto exit;
+    }
+    if ( (ds->image = open(imagePath, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 ) {
+        LOG(ERROR, "Failed to create firmware image %s: errno=%d", imagePath, errno);
+        rc = FIRMWAREUPDATE_OUTOFMEMORY;
+        goto exit;
+    }
+    if ( (ds->sha = EVP_MD_CTX_new()) == NULL || !EVP_DigestInit_ex(ds->sha, EVP_sha256(), NULL) ) {
+        rc = FIRMWAREUPDATE_OUTOFMEMORY;
+        goto exit;
+    }
+
+    if ( (rc = applyOps(ds)) != 0 ) {
+        LOG(ERROR, "Failed to apply firmware delta at %llu bytes: updateStatus=%d", ds->written, rc);
+        goto exit;
+    }
+    if ( flushImage(ds) != 0 || fsync(ds->image) != 0 ) {
+        rc = FIRMWAREUPDATE_OUTOFMEMORY;
+        goto exit;
+    }
+
+    EVP_DigestFinal_ex(ds->sha, digest, &digestLen);
+    if ( digestLen != 32 || memcmp(digest, header + 24, 32) ) {
+        LOG(ERROR, "Firmware image rebuilt from delta does not match its digest");
+        rc = FIRMWAREUPDATE_VERIFICATIONFAILED;
+        goto exit;
+    }
+    LOG(INFO, "Firmware image rebuilt from delta: %llu bytes", ds->written);
+
+exit:
+    if ( ds->delta )
+        fclose(ds->delta);
+    if ( ds->base >= 0 )
+        close(ds->base);
+    if ( ds->image >= 0 ) {
+        close(ds->image);
+        if ( rc != 0 )
+            unlink(imagePath);
+    }
+    if ( ds->sha )
+        EVP_MD_CTX_free(ds->sha);
+    free(ds);
+
+    return rc;
+}
+
+/**
+ * Function used to rebuild a firmware image from a delta.
+ */
+int applyFirmwareDelta(char *basePath, char *deltaPath, char *imagePath)
+{
+    LOG(TRACE, "entry::");
+
+    int rc;
+
+    if ( basePath == NULL || deltaPath == NULL || imagePath == NULL )
+        rc = MISSING_INPUT_PARAM;
+    else
+        rc = applyDelta(basePath, deltaPath, imagePath, NULL);
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
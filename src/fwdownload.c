@@ -0,0 +1,1152 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Firmware download. With a staging path set, a firmware download request
+ * of the platform is served by a download thread, instead of the firmware
+ * download callback.
+ *
+ * The image is streamed over HTTP or HTTPS to "<staging>.part" through a
+ * fixed buffer, so memory does not grow with the image. "<staging>.meta"
+ * keeps the URL, validator and size of the partial image. After a lost
+ * link, the download resumes with a range request from the end of the
+ * partial image, with If-Range so a changed image starts over. Resumes
+ * back off up to FWDL_MAX_BACKOFF secs, the retry count is reset whenever
+ * a transfer made progress. A complete image is renamed to the staging path.
+ *
+ * The digest of the verifier is computed while the image streams, through
+ * EVP so an engine or CPU crypto extensions can accelerate it. Only a
+ * partial image of an earlier run is read back, once, to resume the digest.
+ * An image that does not match the verifier is removed.
+ *
+ * A downloaded firmware delta is applied to the base image, the verifier
+ * is then checked on the rebuilt image.
+ *
+ * The download drives the firmware state of device management: downloading,
+ * downloaded, or idle with the update status of the failure.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define FWDL_BUFSIZE            16384
+#define FWDL_MAX_REDIRECTS      5
+#define FWDL_DEFAULT_RETRIES    10
+#define FWDL_MAX_BACKOFF        60
+#define FWDL_IO_TIMEOUT         30
+
+/* Result of one transfer */
+enum { FETCH_DONE = 0, FETCH_RETRY, FETCH_REDIRECT, FETCH_RESTART, FETCH_FAILED };
+
+typedef struct {
+    int fd;
+    SSL_CTX *ctx;
+    SSL *ssl;
+} fwConnection;
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    int sock;                   /* socket of the transfer, -1 if none, to abort it */
+    char *stagingPath;
+    char *basePath;             /* installed image, base of deltas */
+    int maxBytesPerSec;
+    int maxRetries;
+    char *url;
+    /* verification, md is NULL without verifier */
+    const EVP_MD *md;
+    EVP_MD_CTX *mdctx;
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned int expectedLen;
+    /* transfer */
+    int file;
+    long long offset;
+    long long total;
+    char validator[256];
+    char location[1024];
+    long long sessionStartMs;
+    long long sessionBytes;
+    /* statistics */
+    int active;
+    unsigned long resumes;
+    double bytesPerSec;
+    int error;
+    int verified;
+} fwDownload;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int changeFirmwareDownloadState(int state);
+extern int changeFirmwareUpdateState(int state);
+extern int isFirmwareDelta(char *path);
+extern int applyDelta(char *basePath, char *deltaPath, char *imagePath, EVP_MD_CTX *verify);
+
+
+/* Parse http[s]://host[:port][/path] */
+static int parseUrl(const char *url, int *tls, char *host, int hostLen, char *port, char **path)
+{
+    const char *p, *h, *e;
+    size_t n;
+
+    if ( !strncmp(url, "https://", 8) ) {
+        *tls = 1;
+        h = url + 8;
+    } else if ( !strncmp(url, "http://", 7) ) {
+        *tls = 0;
+        h = url + 7;
+    } else {
+        return -1;
+    }
+
+    *path = strchr(h, '/');
+    e = *path ? *path : h + strlen(h);
+    if ( *h == '[' ) {
+        h++;
+        if ( (p = memchr(h, ']', e - h)) == NULL )
+            return -1;
+        n = p - h;
+        p++;
+    } else {
+        p = memchr(h, ':', e - h);
+        n = (p ? p : e) - h;
+    }
+    if ( n == 0 || n >= (size_t)hostLen )
+        return -1;
+    memcpy(host, h, n);
+    host[n] = '\0';
+
+    if ( p && p < e && *p == ':' && e - p > 1 && e - p < 7 ) {
+        memcpy(port, p + 1, e - p - 1);
+        port[e - p - 1] = '\0';
+    } else {
+        strcpy(port, *tls ? "443" : "80");
+    }
+    if ( *path == NULL )
+        *path = "/";
+
+    return 0;
+}
+
+static void closeConnection(fwDownload *fw, fwConnection *conn)
+{
+    pthread_mutex_lock(&fw->lock);
+    fw->sock = -1;
+    pthread_mutex_unlock(&fw->lock);
+
+    if ( conn->ssl )
+        SSL_free(conn->ssl);
+    if ( conn->ctx )
+        SSL_CTX_free(conn->ctx);
+    if ( conn->fd >= 0 )
+        close(conn->fd);
+    conn->ssl = NULL;
+    conn->ctx = NULL;
+    conn->fd = -1;
+}
+
+static int openConnection(fwDownload *fw, fwConnection *conn, int tls, char *host, char *port)
+{
+    struct addrinfo hints, *res = NULL, *ai;
+    struct timeval tv = { FWDL_IO_TIMEOUT, 0 };
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if ( getaddrinfo(host, port, &hints, &res) != 0 ) {
+        LOG(WARN, "Failed to resolve firmware host %s", host);
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        conn->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if ( conn->fd < 0 )
+            continue;
+        setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if ( connect(conn->fd, ai->ai_addr, ai->ai_addrlen) == 0 )
+            break;
+        close(conn->fd);
+        conn->fd = -1;
+    }
+    freeaddrinfo(res);
+    if ( conn->fd < 0 ) {
+        LOG(WARN, "Failed to connect to firmware host %s:%s: errno=%d", host, port, errno);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    fw->sock = conn->fd;
+    if ( fw->stop )
+        shutdown(conn->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&fw->lock);
+
+    if ( !tls )
+        return 0;
+
+    if ( (conn->ctx = SSL_CTX_new(TLS_client_method())) == NULL )
+        return -1;
+    SSL_CTX_set_verify(conn->ctx, SSL_VERIFY_PEER, NULL);
+    SSL_CTX_set_default_verify_paths(conn->ctx);
+    if ( fw->client->cfg.rootCACertPath && *fw->client->cfg.rootCACertPath )
+        SSL_CTX_load_verify_locations(conn->ctx, fw->client->cfg.rootCACertPath, NULL);
+
+    if ( (conn->ssl = SSL_new(conn->ctx)) == NULL )
+        return -1;
+    SSL_set_fd(conn->ssl, conn->fd);
+    SSL_set_tlsext_host_name(conn->ssl, host);
+    SSL_set1_host(conn->ssl, host);
+    if ( SSL_connect(conn->ssl) != 1 ) {
+        LOG(WARN, "TLS handshake with firmware host %s failed: %s", host,
+            ERR_error_string(ERR_get_error(), NULL));
+        return -1;
+    }
+
+    return 0;
+}
+
+static int connRead(fwConnection *conn, char *buf, int len)
+{
+    if ( conn->ssl )
+        return SSL_read(conn->ssl, buf, len);
+    return recv(conn->fd, buf, len, 0);
+}
+
+static int connWrite(fwConnection *conn, const char *buf, int len)
+{
+    if ( conn->ssl )
+        return SSL_write(conn->ssl, buf, len);
+    return send(conn->fd, buf, len, MSG_NOSIGNAL);
+}
+
+/* Wait for msecs, or until the download is stopped. Returns non zero if stopped. */
+static int waitStop(fwDownload *fw, long long msecs)
+{
+    struct timespec deadline;
+    int stop;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += msecs / 1000;
+    deadline.tv_nsec += (msecs % 1000) * 1000000;
+    if ( deadline.tv_nsec >= 1000000000 ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    while ( !fw->stop && pthread_cond_timedwait(&fw->cond, &fw->lock, &deadline) == 0 )
+        ;
+    stop = fw->stop;
+    pthread_mutex_unlock(&fw->lock);
+
+    return stop;
+}
+
+/*
+ * Set the digest of the verifier, hex of a known digest length or
+ * "<digest>:<hex>". Returns -1 if the verifier is not a digest.
+ */
+static int parseVerifier(fwDownload *fw, const char *verifier)
+{
+    const char *hex = verifier, *sep = strchr(verifier, ':');
+    size_t n, i;
+
+    fw->md = NULL;
+    if ( sep ) {
+        char name[32];
+        if ( (size_t)(sep - verifier) >= sizeof(name) )
+            return -1;
+        memcpy(name, verifier, sep - verifier);
+        name[sep - verifier] = '\0';
+        fw->md = EVP_get_digestbyname(name);
+        hex = sep + 1;
+    }
+
+    n = strlen(hex);
+    if ( fw->md == NULL ) {
+        switch ( n ) {
+        case 32:  fw->md = EVP_md5();    break;
+        case 40:  fw->md = EVP_sha1();   break;
+        case 64:  fw->md = EVP_sha256(); break;
+        case 96:  fw->md = EVP_sha384(); break;
+        case 128: fw->md = EVP_sha512(); break;
+        default:  return -1;
+        }
+    }
+    if ( n != (size_t)EVP_MD_size(fw->md) * 2 ) {
+        fw->md = NULL;
+        return -1;
+    }
+
+    for (i = 0; i < n / 2; i++) {
+        unsigned int byte;
+        if ( !isxdigit((unsigned char)hex[2 * i]) || !isxdigit((unsigned char)hex[2 * i + 1]) ||
+             sscanf(hex + 2 * i, "%2x", &byte) != 1 ) {
+            fw->md = NULL;
+            return -1;
+        }
+        fw->expected[i] = (unsigned char)byte;
+    }
+    fw->expectedLen = n / 2;
+
+    return 0;
+}
+
+/* Truncate the partial image, to download from the start */
+static int restartImage(fwDownload *fw)
+{
+    pthread_mutex_lock(&fw->lock);
+    fw->offset = 0;
+    fw->total = -1;
+    pthread_mutex_unlock(&fw->lock);
+    fw->validator[0] = '\0';
+    if ( fw->md )
+        EVP_DigestInit_ex(fw->mdctx, fw->md, NULL);
+    return ftruncate(fw->file, 0);
+}
+
+/* Digest the partial image of an earlier run. Returns -1 on read error. */
+static int digestPartialImage(fwDownload *fw)
+{
+    char *buf = (char *)malloc(FWDL_BUFSIZE);
+    long long left = fw->offset;
+    int n = 0;
+
+    if ( buf == NULL )
+        return -1;
+    EVP_DigestInit_ex(fw->mdctx, fw->md, NULL);
+    lseek(fw->file, 0, SEEK_SET);
+    while ( left > 0 && (n = read(fw->file, buf, left < FWDL_BUFSIZE ? (int)left : FWDL_BUFSIZE)) > 0 ) {
+        EVP_DigestUpdate(fw->mdctx, buf, n);
+        left -= n;
+    }
+    free(buf);
+
+    return (left == 0) ? 0 : -1;
+}
+
+/* Check the digest of the complete image */
+static int verifyImage(fwDownload *fw)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+
+    EVP_DigestFinal_ex(fw->mdctx, digest, &len);
+    if ( len != fw->expectedLen || memcmp(digest, fw->expected, len) != 0 )
+        return -1;
+
+    return 0;
+}
+
+static void saveMeta(fwDownload *fw)
+{
+    char path[strlen(fw->stagingPath) + 6];
+    FILE *fp;
+
+    sprintf(path, "%s.meta", fw->stagingPath);
+    if ( (fp = fopen(path, "w")) != NULL ) {
+        fprintf(fp, "%s\n%s\n%lld\n", fw->url, fw->validator, fw->total);
+        fclose(fp);
+    }
+}
+
+/* Resume offset of the partial image of the URL, 0 if none */
+static void loadMeta(fwDownload *fw)
+{
+    char path[strlen(fw->stagingPath) + 6];
+    char url[1024], validator[sizeof(fw->validator)];
+    long long total;
+    struct stat st;
+    FILE *fp;
+
+    fw->offset = 0;
+    fw->total = -1;
+    fw->validator[0] = '\0';
+
+    sprintf(path, "%s.meta", fw->stagingPath);
+    if ( (fp = fopen(path, "r")) == NULL )
+        return;
+    if ( fgets(url, sizeof(url), fp) && fgets(validator, sizeof(validator), fp) &&
+         fscanf(fp, "%lld", &total) == 1 ) {
+        url[strcspn(url, "\n")] = '\0';
+        validator[strcspn(validator, "\n")] = '\0';
+        if ( !strcmp(url, fw->url) && fstat(fw->file, &st) == 0 ) {
+            fw->offset = st.st_size;
+            fw->total = total;
+            strcpy(fw->validator, validator);
+        }
+    }
+    fclose(fp);
+}
+
+/* Find a header of the response, returns its value or NULL */
+static char * findHeader(char *headers, const char *name, char *value, int len)
+{
+    size_t n = strlen(name);
+    char *p, *e;
+
+    for (p = strstr(headers, "\r\n"); p; p = strstr(p, "\r\n")) {
+        p += 2;
+        if ( !strncasecmp(p, name, n) && p[n] == ':' ) {
+            p += n + 1;
+            while ( *p == ' ' || *p == '\t' )
+                p++;
+            e = strstr(p, "\r\n");
+            n = e ? (size_t)(e - p) : strlen(p);
+            if ( n >= (size_t)len )
+                n = len - 1;
+            memcpy(value, p, n);
+            value[n] = '\0';
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+/* Write body data to the partial image, throttled. Returns -1 on write error. */
+static int writeImage(fwDownload *fw, const char *data, int len)
+{
+    long long elapsed;
+    int written = 0;
+
+    if ( fw->md )
+        EVP_DigestUpdate(fw->mdctx, data, len);
+
+    while ( len > 0 ) {
+        int n = write(fw->file, data, len);
+        if ( n < 0 ) {
+            if ( errno == EINTR )
+                continue;
+            LOG(ERROR, "Failed to write firmware image: errno=%d", errno);
+            return -1;
+        }
+        data += n;
+        len -= n;
+        written += n;
+    }
+    fw->sessionBytes += written;
+
+    elapsed = monotonicMs() - fw->sessionStartMs;
+    if ( fw->maxBytesPerSec > 0 ) {
+        long long dueMs = fw->sessionBytes * 1000 / fw->maxBytesPerSec;
+        if ( dueMs > elapsed ) {
+            waitStop(fw, dueMs - elapsed);
+            elapsed = dueMs;
+        }
+    }
+    pthread_mutex_lock(&fw->lock);
+    fw->offset += written;
+    if ( elapsed > 0 )
+        fw->bytesPerSec = fw->sessionBytes * 1000.0 / elapsed;
+    pthread_mutex_unlock(&fw->lock);
+
+    return 0;
+}
+
+/* Size of a chunk size line: hex digits, then an optional extension. -1 if invalid. */
+static long long parseChunkSize(const char *line)
+{
+    long long size = 0;
+    int digits = 0;
+    const char *p;
+
+    for (p = line; isxdigit((unsigned char)*p); p++) {
+        if ( ++digits > 15 )
+            return -1;
+        size = size * 16 + (isdigit((unsigned char)*p) ? *p - '0' : tolower((unsigned char)*p) - 'a' + 10);
+    }
+    if ( digits == 0 || (*p != '\0' && *p != '\r' && *p != ';' && *p != ' ' && *p != '\t') )
+        return -1;
+
+    return size;
+}
+
+/*
+ * Stream the body to the partial image. buf holds len bytes of the body
+ * read with the headers. contentLen is -1 if not known.
+ */
+static int readBody(fwDownload *fw, fwConnection *conn, char *buf, int len, int chunked, long long contentLen)
+{
+    long long chunkLeft = 0;
+    long long remaining = contentLen;
+    int lineLen = 0;
+    char line[32];
+    int readSize = FWDL_BUFSIZE;
+
+    /* small reads keep a throttled transfer smooth */
+    if ( fw->maxBytesPerSec > 0 && fw->maxBytesPerSec / 4 < readSize )
+        readSize = (fw->maxBytesPerSec / 4 > 512) ? fw->maxBytesPerSec / 4 : 512;
+
+    for (;;) {
+        char *p = buf;
+
+        while ( len > 0 ) {
+            int n;
+
+            if ( chunked && chunkLeft == 0 ) {
+                /* chunk size line, and CRLF after the previous chunk */
+                char ch = *p++;
+                len--;
+                if ( ch != '\n' ) {
+                    if ( lineLen < (int)sizeof(line) - 1 )
+                        line[lineLen++] = ch;
+                    continue;
+                }
+                line[lineLen] = '\0';
+                if ( lineLen == 0 || (lineLen == 1 && line[0] == '\r') ) {
+                    lineLen = 0;
+                    continue;
+                }
+                lineLen = 0;
+                if ( (chunkLeft = parseChunkSize(line)) < 0 ) {
+                    LOG(ERROR, "Invalid firmware chunk size: %s", line);
+                    fw->error = FIRMWAREUPDATE_INVALIDURL;
+                    return FETCH_FAILED;
+                }
+                if ( chunkLeft == 0 )
+                    return FETCH_DONE;
+                continue;
+            }
+
+            n = len;
+            if ( chunked && n > chunkLeft )
+                n = (int)chunkLeft;
+            if ( !chunked && remaining >= 0 && n > remaining )
+                n = (int)remaining;
+            if ( writeImage(fw, p, n) != 0 ) {
+                fw->error = FIRMWAREUPDATE_OUTOFMEMORY;
+                return FETCH_FAILED;
+            }
+            p += n;
+            len -= n;
+            if ( chunked )
+                chunkLeft -= n;
+            else if ( remaining >= 0 && (remaining -= n) == 0 )
+                return FETCH_DONE;
+        }
+
+        if ( fw->stop )
+            return FETCH_RETRY;
+        len = connRead(conn, buf, readSize);
+        if ( len <= 0 ) {
+            /* a body delimited by close is complete at close */
+            if ( len == 0 && !chunked && remaining < 0 )
+                return FETCH_DONE;
+            LOG(WARN, "Firmware download interrupted at %lld bytes", fw->offset);
+            return FETCH_RETRY;
+        }
+    }
+}
+
+/* One request for the image from the current offset */
+static int fetchImage(fwDownload *fw, const char *url)
+{
+    fwConnection conn = { -1, NULL, NULL };
+    char host[256], port[8], *path;
+    char value[1024];
+    char *buf = NULL, *body;
+    int tls, len = 0, n, status, chunked, rc = FETCH_RETRY;
+    long long contentLen = -1;
+
+    if ( parseUrl(url, &tls, host, sizeof(host), port, &path) != 0 ) {
+        LOG(ERROR, "Invalid firmware URL: %s", url);
+        fw->error = FIRMWAREUPDATE_INVALIDURL;
+        return FETCH_FAILED;
+    }
+
+    if ( (buf = (char *)malloc(FWDL_BUFSIZE + 1)) == NULL ) {
+        fw->error = FIRMWAREUPDATE_OUTOFMEMORY;
+        return FETCH_FAILED;
+    }
+
+    if ( openConnection(fw, &conn, tls, host, port) != 0 )
+        goto exit;
+
+    len = snprintf(buf, FWDL_BUFSIZE, "GET %s HTTP/1.1\r\nHost: %s%s%s\r\nUser-Agent: iotf-embeddedc\r\nConnection: close\r\n",
+        path, host, (!strcmp(port, tls ? "443" : "80")) ? "" : ":", (!strcmp(port, tls ? "443" : "80")) ? "" : port);
+    if ( fw->offset > 0 ) {
+        len += snprintf(buf + len, FWDL_BUFSIZE - len, "Range: bytes=%lld-\r\n", fw->offset);
+        if ( fw->validator[0] )
+            len += snprintf(buf + len, FWDL_BUFSIZE - len, "If-Range: %s\r\n", fw->validator);
+    }
+    len += snprintf(buf + len, FWDL_BUFSIZE - len, "\r\n");
+    if ( len >= FWDL_BUFSIZE || connWrite(&conn, buf, len) != len ) {
+        LOG(WARN, "Failed to send firmware request to %s", host);
+        goto exit;
+    }
+
+    /* read the response headers */
+    len = 0;
+    body = NULL;
+    while ( body == NULL ) {
+        if ( len >= FWDL_BUFSIZE ) {
+            LOG(WARN, "Firmware response headers too large");
+            goto exit;
+        }
+        if ( (n = connRead(&conn, buf + len, FWDL_BUFSIZE - len)) <= 0 )
+            goto exit;
+        len += n;
+        buf[len] = '\0';
+        body = strstr(buf, "\r\n\r\n");
+    }
+    body[2] = '\0';
+    body += 4;
+    len -= body - buf;
+
+    if ( sscanf(buf, "HTTP/%*s %d", &status) != 1 ) {
+        LOG(WARN, "Invalid firmware response");
+        goto exit;
+    }
+    LOG(DEBUG, "Firmware response: status=%d offset=%lld", status, fw->offset);
+
+    if ( findHeader(buf, "Content-Length", value, sizeof(value)) )
+        contentLen = strtoll(value, NULL, 10);
+
+    if ( status == 301 || status == 302 || status == 303 || status == 307 || status == 308 ) {
+        if ( findHeader(buf, "Location", value, sizeof(value)) == NULL ) {
+            fw->error = FIRMWAREUPDATE_INVALIDURL;
+            rc = FETCH_FAILED;
+        } else if ( value[0] == '/' ) {
+            n = snprintf(fw->location, sizeof(fw->location), "%s://%s%s%s:%s", tls ? "https" : "http",
+                strchr(host, ':') ? "[" : "", host, strchr(host, ':') ? "]" : "", port);
+            if ( n > 0 && n < (int)sizeof(fw->location) )
+                memcpy(fw->location + n, value, strnlen(value, sizeof(fw->location) - n - 1) + 1);
+            fw->location[sizeof(fw->location) - 1] = '\0';
+            rc = FETCH_REDIRECT;
+        } else if ( tls && strncmp(value, "https://", 8) ) {
+            /* an image from https must not continue unauthenticated */
+            LOG(ERROR, "Firmware redirect from https refused: %s", value);
+            fw->error = FIRMWAREUPDATE_INVALIDURL;
+            rc = FETCH_FAILED;
+        } else {
+            snprintf(fw->location, sizeof(fw->location), "%s", value);
+            rc = FETCH_REDIRECT;
+        }
+        goto exit;
+    }
+
+    if ( status == 416 ) {
+        /* nothing left after offset, or the image got smaller */
+        long long total = -1;
+        if ( findHeader(buf, "Content-Range", value, sizeof(value)) && strchr(value, '/') )
+            total = strtoll(strchr(value, '/') + 1, NULL, 10);
+        if ( total >= 0 && total == fw->offset ) {
+            fw->total = total;
+            rc = FETCH_DONE;
+        } else {
+            rc = (restartImage(fw) == 0) ? FETCH_RESTART : FETCH_FAILED;
+        }
+        goto exit;
+    }
+
+    if ( status >= 500 ) {
+        LOG(WARN, "Firmware server error: status=%d", status);
+        goto exit;
+    }
+    if ( status != 200 && status != 206 ) {
+        LOG(ERROR, "Firmware download failed: status=%d url=%s", status, url);
+        fw->error = FIRMWAREUPDATE_INVALIDURL;
+        rc = FETCH_FAILED;
+        goto exit;
+    }
+
+    if ( status == 206 ) {
+        long long start = -1;
+        if ( findHeader(buf, "Content-Range", value, sizeof(value)) ) {
+            sscanf(value, "bytes %lld-", &start);
+            if ( strchr(value, '/') && strchr(value, '/')[1] != '*' )
+                fw->total = strtoll(strchr(value, '/') + 1, NULL, 10);
+        }
+        if ( start != fw->offset ) {
+            LOG(WARN, "Firmware range starts at %lld instead of %lld", start, fw->offset);
+            rc = (restartImage(fw) == 0) ? FETCH_RESTART : FETCH_FAILED;
+            goto exit;
+        }
+    } else {
+        /* full image: first request, or the image changed since the partial download */
+        if ( fw->offset > 0 )
+            LOG(INFO, "Firmware image changed or range not supported, download from start");
+        if ( restartImage(fw) != 0 ) {
+            fw->error = FIRMWAREUPDATE_OUTOFMEMORY;
+            rc = FETCH_FAILED;
+            goto exit;
+        }
+        fw->total = contentLen;
+    }
+
+    /* a weak ETag can not validate a range */
+    if ( findHeader(buf, "ETag", fw->validator, sizeof(fw->validator)) == NULL || !strncmp(fw->validator, "W/", 2) ) {
+        if ( findHeader(buf, "Last-Modified", fw->validator, sizeof(fw->validator)) == NULL )
+            fw->validator[0] = '\0';
+    }
+    saveMeta(fw);
+
+    chunked = (findHeader(buf, "Transfer-Encoding", value, sizeof(value)) && strcasestr(value, "chunked"));
+    if ( chunked )
+        contentLen = -1;
+
+    lseek(fw->file, fw->offset, SEEK_SET);
+    memmove(buf, body, len);
+    rc = readBody(fw, &conn, buf, len, chunked, contentLen);
+
+exit:
+    closeConnection(fw, &conn);
+    free(buf);
+    return rc;
+}
+
+/* Install a downloaded image. Returns 0 or the FIRMWAREUPDATE_* status of the failure. */
+static int installImage(fwDownload *fw, char *partPath)
+{
+    if ( fw->md ) {
+        if ( verifyImage(fw) != 0 ) {
+            LOG(ERROR, "Firmware image does not match the verifier");
+            return FIRMWAREUPDATE_VERIFICATIONFAILED;
+        }
+        fw->verified = 1;
+        LOG(INFO, "Firmware image verified");
+    }
+    if ( rename(partPath, fw->stagingPath) != 0 ) {
+        LOG(ERROR, "Failed to store firmware image %s: errno=%d", fw->stagingPath, errno);
+        return FIRMWAREUPDATE_OUTOFMEMORY;
+    }
+
+    return 0;
+}
+
+/* Rebuild the image from a downloaded delta. The verifier is of the image, not of the delta. */
+static int installDelta(fwDownload *fw, char *partPath)
+{
+    char imagePath[strlen(fw->stagingPath) + 5];
+    int rc;
+
+    if ( fw->basePath == NULL ) {
+        LOG(ERROR, "Firmware delta downloaded, but no base image is set");
+        return FIRMWAREUPDATE_UNSUPPORTEDIMAGE;
+    }
+
+    sprintf(imagePath, "%s.new", fw->stagingPath);
+    if ( fw->md )
+        EVP_DigestInit_ex(fw->mdctx, fw->md, NULL);
+    if ( (rc = applyDelta(fw->basePath, partPath, imagePath, fw->md ? fw->mdctx : NULL)) != 0 )
+        return rc;
+
+    if ( fw->md ) {
+        if ( verifyImage(fw) != 0 ) {
+            LOG(ERROR, "Firmware image rebuilt from delta does not match the verifier");
+            unlink(imagePath);
+            return FIRMWAREUPDATE_VERIFICATIONFAILED;
+        }
+        fw->verified = 1;
+    }
+    if ( rename(imagePath, fw->stagingPath) != 0 ) {
+        LOG(ERROR, "Failed to store firmware image %s: errno=%d", fw->stagingPath, errno);
+        unlink(imagePath);
+        return FIRMWAREUPDATE_OUTOFMEMORY;
+    }
+
+    return 0;
+}
+
+/* Download thread */
+static void * downloadThread(void *arg)
+{
+    fwDownload *fw = (fwDownload *)arg;
+    char partPath[strlen(fw->stagingPath) + 6];
+    char metaPath[strlen(fw->stagingPath) + 6];
+    char url[1024];
+    int retries = 0, redirects = 0, rc = FETCH_FAILED;
+    long long before, delayMs;
+
+    sprintf(partPath, "%s.part", fw->stagingPath);
+    sprintf(metaPath, "%s.meta", fw->stagingPath);
+    snprintf(url, sizeof(url), "%s", fw->url);
+
+    changeFirmwareDownloadState(FIRMWARESTATE_DOWNLOADING);
+
+    fw->file = open(partPath, O_RDWR | O_CREAT, 0600);
+    if ( fw->file < 0 ) {
+        LOG(ERROR, "Failed to open firmware staging file %s: errno=%d", partPath, errno);
+        fw->error = FIRMWAREUPDATE_OUTOFMEMORY;
+        goto done;
+    }
+    loadMeta(fw);
+    if ( fw->offset > 0 && fw->md && digestPartialImage(fw) != 0 ) {
+        LOG(WARN, "Failed to read partial firmware image, download from start");
+        fw->offset = 0;
+    }
+    if ( fw->offset == 0 )
+        restartImage(fw);
+    else
+        LOG(INFO, "Resume firmware download at %lld bytes", fw->offset);
+
+    while ( !fw->stop ) {
+        before = fw->offset;
+        fw->sessionStartMs = monotonicMs();
+        fw->sessionBytes = 0;
+
+        rc = fetchImage(fw, url);
+        if ( rc == FETCH_DONE && fw->total >= 0 && fw->offset < fw->total )
+            rc = FETCH_RETRY;
+        if ( rc == FETCH_DONE || rc == FETCH_FAILED )
+            break;
+
+        if ( rc == FETCH_REDIRECT ) {
+            if ( ++redirects > FWDL_MAX_REDIRECTS ) {
+                LOG(ERROR, "Too many firmware redirects");
+                fw->error = FIRMWAREUPDATE_INVALIDURL;
+                rc = FETCH_FAILED;
+                break;
+            }
+            snprintf(url, sizeof(url), "%s", fw->location);
+            LOG(DEBUG, "Firmware redirected to %s", url);
+            continue;
+        }
+        if ( rc == FETCH_RESTART )
+            continue;
+
+        /* lost link: resume from the partial image */
+        if ( fw->offset > before )
+            retries = 0;
+        if ( ++retries > fw->maxRetries ) {
+            LOG(ERROR, "Firmware download failed after %d retries", fw->maxRetries);
+            fw->error = FIRMWAREUPDATE_CONNECTIONLOST;
+            break;
+        }
+        pthread_mutex_lock(&fw->lock);
+        fw->resumes++;
+        pthread_mutex_unlock(&fw->lock);
+        /* resume from the original URL, a redirect may be short lived */
+        snprintf(url, sizeof(url), "%s", fw->url);
+        redirects = 0;
+        delayMs = 1000LL << ((retries - 1 < 6) ? retries - 1 : 6);
+        if ( delayMs > FWDL_MAX_BACKOFF * 1000 )
+            delayMs = FWDL_MAX_BACKOFF * 1000;
+        if ( waitStop(fw, delayMs) )
+            break;
+    }
+
+    if ( rc == FETCH_DONE && !fw->stop && fsync(fw->file) != 0 ) {
+        LOG(ERROR, "Failed to store firmware image %s: errno=%d", partPath, errno);
+        fw->error = FIRMWAREUPDATE_OUTOFMEMORY;
+        rc = FETCH_FAILED;
+    }
+    close(fw->file);
+    fw->file = -1;
+
+    if ( rc == FETCH_DONE && !fw->stop ) {
+        fw->error = isFirmwareDelta(partPath) ? installDelta(fw, partPath) : installImage(fw, partPath);
+        if ( fw->error != 0 )
+            rc = FETCH_FAILED;
+        unlink(partPath);
+        unlink(metaPath);
+    } else if ( rc == FETCH_FAILED ) {
+        unlink(partPath);
+        unlink(metaPath);
+    }
+
+done:
+    if ( fw->stop ) {
+        /* the partial image is kept to resume */
+        LOG(INFO, "Firmware download stopped at %lld bytes", fw->offset);
+    } else if ( rc == FETCH_DONE ) {
+        LOG(INFO, "Firmware downloaded: %lld bytes to %s", fw->offset, fw->stagingPath);
+        changeFirmwareDownloadState(FIRMWARESTATE_DOWNLOADED);
+    } else {
+        LOG(ERROR, "Firmware download failed: updateStatus=%d", fw->error);
+        changeFirmwareDownloadState(FIRMWARESTATE_IDLE);
+        changeFirmwareUpdateState(fw->error);
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    fw->active = 0;
+    pthread_mutex_unlock(&fw->lock);
+
+    return NULL;
+}
+
+static fwDownload * getFirmwareDownload(iotfclient *client)
+{
+    fwDownload *fw;
+
+    pthread_mutex_lock(&createLock);
+    fw = (fwDownload *)client->fwdownload;
+    if ( fw == NULL ) {
+        fw = (fwDownload *)calloc(1, sizeof(fwDownload));
+        if ( fw != NULL ) {
+            pthread_condattr_t attr;
+
+            fw->client = client;
+            fw->sock = -1;
+            fw->file = -1;
+            fw->maxRetries = FWDL_DEFAULT_RETRIES;
+            pthread_mutex_init(&fw->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&fw->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            client->fwdownload = fw;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return fw;
+}
+
+/**
+ * Function used to enable the firmware download.
+ */
+int setFirmwareDownloadOptions(iotfclient *client, char *stagingPath, int maxBytesPerSec, int maxRetries)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    fwDownload *fw;
+
+    if ( maxBytesPerSec < 0 || maxRetries < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+    if ( (fw = getFirmwareDownload(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    if ( fw->active ) {
+        LOG(WARN, "Firmware download options can not be changed during a download");
+        rc = -1;
+    } else {
+        freePtr(fw->stagingPath);
+        fw->stagingPath = (stagingPath && *stagingPath) ? strdup(stagingPath) : NULL;
+        fw->maxBytesPerSec = maxBytesPerSec;
+        fw->maxRetries = maxRetries ? maxRetries : FWDL_DEFAULT_RETRIES;
+    }
+    pthread_mutex_unlock(&fw->lock);
+
+    LOG(INFO, "Firmware download: stagingPath=%s maxBytesPerSec=%d maxRetries=%d",
+        stagingPath ? stagingPath : "", maxBytesPerSec, maxRetries);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the installed firmware image, the base of firmware deltas.
+ */
+int setFirmwareBaseImage(iotfclient *client, char *basePath)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    fwDownload *fw;
+
+    if ( (fw = getFirmwareDownload(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    if ( fw->active ) {
+        LOG(WARN, "Firmware base image can not be changed during a download");
+        rc = -1;
+    } else {
+        freePtr(fw->basePath);
+        fw->basePath = (basePath && *basePath) ? strdup(basePath) : NULL;
+    }
+    pthread_mutex_unlock(&fw->lock);
+
+    LOG(INFO, "Firmware base image: %s", basePath ? basePath : "");
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Check if the firmware download is enabled
+ */
+int firmwareDownloadEnabled(iotfclient *client)
+{
+    fwDownload *fw = (fwDownload *)client->fwdownload;
+    int enabled = 0;
+
+    if ( fw != NULL ) {
+        pthread_mutex_lock(&fw->lock);
+        enabled = (fw->stagingPath != NULL);
+        pthread_mutex_unlock(&fw->lock);
+    }
+
+    return enabled;
+}
+
+/**
+ * Function used to start a firmware download.
+ */
+int startFirmwareDownload(iotfclient *client, char *url, char *verifier)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    fwDownload *fw = (fwDownload *)client->fwdownload;
+    int join = 0;
+
+    if ( url == NULL || *url == '\0' ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+    if ( fw == NULL || fw->stagingPath == NULL ) {
+        LOG(WARN, "Firmware download is not enabled");
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&fw->lock);
+    if ( fw->active ) {
+        LOG(WARN, "Firmware download is already in progress");
+        rc = -1;
+    } else {
+        join = fw->threadStarted;
+        fw->threadStarted = 0;
+    }
+    pthread_mutex_unlock(&fw->lock);
+    if ( rc != 0 )
+        goto exit;
+
+    /* reap the thread of the previous download */
+    if ( join )
+        pthread_join(fw->thread, NULL);
+
+    /* an image that cannot be verified is not installed */
+    fw->md = NULL;
+    if ( verifier && *verifier && parseVerifier(fw, verifier) != 0 ) {
+        LOG(ERROR, "Firmware verifier is not a known digest: %s", verifier);
+        fw->verified = 0;
+        fw->error = FIRMWAREUPDATE_VERIFICATIONFAILED;
+        changeFirmwareDownloadState(FIRMWARESTATE_IDLE);
+        changeFirmwareUpdateState(FIRMWAREUPDATE_VERIFICATIONFAILED);
+        rc = FIRMWAREUPDATE_VERIFICATIONFAILED;
+        goto exit;
+    }
+
+    freePtr(fw->url);
+    fw->url = strdup(url);
+    if ( fw->md && fw->mdctx == NULL && (fw->mdctx = EVP_MD_CTX_new()) == NULL )
+        fw->md = NULL;
+    fw->verified = 0;
+    fw->stop = 0;
+    fw->active = 1;
+    fw->error = 0;
+    fw->resumes = 0;
+    fw->bytesPerSec = 0;
+    if ( fw->url == NULL || pthread_create(&fw->thread, NULL, downloadThread, fw) != 0 ) {
+        LOG(ERROR, "Failed to start firmware download thread");
+        fw->active = 0;
+        rc = -1;
+    } else {
+        fw->threadStarted = 1;
+        LOG(INFO, "Firmware download started: %s", url);
+    }
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the progress of the firmware download.
+ */
+int getFirmwareDownloadStats(iotfclient *client, FirmwareDownloadStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    fwDownload *fw = (fwDownload *)client->fwdownload;
+
+    if ( stats == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    memset(stats, 0, sizeof(FirmwareDownloadStats));
+    stats->total = -1;
+    if ( fw == NULL )
+        goto exit;
+
+    pthread_mutex_lock(&fw->lock);
+    stats->active = fw->active;
+    stats->received = fw->offset;
+    stats->total = fw->total;
+    stats->resumes = fw->resumes;
+    stats->bytesPerSec = fw->bytesPerSec;
+    stats->error = fw->error;
+    stats->verified = fw->verified;
+    pthread_mutex_unlock(&fw->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Stop a download in progress, the partial image is kept to resume
+ */
+void freeFirmwareDownload(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    fwDownload *fw = (fwDownload *)client->fwdownload;
+
+    if ( fw != NULL ) {
+        pthread_mutex_lock(&fw->lock);
+        fw->stop = 1;
+        if ( fw->sock >= 0 )
+            shutdown(fw->sock, SHUT_RDWR);
+        pthread_cond_signal(&fw->cond);
+        pthread_mutex_unlock(&fw->lock);
+        if ( fw->threadStarted )
+            pthread_join(fw->thread, NULL);
+
+        client->fwdownload = NULL;
+        pthread_cond_destroy(&fw->cond);
+        pthread_mutex_destroy(&fw->lock);
+        freePtr(fw->stagingPath);
+        freePtr(fw->basePath);
+        freePtr(fw->url);
+        if ( fw->mdctx )
+            EVP_MD_CTX_free(fw->mdctx);
+        free(fw);
+    }
+
+    LOG(TRACE, "exit::");
+}
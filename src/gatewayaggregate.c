@@ -0,0 +1,577 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Windowed aggregation of samples per (device, metric). A window is split in
+ * panes of slideMs - a tumbling window has a single pane, a sliding window has
+ * windowMs / slideMs panes. At each pane boundary the aggregation thread
+ * publishes one summary event per device, covering all panes, and clears the
+ * oldest pane for reuse.
+ *
+ * Metric state is kept as structure of arrays indexed by metric handle (and
+ * pane), so a batch of samples is applied with a tight loop over plain arrays.
+ * Percentiles are estimated from per pane reservoir samples, each weighted by
+ * the number of pane samples it stands for when panes are merged.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define AGGREGATE_EVENT_TYPE    "aggregate"
+#define AGGREGATE_MAX_PAYLOAD   4096
+#define AGGREGATE_MAX_NAME      256
+#define AGGREGATE_MAX_ENTRY     (AGGREGATE_MAX_NAME + 256)
+
+typedef struct aggregateEvent {
+    struct aggregateEvent *next;
+    char *deviceType;
+    char *deviceId;
+    char data[AGGREGATE_MAX_PAYLOAD];
+} aggregateEvent;
+
+/* Reservoir sample weighted by the number of pane samples it stands for */
+typedef struct {
+    double value;
+    double weight;
+} aggregateSample;
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    char *eventType;
+    int windowMs;
+    int slideMs;
+    int panes;
+    int perPane;                /* reservoir samples per pane, 0 if no percentiles */
+    struct timespec start;
+    long curPane;               /* absolute number of the pane being filled */
+    unsigned long long seed;    /* xorshift state of reservoir sampling */
+
+    /* devices */
+    int devCount;
+    int devSize;
+    char **devType;
+    char **devId;
+    int *devFirst;              /* first metric of device */
+
+    /* metrics */
+    int count;
+    int size;
+    int *metricDev;
+    int *metricNext;            /* next metric of same device */
+    char **metricName;
+    double *last;
+
+    /* per metric and pane - index metric * panes + pane */
+    double *min;
+    double *max;
+    double *sum;
+    unsigned int *n;
+    unsigned int *seen;
+    double *res;                /* index (metric * panes + pane) * perPane + sample */
+} aggregator;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int growArray(void **ptr, size_t elemSize, int newSize)
+{
+    void *tmp = realloc(*ptr, elemSize * newSize);
+    if ( tmp == NULL )
+        return -1;
+    *ptr = tmp;
+    return 0;
+}
+
+/* Add device, returns device index. Called with lock held. */
+static int findAggregateDevice(aggregator *agg, char *deviceType, char *deviceId)
+{
+    int i;
+
+    for (i = 0; i < agg->devCount; i++) {
+        if ( !strcmp(agg->devId[i], deviceId) && !strcmp(agg->devType[i], deviceType) )
+            return i;
+    }
+
+    if ( agg->devCount == agg->devSize ) {
+        int newSize = agg->devSize ? agg->devSize * 2 : 16;
+        if ( growArray((void **)&agg->devType, sizeof(char *), newSize) ||
+             growArray((void **)&agg->devId, sizeof(char *), newSize) ||
+             growArray((void **)&agg->devFirst, sizeof(int), newSize) )
+            return -1;
+        agg->devSize = newSize;
+    }
+
+    agg->devType[agg->devCount] = strdup(deviceType);
+    agg->devId[agg->devCount] = strdup(deviceId);
+    agg->devFirst[agg->devCount] = -1;
+
+    return agg->devCount++;
+}
+
+/* Grow metric arrays. Called with lock held. */
+static int growMetrics(aggregator *agg)
+{
+    int newSize = agg->size ? agg->size * 2 : 64;
+    int p = agg->panes;
+
+    if ( growArray((void **)&agg->metricDev, sizeof(int), newSize) ||
+         growArray((void **)&agg->metricNext, sizeof(int), newSize) ||
+         growArray((void **)&agg->metricName, sizeof(char *), newSize) ||
+         growArray((void **)&agg->last, sizeof(double), newSize) ||
+         growArray((void **)&agg->min, sizeof(double), newSize * p) ||
+         growArray((void **)&agg->max, sizeof(double), newSize * p) ||
+         growArray((void **)&agg->sum, sizeof(double), newSize * p) ||
+         growArray((void **)&agg->n, sizeof(unsigned int), newSize * p) ||
+         growArray((void **)&agg->seen, sizeof(unsigned int), newSize * p) ||
+         (agg->perPane && growArray((void **)&agg->res, sizeof(double), newSize * p * agg->perPane)) ) {
+        LOG(ERROR, "Failed to grow aggregation metric table: size=%d", newSize);
+        return -1;
+    }
+
+    agg->size = newSize;
+    return 0;
+}
+
+static void clearPane(aggregator *agg, int pane)
+{
+    int m;
+
+    for (m = 0; m < agg->count; m++) {
+        agg->n[m * agg->panes + pane] = 0;
+        agg->seen[m * agg->panes + pane] = 0;
+        agg->sum[m * agg->panes + pane] = 0.0;
+    }
+}
+
+static int compareSample(const void *a, const void *b)
+{
+    double x = ((const aggregateSample *)a)->value;
+    double y = ((const aggregateSample *)b)->value;
+    return (x > y) - (x < y);
+}
+
+/* Value of percentile q of sorted weighted samples */
+static double percentile(aggregateSample *samples, int n, double total, int q)
+{
+    double target = total * q / 100.0;
+    double acc = 0.0;
+    int i;
+
+    for (i = 0; i < n - 1; i++) {
+        acc += samples[i].weight;
+        if ( acc >= target )
+            break;
+    }
+    return samples[i].value;
+}
+
+/* Add a finished summary event to the list */
+static void endSummary(aggregateEvent *evt, int len, aggregateEvent ***tail)
+{
+    strcpy(evt->data + len, "}}}");
+    evt->next = NULL;
+    **tail = evt;
+    *tail = &evt->next;
+}
+
+/*
+ * Build summaries of a device over all panes. Metrics that do not fit in one
+ * event continue in another. Called with lock held. Returns number of events.
+ */
+static int buildSummary(aggregator *agg, int dev, aggregateSample *tmp, aggregateEvent ***tail)
+{
+    aggregateEvent *evt = NULL;
+    char entry[AGGREGATE_MAX_ENTRY];
+    int m, p, len = 0, n, metrics = 0, events = 0;
+
+    for (m = agg->devFirst[dev]; m >= 0; m = agg->metricNext[m]) {
+        unsigned int count = 0;
+        double min = 0.0, max = 0.0, sum = 0.0;
+        int samples = 0;
+
+        for (p = 0; p < agg->panes; p++) {
+            int idx = m * agg->panes + p;
+            if ( agg->n[idx] == 0 )
+                continue;
+            if ( count == 0 || agg->min[idx] < min ) min = agg->min[idx];
+            if ( count == 0 || agg->max[idx] > max ) max = agg->max[idx];
+            sum += agg->sum[idx];
+            count += agg->n[idx];
+            if ( agg->perPane ) {
+                int k = agg->seen[idx] < (unsigned int)agg->perPane ? (int)agg->seen[idx] : agg->perPane;
+                double *res = agg->res + (size_t)idx * agg->perPane;
+                int j;
+                for (j = 0; j < k; j++) {
+                    tmp[samples].value = res[j];
+                    tmp[samples++].weight = (double)agg->n[idx] / k;
+                }
+            }
+        }
+
+        if ( count == 0 )
+            continue;
+
+        /* names are at most AGGREGATE_MAX_NAME, so an entry always fits */
+        n = snprintf(entry, sizeof(entry), "\"%s\":{\"count\":%u,\"min\":%g,\"max\":%g,\"mean\":%g,\"last\":%g",
+            agg->metricName[m], count, min, max, sum / count, agg->last[m]);
+        if ( samples > 0 ) {
+            qsort(tmp, samples, sizeof(aggregateSample), compareSample);
+            n += snprintf(entry + n, sizeof(entry) - n, ",\"p50\":%g,\"p90\":%g,\"p99\":%g",
+                percentile(tmp, samples, count, 50), percentile(tmp, samples, count, 90),
+                percentile(tmp, samples, count, 99));
+        }
+        n += snprintf(entry + n, sizeof(entry) - n, "}");
+
+        /* continue in another event if the entry, a comma and the closing braces do not fit */
+        if ( evt != NULL && len + n + 4 >= AGGREGATE_MAX_PAYLOAD ) {
+            endSummary(evt, len, tail);
+            evt = NULL;
+        }
+        if ( evt == NULL ) {
+            if ( (evt = (aggregateEvent *)malloc(sizeof(aggregateEvent))) == NULL ) {
+                LOG(ERROR, "Failed to allocate summary of device type=%s id=%s", agg->devType[dev], agg->devId[dev]);
+                return events;
+            }
+            evt->deviceType = agg->devType[dev];
+            evt->deviceId = agg->devId[dev];
+            len = snprintf(evt->data, AGGREGATE_MAX_PAYLOAD, "{\"d\":{\"windowMs\":%d,\"metrics\":{", agg->windowMs);
+            metrics = 0;
+            events++;
+        }
+        len += sprintf(evt->data + len, "%s%s", metrics ? "," : "", entry);
+        metrics++;
+    }
+
+    if ( evt != NULL )
+        endSummary(evt, len, tail);
+
+    return events;
+}
+
+/* Close current pane - build summaries and advance. Called with lock held. */
+static aggregateEvent * closePane(aggregator *agg)
+{
+    aggregateEvent *list = NULL;
+    aggregateEvent **tail = &list;
+    aggregateSample *tmp = NULL;
+    int dev;
+
+    if ( agg->perPane )
+        tmp = (aggregateSample *)malloc(sizeof(aggregateSample) * agg->perPane * agg->panes);
+
+    for (dev = 0; dev < agg->devCount; dev++) {
+        if ( agg->perPane && tmp == NULL )
+            break;
+        buildSummary(agg, dev, tmp, &tail);
+    }
+
+    freePtr((char *)tmp);
+
+    agg->curPane++;
+    clearPane(agg, (int)(agg->curPane % agg->panes));
+
+    return list;
+}
+
+static void publishSummaries(aggregator *agg, aggregateEvent *list)
+{
+    while ( list ) {
+        aggregateEvent *evt = list;
+        list = evt->next;
+        publishDeviceEvent(agg->client, evt->deviceType, evt->deviceId, agg->eventType, "json", evt->data, QoS0);
+        free(evt);
+    }
+}
+
+/* Publish summaries at pane boundaries */
+static void * aggregateThread(void *arg)
+{
+    aggregator *agg = (aggregator *)arg;
+
+    pthread_mutex_lock(&agg->lock);
+    while ( !agg->stop ) {
+        struct timespec deadline;
+        long ms = (agg->curPane + 1) * agg->slideMs;
+
+        deadline.tv_sec = agg->start.tv_sec + ms / 1000;
+        deadline.tv_nsec = agg->start.tv_nsec + (ms % 1000) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        if ( pthread_cond_timedwait(&agg->cond, &agg->lock, &deadline) == ETIMEDOUT && !agg->stop ) {
+            aggregateEvent *list = closePane(agg);
+            /* device names are never freed while the thread runs */
+            pthread_mutex_unlock(&agg->lock);
+            publishSummaries(agg, list);
+            pthread_mutex_lock(&agg->lock);
+        }
+    }
+    pthread_mutex_unlock(&agg->lock);
+
+    return NULL;
+}
+
+/**
+ * Function used to enable windowed aggregation of device samples.
+ */
+int setAggregationOptions(iotfclient *client, char *eventType, int windowMs, int slideMs, int percentileSamples)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    aggregator *agg;
+    pthread_condattr_t attr;
+
+    pthread_mutex_lock(&createLock);
+    if ( !client->isGateway || client->aggregator != NULL ) {
+        LOG(ERROR, "Aggregation requires a gateway client and can be enabled only once");
+        rc = -1;
+        goto exit;
+    }
+
+    if ( slideMs == 0 )
+        slideMs = windowMs;
+
+    if ( windowMs <= 0 || slideMs <= 0 || windowMs % slideMs != 0 || percentileSamples < 0 ) {
+        LOG(WARN, "Invalid aggregation options: windowMs=%d slideMs=%d percentileSamples=%d", windowMs, slideMs, percentileSamples);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    agg = (aggregator *)calloc(1, sizeof(aggregator));
+    if ( agg == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    agg->client = client;
+    agg->eventType = strdup((eventType && *eventType) ? eventType : AGGREGATE_EVENT_TYPE);
+    agg->windowMs = windowMs;
+    agg->slideMs = slideMs;
+    agg->panes = windowMs / slideMs;
+    agg->perPane = percentileSamples ? (percentileSamples + agg->panes - 1) / agg->panes : 0;
+    clock_gettime(CLOCK_MONOTONIC, &agg->start);
+    /* splitmix64 of the start time, xorshift needs a well mixed non zero state */
+    agg->seed = (unsigned long long)agg->start.tv_sec * 1000000000ULL + agg->start.tv_nsec + 0x9E3779B97F4A7C15ULL;
+    agg->seed = (agg->seed ^ (agg->seed >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    agg->seed = (agg->seed ^ (agg->seed >> 27)) * 0x94D049BB133111EBULL;
+    agg->seed = (agg->seed ^ (agg->seed >> 31)) | 1;
+
+    pthread_mutex_init(&agg->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&agg->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if ( pthread_create(&agg->thread, NULL, aggregateThread, agg) != 0 ) {
+        LOG(ERROR, "Failed to start aggregation thread");
+        pthread_cond_destroy(&agg->cond);
+        pthread_mutex_destroy(&agg->lock);
+        free(agg->eventType);
+        free(agg);
+        rc = -1;
+        goto exit;
+    }
+
+    client->aggregator = agg;
+    LOG(INFO, "Aggregation: windowMs=%d slideMs=%d panes=%d percentileSamples=%d", windowMs, slideMs, agg->panes, percentileSamples);
+
+exit:
+    pthread_mutex_unlock(&createLock);
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the handle of a (device, metric) pair.
+ */
+int getAggregateMetric(iotfclient *client, char *deviceType, char *deviceId, char *metric)
+{
+    LOG(TRACE, "entry::");
+
+    aggregator *agg = (aggregator *)client->aggregator;
+    int handle = -1;
+    int dev, m, p;
+
+    if ( agg == NULL || !deviceType || !deviceId || !metric || *metric == '\0' || strpbrk(metric, "\"\\") ||
+         strlen(metric) > AGGREGATE_MAX_NAME ) {
+        LOG(WARN, "Aggregation is not enabled or invalid arguments");
+        goto exit;
+    }
+
+    pthread_mutex_lock(&agg->lock);
+
+    if ( (dev = findAggregateDevice(agg, deviceType, deviceId)) < 0 )
+        goto unlock;
+
+    for (m = agg->devFirst[dev]; m >= 0; m = agg->metricNext[m]) {
+        if ( !strcmp(agg->metricName[m], metric) ) {
+            handle = m;
+            goto unlock;
+        }
+    }
+
+    if ( agg->count == agg->size && growMetrics(agg) != 0 )
+        goto unlock;
+
+    m = agg->count++;
+    agg->metricDev[m] = dev;
+    agg->metricName[m] = strdup(metric);
+    agg->metricNext[m] = agg->devFirst[dev];
+    agg->devFirst[dev] = m;
+    agg->last[m] = 0.0;
+    for (p = 0; p < agg->panes; p++) {
+        agg->n[m * agg->panes + p] = 0;
+        agg->seen[m * agg->panes + p] = 0;
+        agg->sum[m * agg->panes + p] = 0.0;
+    }
+    handle = m;
+
+unlock:
+    pthread_mutex_unlock(&agg->lock);
+
+exit:
+    LOG(TRACE, "exit:: handle=%d", handle);
+    return handle;
+}
+
+/**
+ * Function used to add a batch of samples.
+ */
+int addAggregateSamples(iotfclient *client, int *metrics, double *values, int count)
+{
+    aggregator *agg = (aggregator *)client->aggregator;
+    int i, pane, panes;
+
+    if ( agg == NULL || !metrics || !values )
+        return MISSING_INPUT_PARAM;
+
+    pthread_mutex_lock(&agg->lock);
+
+    panes = agg->panes;
+    pane = (int)(agg->curPane % panes);
+
+    for (i = 0; i < count; i++) {
+        int m = metrics[i];
+        double v = values[i];
+        int idx;
+
+        if ( m < 0 || m >= agg->count )
+            continue;
+
+        idx = m * panes + pane;
+        if ( agg->n[idx] == 0 ) {
+            agg->min[idx] = v;
+            agg->max[idx] = v;
+        } else {
+            if ( v < agg->min[idx] ) agg->min[idx] = v;
+            if ( v > agg->max[idx] ) agg->max[idx] = v;
+        }
+        agg->sum[idx] += v;
+        agg->n[idx]++;
+        agg->last[m] = v;
+
+        if ( agg->perPane ) {
+            /* reservoir sampling */
+            unsigned int seen = agg->seen[idx]++;
+            if ( seen < (unsigned int)agg->perPane ) {
+                agg->res[(size_t)idx * agg->perPane + seen] = v;
+            } else {
+                unsigned int r;
+                agg->seed ^= agg->seed << 13;
+                agg->seed ^= agg->seed >> 7;
+                agg->seed ^= agg->seed << 17;
+                r = (unsigned int)((agg->seed >> 32) % (seen + 1));
+                if ( r < (unsigned int)agg->perPane )
+                    agg->res[(size_t)idx * agg->perPane + r] = v;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&agg->lock);
+
+    return 0;
+}
+
+/**
+ * Function used to add a sample of a device metric.
+ */
+int addDeviceSample(iotfclient *client, char *deviceType, char *deviceId, char *metric, double value)
+{
+    int handle = getAggregateMetric(client, deviceType, deviceId, metric);
+
+    if ( handle < 0 )
+        return -1;
+
+    return addAggregateSamples(client, &handle, &value, 1);
+}
+
+/*
+ * Stop aggregation thread and free aggregation state
+ */
+void freeAggregator(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    aggregator *agg = (aggregator *)client->aggregator;
+    int i;
+
+    if ( agg != NULL ) {
+        pthread_mutex_lock(&agg->lock);
+        agg->stop = 1;
+        pthread_cond_signal(&agg->cond);
+        pthread_mutex_unlock(&agg->lock);
+        pthread_join(agg->thread, NULL);
+
+        /* publish summaries of the partial window */
+        publishSummaries(agg, closePane(agg));
+
+        for (i = 0; i < agg->devCount; i++) {
+            free(agg->devType[i]);
+            free(agg->devId[i]);
+        }
+        for (i = 0; i < agg->count; i++)
+            free(agg->metricName[i]);
+
+        free(agg->devType);
+        free(agg->devId);
+        free(agg->devFirst);
+        free(agg->metricDev);
+        free(agg->metricNext);
+        free(agg->metricName);
+        free(agg->last);
+        free(agg->min);
+        free(agg->max);
+        free(agg->sum);
+        free(agg->n);
+        free(agg->seen);
+        freePtr((char *)agg->res);
+        free(agg->eventType);
+        pthread_cond_destroy(&agg->cond);
+        pthread_mutex_destroy(&agg->lock);
+        free(agg);
+        client->aggregator = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
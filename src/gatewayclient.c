@@ -33,6 +33,8 @@
 #include "iotfclient.h"
 #include "iotf_utils.h"
 
+extern int gatewayDeviceBackedOff(iotfclient *client, char *deviceType, char *deviceId);
+
 /* Subscription details storage */
 char* subscribeTopics[MAX_SUBSCRIPTION];
 int subscribeCount = 0;
@@ -55,6 +57,14 @@ int publishDeviceEvent(iotfclient  *client, char *deviceType, char *deviceId, ch
 
     int rc = -1;
 
+    /* Do not waste uplink on devices the platform is rejecting */
+    if ( gatewayDeviceBackedOff(client, deviceType, deviceId) ) {
+        LOG(DEBUG, "Device type=%s id=%s is backed off", deviceType, deviceId);
+        rc = DEVICE_BACKOFF;
+        LOG(TRACE, "exit:: rc=%d", rc);
+        return rc;
+    }
+
     char publishTopic[strlen(eventType) + strlen(eventFormat) + strlen(deviceType) + strlen(deviceId)+25];
 
     sprintf(publishTopic, "iot-2/type/%s/id/%s/evt/%s/fmt/%s", deviceType, deviceId, eventType, eventFormat);
@@ -63,7 +73,7 @@ int publishDeviceEvent(iotfclient  *client, char *deviceType, char *deviceId, ch
 
     rc = publishData(client, publishTopic, data, qos);
 
-    if (rc != 0) {
+    if (rc != 0 && rc != QUEUE_FULL) {
         LOG(WARN, "connection lost.. %d \n",rc);
         retry_connection(client);
         rc = publishData(client, publishTopic, data, qos);
@@ -98,7 +108,7 @@ int publishGatewayEvent(iotfclient  *client, char *eventType, char *eventFormat,
 
     rc = publishData(client, publishTopic , data, qos);
 
-    if (rc != 0) {
+    if (rc != 0 && rc != QUEUE_FULL) {
         LOG(WARN, "connection lost.. \n");
         retry_connection(client);
         rc = publishData(client, publishTopic , data, qos);
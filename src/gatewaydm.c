@@ -0,0 +1,577 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Device management of the devices attached to a gateway. The gateway sends
+ * the requests of a device on iotdevice-1/type/<type>/id/<id>/..., and the
+ * platform sends its requests and responses on iotdm-1/type/<type>/id/<id>/...
+ * All devices share one subscription, and the request table of the client
+ * that correlates responses by reqId.
+ *
+ * The DM state of a device is an entry of a dense array, found by hash
+ * through bucket chains, so that lookup cost does not grow with the number
+ * of devices. An unmanaged device is removed from the table.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define GWDM_SUBSCRIPTION   "iotdm-1/type/+/id/+/#"
+#define GWDM_TOPIC_PREFIX   "iotdm-1/type/"
+
+extern void messageResponse(iotfclient *client, char *payload, size_t sz);
+extern int scanDMResponse(const char *p, size_t len, int *rc, char *reqId, size_t reqIdLen);
+extern int scheduleDMRenewal(iotfclient *client, char *deviceType, char *deviceId, long lifetime,
+    int supportDeviceActions, int supportFirmwareActions);
+extern void cancelDMRenewal(iotfclient *client, char *deviceType, char *deviceId);
+
+/* Per device DM state */
+typedef struct {
+    unsigned long hash;
+    char *deviceType;
+    char *deviceId;
+    int next;                   /* next device of the hash bucket, -1 if none */
+    unsigned char state;        /* GATEWAYDM_*                                */
+    unsigned char supports;     /* bit 0 device actions, bit 1 firmware actions */
+    long lifetime;
+    long long managedMs;        /* time of the last successful manage         */
+} dmDevice;
+
+typedef struct {
+    pthread_mutex_t lock;
+    gatewayDMCommandCallback cb;
+    int subscribed;             /* of the connection, sessions are not kept */
+    int count;
+    int size;
+    dmDevice *devices;
+    int nbuckets;               /* power of 2 */
+    int *buckets;
+} gatewayDM;
+
+/* Context of a pending manage or unmanage request */
+typedef struct {
+    iotfclient *client;
+    char *deviceType;
+    char *deviceId;
+    int manage;                 /* 1 manage, 2 renewal of the lifetime, 0 unmanage */
+    dmResponseCallback cb;
+    void *context;
+} gatewayDMRequest;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* Hash of device type and id */
+static unsigned long deviceHash(const char *deviceType, const char *deviceId)
+{
+    unsigned long h = 5381;
+    const char *p;
+
+    for (p = deviceType; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+    h = (h << 5) + h + '/';
+    for (p = deviceId; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+
+    return h;
+}
+
+static gatewayDM * getGatewayDM(iotfclient *client)
+{
+    gatewayDM *gdm;
+
+    pthread_mutex_lock(&createLock);
+    gdm = (gatewayDM *)client->gatewaydm;
+    if ( gdm == NULL ) {
+        gdm = (gatewayDM *)calloc(1, sizeof(gatewayDM));
+        if ( gdm != NULL ) {
+            pthread_mutex_init(&gdm->lock, NULL);
+            client->gatewaydm = gdm;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return gdm;
+}
+
+/* Link all devices into a bucket table of nbuckets. Called with lock held. */
+static int rehash(gatewayDM *gdm, int nbuckets)
+{
+    int *buckets = (int *)malloc(nbuckets * sizeof(int));
+    int i;
+
+    if ( buckets == NULL )
+        return -1;
+
+    memset(buckets, 0xff, nbuckets * sizeof(int));
+    for (i = 0; i < gdm->count; i++) {
+        int b = (int)(gdm->devices[i].hash & (nbuckets - 1));
+        gdm->devices[i].next = buckets[b];
+        buckets[b] = i;
+    }
+    free(gdm->buckets);
+    gdm->buckets = buckets;
+    gdm->nbuckets = nbuckets;
+
+    return 0;
+}
+
+/* Find device, add it if create is set. Called with lock held. */
+static dmDevice * findDMDevice(gatewayDM *gdm, const char *deviceType, const char *deviceId, int create)
+{
+    unsigned long hash = deviceHash(deviceType, deviceId);
+    dmDevice *dev;
+    int i, b;
+
+    if ( gdm->nbuckets > 0 ) {
+        for (i = gdm->buckets[hash & (gdm->nbuckets - 1)]; i >= 0; i = dev->next) {
+            dev = &gdm->devices[i];
+            if ( dev->hash == hash && !strcmp(dev->deviceId, deviceId) && !strcmp(dev->deviceType, deviceType) )
+                return dev;
+        }
+    }
+
+    if ( !create )
+        return NULL;
+
+    if ( gdm->count == gdm->size ) {
+        int newSize = gdm->size ? gdm->size * 2 : 16;
+        dmDevice *tmp = (dmDevice *)realloc(gdm->devices, newSize * sizeof(dmDevice));
+        if ( tmp == NULL ) {
+            LOG(ERROR, "Failed to grow gateway DM device table: size=%d", newSize);
+            return NULL;
+        }
+        gdm->devices = tmp;
+        gdm->size = newSize;
+    }
+
+    dev = &gdm->devices[gdm->count];
+    memset((void *)dev, 0, sizeof(dmDevice));
+    dev->hash = hash;
+    dev->deviceType = strdup(deviceType);
+    dev->deviceId = strdup(deviceId);
+    if ( dev->deviceType == NULL || dev->deviceId == NULL ) {
+        free(dev->deviceType);
+        free(dev->deviceId);
+        return NULL;
+    }
+    gdm->count++;
+
+    /* keep chains short, one bucket per device */
+    if ( gdm->count > gdm->nbuckets ) {
+        if ( rehash(gdm, gdm->nbuckets ? gdm->nbuckets * 2 : 16) != 0 ) {
+            gdm->count--;
+            free(dev->deviceType);
+            free(dev->deviceId);
+            return NULL;
+        }
+    } else {
+        b = (int)(hash & (gdm->nbuckets - 1));
+        dev->next = gdm->buckets[b];
+        gdm->buckets[b] = gdm->count - 1;
+    }
+
+    return dev;
+}
+
+/* Replace index from by to in the bucket chain of a device. Called with lock held. */
+static void relink(gatewayDM *gdm, unsigned long hash, int from, int to)
+{
+    int *p = &gdm->buckets[hash & (gdm->nbuckets - 1)];
+
+    while ( *p >= 0 && *p != from )
+        p = &gdm->devices[*p].next;
+    if ( *p == from )
+        *p = to;
+}
+
+/* Remove a device, the last device takes its place. Called with lock held. */
+static void removeDMDevice(gatewayDM *gdm, dmDevice *dev)
+{
+    int i = (int)(dev - gdm->devices);
+    int last = gdm->count - 1;
+
+    relink(gdm, dev->hash, i, dev->next);
+    free(dev->deviceType);
+    free(dev->deviceId);
+    if ( i != last ) {
+        relink(gdm, gdm->devices[last].hash, last, i);
+        gdm->devices[i] = gdm->devices[last];
+    }
+    gdm->count--;
+}
+
+static void freeDMRequestContext(gatewayDMRequest *req)
+{
+    free(req->deviceType);
+    free(req->deviceId);
+    free(req);
+}
+
+/* Response of a manage or unmanage request, or its timeout */
+static void gatewayDMResponse(void *context, char *reqId, int rc, char *payload, size_t payloadlen)
+{
+    gatewayDMRequest *req = (gatewayDMRequest *)context;
+    gatewayDM *gdm = (gatewayDM *)req->client->gatewaydm;
+    long lifetime = 0;
+    int supports = 0, managed = 0, removed = 0;
+
+    if ( gdm != NULL && req->manage ) {
+        dmDevice *dev;
+
+        pthread_mutex_lock(&gdm->lock);
+        dev = findDMDevice(gdm, req->deviceType, req->deviceId, 0);
+        if ( dev != NULL && dev->state == GATEWAYDM_MANAGING && req->manage == 1 ) {
+            if ( rc == 200 ) {
+                dev->state = GATEWAYDM_MANAGED;
+                dev->managedMs = monotonicMs();
+                lifetime = dev->lifetime;
+                supports = dev->supports;
+                managed = 1;
+            } else {
+                /* rejected or timed out, the device is not kept */
+                removeDMDevice(gdm, dev);
+                removed = 1;
+            }
+        } else if ( dev != NULL && dev->state == GATEWAYDM_MANAGED && req->manage == 2 && rc == 200 ) {
+            dev->managedMs = monotonicMs();
+        }
+        pthread_mutex_unlock(&gdm->lock);
+    }
+    /* renewals reschedule themselves, a lifetime of 0 cancels the renewal */
+    if ( managed )
+        scheduleDMRenewal(req->client, req->deviceType, req->deviceId, lifetime, supports & 1, supports & 2);
+    else if ( removed )
+        cancelDMRenewal(req->client, req->deviceType, req->deviceId);
+    LOG(DEBUG, "%s response of device type=%s id=%s: rc=%d", req->manage ? "Manage" : "Unmanage",
+        req->deviceType, req->deviceId, rc);
+
+    if ( req->cb )
+        (*req->cb)(req->context, reqId, rc, payload, payloadlen);
+    freeDMRequestContext(req);
+}
+
+/* Send a manage or unmanage request of an attached device */
+static int sendGatewayDMRequest(iotfclient *client, char *deviceType, char *deviceId, char *request, char *data,
+    int manage, dmResponseCallback cb, void *context, char *reqId)
+{
+    char topic[strlen(deviceType) + strlen(deviceId) + strlen(request) + 32];
+    gatewayDMRequest *req = (gatewayDMRequest *)calloc(1, sizeof(gatewayDMRequest));
+    int rc;
+
+    if ( req == NULL || (req->deviceType = strdup(deviceType)) == NULL || (req->deviceId = strdup(deviceId)) == NULL ) {
+        if ( req )
+            freeDMRequestContext(req);
+        return -1;
+    }
+    req->client = client;
+    req->manage = manage;
+    req->cb = cb;
+    req->context = context;
+
+    sprintf(topic, "iotdevice-1/type/%s/id/%s/%s", deviceType, deviceId, request);
+    if ( (rc = sendDMRequest(client, topic, data, 0, gatewayDMResponse, req, reqId)) != 0 )
+        freeDMRequestContext(req);
+
+    return rc;
+}
+
+/* Subscribe to the DM topics of all attached devices. Not under the lock that the
+ * response handler takes. */
+static int subscribeGatewayDM(iotfclient *client, gatewayDM *gdm)
+{
+    int rc = subscribeTopic(client, GWDM_SUBSCRIPTION, QoS1);
+
+    if ( rc != 0 )
+        LOG(ERROR, "Failed to subscribe to gateway DM topics: rc=%d", rc);
+
+    pthread_mutex_lock(&gdm->lock);
+    gdm->subscribed = (rc == 0);
+    pthread_mutex_unlock(&gdm->lock);
+
+    return rc;
+}
+
+/*
+ * Subscribe again after a connect. connectiotf() connects with a clean
+ * session, which drops the subscription of the previous connection.
+ */
+void connectedGatewayDM(iotfclient *client)
+{
+    gatewayDM *gdm = (gatewayDM *)client->gatewaydm;
+    int resubscribe;
+
+    if ( gdm == NULL )
+        return;
+
+    pthread_mutex_lock(&gdm->lock);
+    resubscribe = gdm->subscribed || gdm->count > 0;
+    gdm->subscribed = 0;
+    pthread_mutex_unlock(&gdm->lock);
+
+    if ( resubscribe )
+        subscribeGatewayDM(client, gdm);
+}
+
+/*
+ * Process device management messages of attached devices. Invoked from
+ * messageArrived_dm() for iotdm-1/type/... topics.
+ */
+int messageArrived_gatewaydm(iotfclient *client, char *topic, void *payload, size_t len)
+{
+    gatewayDM *gdm = (gatewayDM *)client->gatewaydm;
+    char *deviceType, *deviceId, *request, *end;
+    char buf[strlen(topic) + 1];
+
+    /* iotdm-1/type/<type>/id/<id>/<request> */
+    strcpy(buf, topic);
+    deviceType = buf + strlen(GWDM_TOPIC_PREFIX);
+    if ( (end = strchr(deviceType, '/')) == NULL || strncmp(end, "/id/", 4) != 0 )
+        goto invalid;
+    *end = '\0';
+    deviceId = end + 4;
+    if ( (end = strchr(deviceId, '/')) == NULL )
+        goto invalid;
+    *end = '\0';
+    request = end + 1;
+
+    /* responses are correlated with the requests of all devices */
+    if ( !strcmp(request, "response") ) {
+        messageResponse(client, (char *)payload, len);
+        return 1;
+    }
+
+    if ( gdm != NULL && gdm->cb != NULL ) {
+        char *pl = (char *)malloc(len + 1);
+        char reqId[40];
+        int rc;
+
+        if ( pl == NULL ) {
+            LOG(ERROR, "Failed to allocate DM message payload");
+            return 1;
+        }
+        memcpy(pl, payload, len);
+        pl[len] = '\0';
+
+        /* reqId for the response, the handler gets the whole request */
+        scanDMResponse(pl, len, &rc, reqId, sizeof(reqId));
+
+        LOG(DEBUG, "DM request %s of device type=%s id=%s: reqId=%s", request, deviceType, deviceId, reqId);
+        (*gdm->cb)(deviceType, deviceId, request, reqId, pl, len);
+        free(pl);
+    } else {
+        LOG(WARN, "No handler for DM request %s of device type=%s id=%s", request, deviceType, deviceId);
+    }
+
+    return 1;
+
+invalid:
+    LOG(WARN, "Invalid gateway DM topic: %s", topic);
+    return 1;
+}
+
+/**
+ * Function used to send a manage request of an attached device.
+ */
+int manageGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, long lifetime,
+    int supportDeviceActions, int supportFirmwareActions, dmResponseCallback cb, void *context, char *reqId)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayDM *gdm;
+    dmDevice *dev;
+    char data[128];
+    int subscribed;
+
+    if ( deviceType == NULL || deviceId == NULL || lifetime < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (gdm = getGatewayDM(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    /* one subscription for the DM requests and responses of all devices */
+    pthread_mutex_lock(&gdm->lock);
+    subscribed = gdm->subscribed;
+    pthread_mutex_unlock(&gdm->lock);
+    if ( !subscribed && (rc = subscribeGatewayDM(client, gdm)) != 0 )
+        goto exit;
+
+    pthread_mutex_lock(&gdm->lock);
+    if ( (dev = findDMDevice(gdm, deviceType, deviceId, 1)) != NULL ) {
+        dev->state = GATEWAYDM_MANAGING;
+        dev->lifetime = lifetime;
+        dev->supports = (supportDeviceActions ? 1 : 0) | (supportFirmwareActions ? 2 : 0);
+    }
+    pthread_mutex_unlock(&gdm->lock);
+    if ( dev == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    snprintf(data, sizeof(data), "{\"lifetime\":%ld,\"supports\":{\"deviceActions\":%s,\"firmwareActions\":%s}}",
+        lifetime, supportDeviceActions ? "true" : "false", supportFirmwareActions ? "true" : "false");
+    if ( (rc = sendGatewayDMRequest(client, deviceType, deviceId, "mgmt/manage", data, 1, cb, context, reqId)) != 0 ) {
+        pthread_mutex_lock(&gdm->lock);
+        if ( (dev = findDMDevice(gdm, deviceType, deviceId, 0)) != NULL && dev->state == GATEWAYDM_MANAGING )
+            removeDMDevice(gdm, dev);
+        pthread_mutex_unlock(&gdm->lock);
+        if ( dev != NULL )
+            cancelDMRenewal(client, deviceType, deviceId);
+    }
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Renew the manage lifetime of a managed device, without changing its state.
+ * Invoked by the renewal scheduler.
+ */
+int renewGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, long lifetime, int supports,
+    dmResponseCallback cb, void *context)
+{
+    char data[128];
+
+    snprintf(data, sizeof(data), "{\"lifetime\":%ld,\"supports\":{\"deviceActions\":%s,\"firmwareActions\":%s}}",
+        lifetime, (supports & 1) ? "true" : "false", (supports & 2) ? "true" : "false");
+
+    return sendGatewayDMRequest(client, deviceType, deviceId, "mgmt/manage", data, 2, cb, context, NULL);
+}
+
+/**
+ * Function used to send an unmanage request of an attached device.
+ */
+int unmanageGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, dmResponseCallback cb, void *context, char *reqId)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayDM *gdm = (gatewayDM *)client->gatewaydm;
+    dmDevice *dev;
+
+    if ( deviceType == NULL || deviceId == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (rc = sendGatewayDMRequest(client, deviceType, deviceId, "mgmt/unmanage", NULL, 0, cb, context, reqId)) != 0 )
+        goto exit;
+
+    cancelDMRenewal(client, deviceType, deviceId);
+
+    if ( gdm != NULL ) {
+        pthread_mutex_lock(&gdm->lock);
+        if ( (dev = findDMDevice(gdm, deviceType, deviceId, 0)) != NULL )
+            removeDMDevice(gdm, dev);
+        pthread_mutex_unlock(&gdm->lock);
+    }
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to send the response to a DM request of an attached device.
+ */
+int respondGatewayDeviceDM(iotfclient *client, char *deviceType, char *deviceId, char *reqId, int rc)
+{
+    LOG(TRACE, "entry::");
+
+    int ret;
+
+    if ( deviceType == NULL || deviceId == NULL || reqId == NULL ) {
+        ret = MISSING_INPUT_PARAM;
+    } else {
+        char topic[strlen(deviceType) + strlen(deviceId) + 40];
+        char payload[strlen(reqId) + 40];
+
+        sprintf(topic, "iotdevice-1/type/%s/id/%s/response", deviceType, deviceId);
+        sprintf(payload, "{\"rc\":%d,\"reqId\":\"%s\"}", rc, reqId);
+        ret = publishData(client, topic, payload, QoS1);
+    }
+
+    LOG(TRACE, "exit:: rc=%d", ret);
+    return ret;
+}
+
+/**
+ * Function used to get the DM state of an attached device.
+ */
+int getGatewayDeviceDMState(iotfclient *client, char *deviceType, char *deviceId)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = -1;
+    gatewayDM *gdm = (gatewayDM *)client->gatewaydm;
+    dmDevice *dev;
+
+    if ( gdm != NULL && deviceType != NULL && deviceId != NULL ) {
+        pthread_mutex_lock(&gdm->lock);
+        if ( (dev = findDMDevice(gdm, deviceType, deviceId, 0)) != NULL )
+            rc = dev->state;
+        pthread_mutex_unlock(&gdm->lock);
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the handler of DM requests of attached devices.
+ */
+void setGatewayDMCommandHandler(iotfclient *client, gatewayDMCommandCallback cb)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayDM *gdm = getGatewayDM(client);
+
+    if ( gdm != NULL ) {
+        pthread_mutex_lock(&gdm->lock);
+        gdm->cb = cb;
+        pthread_mutex_unlock(&gdm->lock);
+    }
+
+    LOG(TRACE, "exit::");
+}
+
+/*
+ * Free the DM state of attached devices
+ */
+void freeGatewayDM(iotfclient *client)
+{
+    gatewayDM *gdm = (gatewayDM *)client->gatewaydm;
+    int i;
+
+    if ( gdm != NULL ) {
+        for (i = 0; i < gdm->count; i++) {
+            free(gdm->devices[i].deviceType);
+            free(gdm->devices[i].deviceId);
+        }
+        free(gdm->devices);
+        free(gdm->buckets);
+        pthread_mutex_destroy(&gdm->lock);
+        free(gdm);
+        client->gatewaydm = NULL;
+    }
+}
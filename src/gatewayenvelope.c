@@ -0,0 +1,456 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Envelope publishing packs events of many attached devices into a single
+ * gateway event, published with publishGatewayEvent() in format "wenv".
+ * The envelope is text, so it can be published with publishData():
+ *
+ *   WENV1 <records>\n
+ *   <deviceType> <deviceId> <eventType> <offsetMs> <payloadLen>\n   (one line per record)
+ *   <payload of record 1><payload of record 2>...
+ *
+ * offsetMs is the time the record was added, relative to the first record.
+ * Payloads are concatenated without separator, payloadLen gives their size.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define ENVELOPE_FORMAT        "wenv"
+#define ENVELOPE_MAGIC         "WENV1"
+#define ENVELOPE_MAX_NAME      256
+#define ENVELOPE_INDEX_LINE    (3 * ENVELOPE_MAX_NAME + 32)
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int threadStarted;
+    int stop;
+    char *eventType;
+    QoS qos;
+    int maxBytes;
+    int maxDelayMs;
+    int records;
+    struct timespec first;
+    char *index;            /* index lines */
+    int indexLen;
+    int indexSize;
+    char *payloads;         /* concatenated payloads */
+    int payloadLen;
+    int payloadSize;
+} gatewayEnvelope;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static long elapsedMs(struct timespec *from, struct timespec *to)
+{
+    return (long)((to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000);
+}
+
+/* Grow buffer to hold at least need bytes */
+static int ensureSize(char **buf, int *size, int need)
+{
+    if ( need > *size ) {
+        int newSize = *size ? *size : 1024;
+        char *tmp;
+        while ( newSize < need )
+            newSize *= 2;
+        if ( (tmp = (char *)realloc(*buf, newSize)) == NULL )
+            return -1;
+        *buf = tmp;
+        *size = newSize;
+    }
+    return 0;
+}
+
+/* Publish envelope and reset it. A failed envelope is kept for the next flush.
+ * Called with envelope lock held. */
+static int flushEnvelope(gatewayEnvelope *env)
+{
+    int rc = 0;
+    char header[32];
+    char *msg;
+    int headerLen, len;
+
+    if ( env->records == 0 )
+        return 0;
+
+    headerLen = sprintf(header, "%s %d\n", ENVELOPE_MAGIC, env->records);
+    len = headerLen + env->indexLen + env->payloadLen;
+
+    msg = (char *)malloc(len + 1);
+    if ( msg == NULL ) {
+        LOG(ERROR, "Failed to allocate envelope: size=%d", len);
+        return -1;
+    }
+    memcpy(msg, header, headerLen);
+    memcpy(msg + headerLen, env->index, env->indexLen);
+    memcpy(msg + headerLen + env->indexLen, env->payloads, env->payloadLen);
+    msg[len] = '\0';
+
+    LOG(DEBUG, "Publish envelope: records=%d size=%d", env->records, len);
+    rc = publishGatewayEvent(env->client, env->eventType, ENVELOPE_FORMAT, msg, env->qos);
+    free(msg);
+
+    if ( rc != 0 ) {
+        LOG(WARN, "Failed to publish envelope, kept for the next flush: records=%d rc=%d", env->records, rc);
+        return rc;
+    }
+
+    env->records = 0;
+    env->indexLen = 0;
+    env->payloadLen = 0;
+
+    return rc;
+}
+
+/* Flush envelopes on time limit */
+static void * envelopeThread(void *arg)
+{
+    gatewayEnvelope *env = (gatewayEnvelope *)arg;
+
+    struct timespec retry = { 0, 0 };
+
+    pthread_mutex_lock(&env->lock);
+    while ( !env->stop ) {
+        if ( env->records == 0 || env->maxDelayMs == 0 ) {
+            retry.tv_sec = 0;
+            pthread_cond_wait(&env->cond, &env->lock);
+        } else {
+            struct timespec deadline, now;
+            deadline.tv_sec = env->first.tv_sec + env->maxDelayMs / 1000;
+            deadline.tv_nsec = env->first.tv_nsec + (env->maxDelayMs % 1000) * 1000000L;
+            if ( deadline.tv_nsec >= 1000000000L ) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            /* after a failed flush, try again one time limit later */
+            if ( retry.tv_sec && (retry.tv_sec > deadline.tv_sec ||
+                 (retry.tv_sec == deadline.tv_sec && retry.tv_nsec > deadline.tv_nsec)) )
+                deadline = retry;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if ( elapsedMs(&deadline, &now) >= 0 ) {
+                retry.tv_sec = 0;
+                if ( flushEnvelope(env) != 0 ) {
+                    retry.tv_sec = now.tv_sec + env->maxDelayMs / 1000;
+                    retry.tv_nsec = now.tv_nsec + (env->maxDelayMs % 1000) * 1000000L;
+                    if ( retry.tv_nsec >= 1000000000L ) {
+                        retry.tv_sec++;
+                        retry.tv_nsec -= 1000000000L;
+                    }
+                }
+            } else {
+                pthread_cond_timedwait(&env->cond, &env->lock, &deadline);
+            }
+        }
+    }
+    pthread_mutex_unlock(&env->lock);
+
+    return NULL;
+}
+
+/**
+ * Function used to enable envelope publishing and set its limits.
+ */
+int setGatewayEnvelopeOptions(iotfclient *client, char *eventType, int maxBytes, int maxDelayMs, QoS qos)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayEnvelope *env;
+
+    if ( !client->isGateway || !eventType || *eventType == '\0' || maxBytes < 256 || maxDelayMs < 0 ) {
+        LOG(WARN, "Invalid envelope options: eventType=%s maxBytes=%d maxDelayMs=%d", eventType?eventType:"", maxBytes, maxDelayMs);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&createLock);
+    env = (gatewayEnvelope *)client->envelope;
+    if ( env == NULL ) {
+        env = (gatewayEnvelope *)calloc(1, sizeof(gatewayEnvelope));
+        if ( env != NULL ) {
+            pthread_condattr_t attr;
+
+            env->client = client;
+            pthread_mutex_init(&env->lock, NULL);
+            pthread_condattr_init(&attr);
+            pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+            pthread_cond_init(&env->cond, &attr);
+            pthread_condattr_destroy(&attr);
+            client->envelope = env;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    if ( env == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&env->lock);
+    flushEnvelope(env);
+    freePtr(env->eventType);
+    env->eventType = strdup(eventType);
+    env->maxBytes = maxBytes;
+    env->maxDelayMs = maxDelayMs;
+    env->qos = qos;
+    if ( maxDelayMs == 0 )
+        env->stop = 1;
+    pthread_cond_signal(&env->cond);
+    pthread_mutex_unlock(&env->lock);
+
+    /* no time limit, stop the flush thread */
+    if ( maxDelayMs == 0 && env->threadStarted ) {
+        pthread_join(env->thread, NULL);
+        env->threadStarted = 0;
+    }
+    env->stop = 0;
+
+    if ( maxDelayMs > 0 && !env->threadStarted ) {
+        if ( pthread_create(&env->thread, NULL, envelopeThread, env) != 0 ) {
+            LOG(ERROR, "Failed to start envelope flush thread");
+            rc = -1;
+            goto exit;
+        }
+        env->threadStarted = 1;
+    }
+
+    LOG(INFO, "Gateway envelope: eventType=%s maxBytes=%d maxDelayMs=%d qos=%d", eventType, maxBytes, maxDelayMs, qos);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to add an event of an attached device to the envelope.
+ */
+int publishEnvelopeEvent(iotfclient *client, char *deviceType, char *deviceId, char *eventType, char* data)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayEnvelope *env = (gatewayEnvelope *)client->envelope;
+    char line[ENVELOPE_INDEX_LINE];
+    struct timespec now;
+    int lineLen, dataLen;
+
+    if ( env == NULL ) {
+        LOG(ERROR, "Envelope publishing is not enabled");
+        rc = -1;
+        goto exit;
+    }
+
+    if ( !deviceType || !deviceId || !eventType || !data ||
+         strlen(deviceType) >= ENVELOPE_MAX_NAME || strlen(deviceId) >= ENVELOPE_MAX_NAME ||
+         strlen(eventType) >= ENVELOPE_MAX_NAME || strpbrk(deviceType, " \n") ||
+         strpbrk(deviceId, " \n") || strpbrk(eventType, " \n") ) {
+        LOG(WARN, "Invalid or NULL arguments");
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    dataLen = strlen(data);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&env->lock);
+
+    if ( env->records == 0 )
+        env->first = now;
+
+    lineLen = sprintf(line, "%s %s %s %ld %d\n", deviceType, deviceId, eventType, elapsedMs(&env->first, &now), dataLen);
+
+    /* Flush first if the record does not fit. If the envelope is kept, the record is refused. */
+    if ( env->records > 0 && env->indexLen + env->payloadLen + lineLen + dataLen > env->maxBytes ) {
+        if ( (rc = flushEnvelope(env)) != 0 ) {
+            pthread_mutex_unlock(&env->lock);
+            goto exit;
+        }
+        env->first = now;
+        lineLen = sprintf(line, "%s %s %s %ld %d\n", deviceType, deviceId, eventType, 0L, dataLen);
+    }
+
+    if ( ensureSize(&env->index, &env->indexSize, env->indexLen + lineLen) != 0 ||
+         ensureSize(&env->payloads, &env->payloadSize, env->payloadLen + dataLen) != 0 ) {
+        LOG(ERROR, "Failed to grow envelope buffers");
+        rc = -1;
+    } else {
+        memcpy(env->index + env->indexLen, line, lineLen);
+        env->indexLen += lineLen;
+        memcpy(env->payloads + env->payloadLen, data, dataLen);
+        env->payloadLen += dataLen;
+        env->records++;
+
+        if ( env->records == 1 )
+            pthread_cond_signal(&env->cond);
+
+        /* a single record may exceed the size limit - publish it right away. The
+         * record is added, a failed envelope is published by a later flush. */
+        if ( env->indexLen + env->payloadLen >= env->maxBytes )
+            flushEnvelope(env);
+    }
+
+    pthread_mutex_unlock(&env->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to publish the envelope now.
+ */
+int flushGatewayEnvelope(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayEnvelope *env = (gatewayEnvelope *)client->envelope;
+
+    if ( env != NULL ) {
+        pthread_mutex_lock(&env->lock);
+        rc = flushEnvelope(env);
+        pthread_mutex_unlock(&env->lock);
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/* Parse a decimal number of at most max, advance pointer */
+static int parseNumber(const char **p, const char *end, long max, long *value)
+{
+    const char *s = *p;
+    long v = 0;
+
+    if ( s >= end || !isdigit((unsigned char)*s) )
+        return -1;
+    while ( s < end && isdigit((unsigned char)*s) ) {
+        int d = *s++ - '0';
+        if ( d > max || v > (max - d) / 10 )
+            return -1;
+        v = v * 10 + d;
+    }
+
+    *value = v;
+    *p = s;
+    return 0;
+}
+
+/* Parse a space terminated name into buf, advance pointer */
+static int parseName(const char **p, const char *end, char *buf)
+{
+    const char *s = *p;
+    int n = 0;
+
+    while ( s < end && *s != ' ' && *s != '\n' ) {
+        if ( n >= ENVELOPE_MAX_NAME - 1 )
+            return -1;
+        buf[n++] = *s++;
+    }
+    if ( n == 0 || s >= end || *s != ' ' )
+        return -1;
+
+    buf[n] = '\0';
+    *p = s + 1;
+    return 0;
+}
+
+/**
+ * Function used to decode an envelope.
+ */
+int decodeGatewayEnvelope(char *envelope, int len, envelopeRecordCallback cb, void *context)
+{
+    const char *p = envelope;
+    const char *end = envelope + len;
+    const char *payload;
+    char deviceType[ENVELOPE_MAX_NAME];
+    char deviceId[ENVELOPE_MAX_NAME];
+    char eventType[ENVELOPE_MAX_NAME];
+    long records, offsetMs, payloadLen, total = 0;
+    long i;
+
+    if ( envelope == NULL || len < (int)strlen(ENVELOPE_MAGIC) + 3 ||
+         strncmp(p, ENVELOPE_MAGIC " ", strlen(ENVELOPE_MAGIC) + 1) != 0 )
+        return -1;
+
+    p += strlen(ENVELOPE_MAGIC) + 1;
+    /* each record has an index line, so there are fewer records than bytes */
+    if ( parseNumber(&p, end, len, &records) != 0 || p >= end || *p++ != '\n' )
+        return -1;
+
+    /* first pass over index to find start of payloads */
+    payload = p;
+    for (i = 0; i < records; i++) {
+        payload = memchr(payload, '\n', end - payload);
+        if ( payload == NULL )
+            return -1;
+        payload++;
+    }
+
+    for (i = 0; i < records; i++) {
+        if ( parseName(&p, end, deviceType) != 0 || parseName(&p, end, deviceId) != 0 ||
+             parseName(&p, end, eventType) != 0 || parseNumber(&p, end, LONG_MAX, &offsetMs) != 0 ||
+             p >= end || *p++ != ' ' || parseNumber(&p, end, (end - payload) - total, &payloadLen) != 0 ||
+             p >= end || *p++ != '\n' )
+            return -1;
+
+        if ( cb )
+            (*cb)(context, deviceType, deviceId, eventType, offsetMs, (char *)payload + total, (int)payloadLen);
+        total += payloadLen;
+    }
+
+    return (int)records;
+}
+
+/*
+ * Flush pending envelope and free envelope state
+ */
+void freeGatewayEnvelope(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayEnvelope *env = (gatewayEnvelope *)client->envelope;
+
+    if ( env != NULL ) {
+        pthread_mutex_lock(&env->lock);
+        if ( flushEnvelope(env) != 0 )
+            LOG(WARN, "Envelope dropped: records=%d", env->records);
+        env->stop = 1;
+        pthread_cond_signal(&env->cond);
+        pthread_mutex_unlock(&env->lock);
+
+        if ( env->threadStarted )
+            pthread_join(env->thread, NULL);
+
+        pthread_cond_destroy(&env->cond);
+        pthread_mutex_destroy(&env->lock);
+        freePtr(env->eventType);
+        freePtr(env->index);
+        freePtr(env->payloads);
+        free(env);
+        client->envelope = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -0,0 +1,514 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Local ingest endpoint for gateways. Co-located sensor processes submit device
+ * events over a UNIX domain datagram socket, a UNIX domain stream socket or UDP
+ * on loopback. The ingest thread reads frames in batches and forwards them
+ * through publishDeviceEvent(). Frames are parsed in place - the strings in a
+ * frame are NUL terminated by the sender, so no field is copied.
+ *
+ * Frame format (all lengths include the terminating NUL):
+ *
+ *   byte 0     : INGEST_FRAME_MAGIC
+ *   byte 1     : QoS
+ *   byte 2     : length of device type
+ *   byte 3     : length of device id
+ *   byte 4     : length of event type
+ *   byte 5     : length of event format
+ *   byte 6-7   : length of payload, big endian
+ *   byte 8-    : device type, device id, event type, event format, payload
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define INGEST_FRAME_MAGIC    0x57
+#define INGEST_HEADER_SIZE    8
+#define INGEST_MAX_FRAME      16384
+#define INGEST_BATCH          8
+#define INGEST_MAX_CONNS      16
+
+/* Stream connection with partial frame buffer */
+typedef struct {
+    int fd;
+    int used;
+    char *buf;
+} ingestConn;
+
+typedef struct {
+    iotfclient *client;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int stop;
+    int wakeFds[2];
+    int dgramFd;
+    int streamFd;
+    int udpFd;
+    char *dgramPath;
+    char *streamPath;
+    ingestConn conns[INGEST_MAX_CONNS];
+    GatewayIngestStats stats;
+} gatewayIngest;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * Function used to encode a device event into an ingest frame.
+ */
+int encodeIngestFrame(char *buf, int bufLen, char *deviceType, char *deviceId, char *eventType, char *eventFormat, char *data, QoS qos)
+{
+    size_t typeLen, idLen, evtLen, fmtLen, dataLen;
+    int frameLen;
+    char *p;
+
+    if ( !buf || !deviceType || !deviceId || !eventType || !eventFormat || !data )
+        return MISSING_INPUT_PARAM;
+
+    typeLen = strlen(deviceType) + 1;
+    idLen = strlen(deviceId) + 1;
+    evtLen = strlen(eventType) + 1;
+    fmtLen = strlen(eventFormat) + 1;
+    dataLen = strlen(data) + 1;
+
+    /* names must not be empty, the payload may be */
+    if ( typeLen < 2 || idLen < 2 || evtLen < 2 || fmtLen < 2 ||
+         typeLen > 255 || idLen > 255 || evtLen > 255 || fmtLen > 255 || dataLen > 65535 )
+        return MISSING_INPUT_PARAM;
+
+    frameLen = INGEST_HEADER_SIZE + typeLen + idLen + evtLen + fmtLen + dataLen;
+    if ( frameLen > bufLen || frameLen > INGEST_MAX_FRAME )
+        return -1;
+
+    p = buf;
+    *p++ = INGEST_FRAME_MAGIC;
+    *p++ = (char)qos;
+    *p++ = (char)typeLen;
+    *p++ = (char)idLen;
+    *p++ = (char)evtLen;
+    *p++ = (char)fmtLen;
+    *p++ = (char)((dataLen >> 8) & 0xFF);
+    *p++ = (char)(dataLen & 0xFF);
+    memcpy(p, deviceType, typeLen); p += typeLen;
+    memcpy(p, deviceId, idLen); p += idLen;
+    memcpy(p, eventType, evtLen); p += evtLen;
+    memcpy(p, eventFormat, fmtLen); p += fmtLen;
+    memcpy(p, data, dataLen);
+
+    return frameLen;
+}
+
+/* Length of the frame starting at buf, 0 if more data is needed, -1 if malformed */
+static int frameLength(unsigned char *buf, int len)
+{
+    int frameLen;
+
+    if ( len < INGEST_HEADER_SIZE )
+        return 0;
+
+    if ( buf[0] != INGEST_FRAME_MAGIC || buf[1] > QoS2 )
+        return -1;
+
+    frameLen = INGEST_HEADER_SIZE + buf[2] + buf[3] + buf[4] + buf[5] + (buf[6] << 8 | buf[7]);
+    if ( frameLen > INGEST_MAX_FRAME )
+        return -1;
+
+    return (len >= frameLen) ? frameLen : 0;
+}
+
+/* Validate frame in place and forward it. Frame length is already checked. */
+static void forwardFrame(gatewayIngest *ingest, unsigned char *buf, int frameLen)
+{
+    char *fields[5];
+    int lens[5];
+    char *p = (char *)buf + INGEST_HEADER_SIZE;
+    int i, rc;
+
+    lens[0] = buf[2];
+    lens[1] = buf[3];
+    lens[2] = buf[4];
+    lens[3] = buf[5];
+    lens[4] = buf[6] << 8 | buf[7];
+
+    /* NUL terminated fields, names not empty, the payload (field 4) may be */
+    for (i = 0; i < 5; i++) {
+        if ( lens[i] < (i == 4 ? 1 : 2) || p[lens[i] - 1] != '\0' ) {
+            LOG(WARN, "Malformed ingest frame: field=%d len=%d", i, lens[i]);
+            pthread_mutex_lock(&ingest->lock);
+            ingest->stats.malformed++;
+            pthread_mutex_unlock(&ingest->lock);
+            return;
+        }
+        fields[i] = p;
+        p += lens[i];
+    }
+
+    rc = publishDeviceEvent(ingest->client, fields[0], fields[1], fields[2], fields[3], fields[4], (QoS)buf[1]);
+
+    pthread_mutex_lock(&ingest->lock);
+    ingest->stats.frames++;
+    ingest->stats.bytes += frameLen;
+    if ( rc == 0 )
+        ingest->stats.forwarded++;
+    else
+        ingest->stats.failed++;
+    pthread_mutex_unlock(&ingest->lock);
+}
+
+/* Read a batch of datagrams from a datagram socket */
+static void readDatagrams(gatewayIngest *ingest, int fd, unsigned char *bufs)
+{
+    struct mmsghdr msgs[INGEST_BATCH];
+    struct iovec iovs[INGEST_BATCH];
+    int i, n;
+
+    memset((void *)msgs, 0, sizeof(msgs));
+    for (i = 0; i < INGEST_BATCH; i++) {
+        iovs[i].iov_base = bufs + i * INGEST_MAX_FRAME;
+        iovs[i].iov_len = INGEST_MAX_FRAME;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    n = recvmmsg(fd, msgs, INGEST_BATCH, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++) {
+        unsigned char *buf = bufs + i * INGEST_MAX_FRAME;
+        int len = (int)msgs[i].msg_len;
+        int frameLen = frameLength(buf, len);
+
+        if ( frameLen != len ) {
+            LOG(WARN, "Malformed ingest datagram: len=%d frameLen=%d", len, frameLen);
+            pthread_mutex_lock(&ingest->lock);
+            ingest->stats.malformed++;
+            pthread_mutex_unlock(&ingest->lock);
+            continue;
+        }
+        forwardFrame(ingest, buf, frameLen);
+    }
+}
+
+static void closeConn(ingestConn *conn)
+{
+    close(conn->fd);
+    free(conn->buf);
+    conn->fd = -1;
+    conn->buf = NULL;
+    conn->used = 0;
+}
+
+/* Read from a stream connection and forward all complete frames */
+static void readStream(gatewayIngest *ingest, ingestConn *conn)
+{
+    int n, off = 0, frameLen;
+
+    n = read(conn->fd, conn->buf + conn->used, INGEST_MAX_FRAME - conn->used);
+    if ( n <= 0 ) {
+        if ( n < 0 && (errno == EAGAIN || errno == EINTR) )
+            return;
+        closeConn(conn);
+        return;
+    }
+    conn->used += n;
+
+    while ( (frameLen = frameLength((unsigned char *)conn->buf + off, conn->used - off)) > 0 ) {
+        forwardFrame(ingest, (unsigned char *)conn->buf + off, frameLen);
+        off += frameLen;
+    }
+
+    if ( frameLen < 0 ) {
+        LOG(WARN, "Malformed ingest stream - closing connection");
+        pthread_mutex_lock(&ingest->lock);
+        ingest->stats.malformed++;
+        pthread_mutex_unlock(&ingest->lock);
+        closeConn(conn);
+        return;
+    }
+
+    if ( off > 0 ) {
+        memmove(conn->buf, conn->buf + off, conn->used - off);
+        conn->used -= off;
+    }
+}
+
+static void acceptConn(gatewayIngest *ingest)
+{
+    int fd = accept(ingest->streamFd, NULL, NULL);
+    int i;
+
+    if ( fd < 0 )
+        return;
+
+    for (i = 0; i < INGEST_MAX_CONNS; i++) {
+        if ( ingest->conns[i].fd < 0 ) {
+            ingest->conns[i].buf = (char *)malloc(INGEST_MAX_FRAME);
+            if ( ingest->conns[i].buf == NULL )
+                break;
+            ingest->conns[i].fd = fd;
+            ingest->conns[i].used = 0;
+            return;
+        }
+    }
+
+    LOG(WARN, "Ingest stream connection rejected - too many connections");
+    close(fd);
+}
+
+/* Ingest thread */
+static void * ingestThread(void *arg)
+{
+    gatewayIngest *ingest = (gatewayIngest *)arg;
+    struct pollfd fds[4 + INGEST_MAX_CONNS];
+    int connIdx[4 + INGEST_MAX_CONNS];
+    unsigned char *bufs;
+    int i, nfds;
+
+    bufs = (unsigned char *)malloc(INGEST_BATCH * INGEST_MAX_FRAME);
+    if ( bufs == NULL ) {
+        LOG(ERROR, "Failed to allocate ingest buffers");
+        return NULL;
+    }
+
+    LOG(INFO, "Gateway ingest thread started");
+
+    while ( !ingest->stop ) {
+        nfds = 0;
+        fds[nfds].fd = ingest->wakeFds[0]; fds[nfds].events = POLLIN; connIdx[nfds++] = -1;
+        if ( ingest->dgramFd >= 0 ) { fds[nfds].fd = ingest->dgramFd; fds[nfds].events = POLLIN; connIdx[nfds++] = -1; }
+        if ( ingest->udpFd >= 0 ) { fds[nfds].fd = ingest->udpFd; fds[nfds].events = POLLIN; connIdx[nfds++] = -1; }
+        if ( ingest->streamFd >= 0 ) { fds[nfds].fd = ingest->streamFd; fds[nfds].events = POLLIN; connIdx[nfds++] = -1; }
+        for (i = 0; i < INGEST_MAX_CONNS; i++) {
+            if ( ingest->conns[i].fd >= 0 ) {
+                fds[nfds].fd = ingest->conns[i].fd;
+                fds[nfds].events = POLLIN;
+                connIdx[nfds++] = i;
+            }
+        }
+
+        if ( poll(fds, nfds, -1) <= 0 )
+            continue;
+
+        for (i = 1; i < nfds; i++) {
+            if ( !(fds[i].revents & (POLLIN | POLLHUP | POLLERR)) )
+                continue;
+            if ( connIdx[i] >= 0 )
+                readStream(ingest, &ingest->conns[connIdx[i]]);
+            else if ( fds[i].fd == ingest->streamFd )
+                acceptConn(ingest);
+            else
+                readDatagrams(ingest, fds[i].fd, bufs);
+        }
+    }
+
+    free(bufs);
+    LOG(INFO, "Gateway ingest thread stopped");
+    return NULL;
+}
+
+/* Create and bind UNIX domain socket */
+static int bindUnixSocket(const char *path, int type)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if ( strlen(path) >= sizeof(addr.sun_path) ) {
+        LOG(ERROR, "Ingest socket path is too long: %s", path);
+        return -1;
+    }
+
+    if ( (fd = socket(AF_UNIX, type, 0)) < 0 ) {
+        LOG(ERROR, "Failed to create ingest socket: errno=%d", errno);
+        return -1;
+    }
+
+    memset((void *)&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+         (type == SOCK_STREAM && listen(fd, INGEST_MAX_CONNS) != 0) ) {
+        LOG(ERROR, "Failed to bind ingest socket %s: errno=%d", path, errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Create UDP socket bound to loopback */
+static int bindUdpSocket(int port)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+    if ( (fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+        LOG(ERROR, "Failed to create ingest UDP socket: errno=%d", errno);
+        return -1;
+    }
+
+    memset((void *)&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((unsigned short)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if ( bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ) {
+        LOG(ERROR, "Failed to bind ingest UDP port %d: errno=%d", port, errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void closeIngest(gatewayIngest *ingest)
+{
+    int i;
+
+    for (i = 0; i < INGEST_MAX_CONNS; i++) {
+        if ( ingest->conns[i].fd >= 0 )
+            closeConn(&ingest->conns[i]);
+    }
+    if ( ingest->dgramFd >= 0 ) close(ingest->dgramFd);
+    if ( ingest->streamFd >= 0 ) close(ingest->streamFd);
+    if ( ingest->udpFd >= 0 ) close(ingest->udpFd);
+    if ( ingest->wakeFds[0] >= 0 ) close(ingest->wakeFds[0]);
+    if ( ingest->wakeFds[1] >= 0 ) close(ingest->wakeFds[1]);
+    if ( ingest->dgramPath ) { unlink(ingest->dgramPath); free(ingest->dgramPath); }
+    if ( ingest->streamPath ) { unlink(ingest->streamPath); free(ingest->streamPath); }
+    pthread_mutex_destroy(&ingest->lock);
+    free(ingest);
+}
+
+/**
+ * Function used to start the local ingest server of a gateway.
+ */
+int startGatewayIngest(iotfclient *client, char *dgramPath, char *streamPath, int udpPort)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    int i;
+    gatewayIngest *ingest = NULL;
+
+    pthread_mutex_lock(&createLock);
+    if ( !client->isGateway || client->ingest != NULL ) {
+        LOG(ERROR, "Ingest server requires a gateway client and can be started only once");
+        rc = -1;
+        goto exit;
+    }
+
+    if ( (!dgramPath || *dgramPath == '\0') && (!streamPath || *streamPath == '\0') && udpPort <= 0 ) {
+        LOG(WARN, "No ingest endpoint is specified");
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    ingest = (gatewayIngest *)calloc(1, sizeof(gatewayIngest));
+    if ( ingest == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+    ingest->client = client;
+    ingest->dgramFd = ingest->streamFd = ingest->udpFd = -1;
+    ingest->wakeFds[0] = ingest->wakeFds[1] = -1;
+    for (i = 0; i < INGEST_MAX_CONNS; i++)
+        ingest->conns[i].fd = -1;
+    pthread_mutex_init(&ingest->lock, NULL);
+
+    if ( pipe(ingest->wakeFds) != 0 ) {
+        rc = -1;
+        goto error;
+    }
+
+    if ( dgramPath && *dgramPath != '\0' ) {
+        if ( (ingest->dgramFd = bindUnixSocket(dgramPath, SOCK_DGRAM)) < 0 ) { rc = -1; goto error; }
+        ingest->dgramPath = strdup(dgramPath);
+    }
+    if ( streamPath && *streamPath != '\0' ) {
+        if ( (ingest->streamFd = bindUnixSocket(streamPath, SOCK_STREAM)) < 0 ) { rc = -1; goto error; }
+        ingest->streamPath = strdup(streamPath);
+    }
+    if ( udpPort > 0 ) {
+        if ( (ingest->udpFd = bindUdpSocket(udpPort)) < 0 ) { rc = -1; goto error; }
+    }
+
+    if ( pthread_create(&ingest->thread, NULL, ingestThread, ingest) != 0 ) {
+        LOG(ERROR, "Failed to start ingest thread");
+        rc = -1;
+        goto error;
+    }
+
+    client->ingest = ingest;
+    LOG(INFO, "Gateway ingest started: dgram=%s stream=%s udpPort=%d",
+        dgramPath?dgramPath:"", streamPath?streamPath:"", udpPort);
+    goto exit;
+
+error:
+    closeIngest(ingest);
+
+exit:
+    pthread_mutex_unlock(&createLock);
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to stop the local ingest server of a gateway.
+ */
+int stopGatewayIngest(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayIngest *ingest = (gatewayIngest *)client->ingest;
+    int rc = 0;
+
+    if ( ingest != NULL ) {
+        ingest->stop = 1;
+        if ( write(ingest->wakeFds[1], "x", 1) != 1 )
+            LOG(WARN, "Failed to wake ingest thread: errno=%d", errno);
+        pthread_join(ingest->thread, NULL);
+        closeIngest(ingest);
+        client->ingest = NULL;
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get statistics of the local ingest server.
+ */
+int getGatewayIngestStats(iotfclient *client, GatewayIngestStats *stats)
+{
+    gatewayIngest *ingest = (gatewayIngest *)client->ingest;
+
+    if ( ingest == NULL || stats == NULL )
+        return -1;
+
+    pthread_mutex_lock(&ingest->lock);
+    *stats = ingest->stats;
+    pthread_mutex_unlock(&ingest->lock);
+
+    return 0;
+}
@@ -0,0 +1,384 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Gateway notifications are published by the platform on
+ * iot-2/type/<gatewayType>/id/<gatewayId>/notify when a request made by the
+ * gateway on behalf of an attached device fails. Payload example:
+ *
+ * {"Request":"Publish","Time":"2018-02-07T20:52:36.522Z",
+ *  "Topic":"iot-2/type/DevType/id/DevId/evt/status/fmt/json",
+ *  "Type":"DevType","Id":"DevId","Client":"g:org:GwType:GwId",
+ *  "RC":135,"Message":"The client is not authorized ..."}
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+#include "cJSON.h"
+
+/* Per device error state */
+typedef struct {
+    char *deviceType;
+    char *deviceId;
+    GatewayDeviceErrorStats stats;
+    time_t lastError;
+    time_t backoffUntil;
+} notifyDevice;
+
+typedef struct {
+    pthread_mutex_t lock;
+    gatewayNotificationCallback cb;
+    int backoffMin;
+    int backoffMax;
+    int count;
+    int size;
+    notifyDevice *devices;
+} gatewayNotifier;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Case insensitive substring check */
+static int containsNoCase(const char *str, const char *sub)
+{
+    size_t len = strlen(sub);
+
+    if ( str == NULL )
+        return 0;
+
+    for ( ; *str; str++) {
+        if ( strncasecmp(str, sub, len) == 0 )
+            return 1;
+    }
+    return 0;
+}
+
+/* Classify platform error - by MQTT reason code, else by message text */
+static GatewayNotifyError classifyNotification(int rc, const char *message)
+{
+    if ( rc == 5 || rc == 135 || containsNoCase(message, "not authorized") )
+        return GWNOTIFY_UNAUTHORIZED;
+
+    if ( rc == 144 || rc == 160 || (containsNoCase(message, "topic") &&
+         (containsNoCase(message, "not valid") || containsNoCase(message, "invalid"))) )
+        return GWNOTIFY_INVALID_TOPIC;
+
+    if ( rc == 151 || rc == 159 || containsNoCase(message, "throttl") || containsNoCase(message, "quota") ||
+         containsNoCase(message, "rate limit") )
+        return GWNOTIFY_THROTTLED;
+
+    return GWNOTIFY_OTHER;
+}
+
+/* Get notifier of the client, create if not set */
+static gatewayNotifier * getNotifier(iotfclient *client)
+{
+    gatewayNotifier *notifier;
+
+    pthread_mutex_lock(&createLock);
+    notifier = (gatewayNotifier *)client->notifier;
+    if ( notifier == NULL ) {
+        notifier = (gatewayNotifier *)calloc(1, sizeof(gatewayNotifier));
+        if ( notifier != NULL ) {
+            pthread_mutex_init(&notifier->lock, NULL);
+            client->notifier = notifier;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    if ( notifier == NULL )
+        LOG(ERROR, "Failed to allocate gateway notifier");
+
+    return notifier;
+}
+
+/* Find device error state, add it if create is set. Called with notifier lock held. */
+static notifyDevice * findNotifyDevice(gatewayNotifier *notifier, const char *deviceType, const char *deviceId, int create)
+{
+    notifyDevice *dev;
+    int i;
+
+    for (i = 0; i < notifier->count; i++) {
+        dev = &notifier->devices[i];
+        if ( !strcmp(dev->deviceId, deviceId) && !strcmp(dev->deviceType, deviceType) )
+            return dev;
+    }
+
+    if ( !create )
+        return NULL;
+
+    if ( notifier->count == notifier->size ) {
+        int newSize = notifier->size ? notifier->size * 2 : 8;
+        notifyDevice *tmp = (notifyDevice *)realloc(notifier->devices, newSize * sizeof(notifyDevice));
+        if ( tmp == NULL ) {
+            LOG(ERROR, "Failed to grow notification device table: size=%d", newSize);
+            return NULL;
+        }
+        notifier->devices = tmp;
+        notifier->size = newSize;
+    }
+
+    dev = &notifier->devices[notifier->count++];
+    memset((void *)dev, 0, sizeof(notifyDevice));
+    dev->deviceType = strdup(deviceType);
+    dev->deviceId = strdup(deviceId);
+
+    return dev;
+}
+
+/* Account error to device and update its back off. Called with notifier lock held. */
+static void recordDeviceError(gatewayNotifier *notifier, notifyDevice *dev, GatewayNotifyError error)
+{
+    time_t now = time(NULL);
+
+    switch (error) {
+        case GWNOTIFY_UNAUTHORIZED:  dev->stats.unauthorized++; break;
+        case GWNOTIFY_INVALID_TOPIC: dev->stats.invalidTopic++; break;
+        case GWNOTIFY_THROTTLED:     dev->stats.throttled++; break;
+        default:                     dev->stats.other++; break;
+    }
+
+    if ( notifier->backoffMin > 0 ) {
+        /* start over if the device was quiet for longer than the maximum interval */
+        if ( dev->stats.backoffSecs == 0 || now - dev->lastError > notifier->backoffMax + dev->stats.backoffSecs ) {
+            dev->stats.backoffSecs = notifier->backoffMin;
+        } else if ( now >= dev->backoffUntil ) {
+            dev->stats.backoffSecs *= 2;
+            if ( dev->stats.backoffSecs > notifier->backoffMax )
+                dev->stats.backoffSecs = notifier->backoffMax;
+        }
+        dev->backoffUntil = now + dev->stats.backoffSecs;
+        LOG(INFO, "Back off device type=%s id=%s for %d seconds", dev->deviceType, dev->deviceId, dev->stats.backoffSecs);
+    }
+
+    dev->lastError = now;
+}
+
+/* Get string value of a JSON object item */
+static char * jsonString(cJSON *obj, const char *name)
+{
+    cJSON *item = cJSON_GetObjectItem(obj, name);
+    return cJSON_IsString(item) ? item->valuestring : NULL;
+}
+
+/*
+ * Process gateway notification. Invoked from messageArrived() for the notify topic.
+ */
+int messageArrived_notify(iotfclient *client, char *topic, void *payload, size_t len)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayNotifier *notifier;
+    gatewayNotificationCallback handler = NULL;
+    GatewayNotifyError error;
+    cJSON *json = NULL;
+    cJSON *item;
+    char *pl = NULL;
+    char *type;
+    char *id;
+    char *request;
+    char *message;
+    int rc = 0;
+
+    LOG(INFO, "Gateway notification. Topic=%s PayloadLen=%d", topic, (int)len);
+
+    if ( (notifier = getNotifier(client)) == NULL )
+        goto exit;
+
+    /* payload is not NUL terminated */
+    pl = (char *)malloc(len + 1);
+    if ( pl == NULL )
+        goto exit;
+    memcpy(pl, payload, len);
+    pl[len] = '\0';
+
+    json = cJSON_Parse(pl);
+    if ( json == NULL ) {
+        LOG(WARN, "Failed to parse gateway notification: %s", pl);
+        goto exit;
+    }
+
+    type = jsonString(json, "Type");
+    id = jsonString(json, "Id");
+    request = jsonString(json, "Request");
+    message = jsonString(json, "Message");
+    item = cJSON_GetObjectItem(json, "RC");
+    if ( cJSON_IsNumber(item) )
+        rc = item->valueint;
+
+    error = classifyNotification(rc, message);
+
+    LOG(WARN, "Gateway notification: type=%s id=%s request=%s rc=%d class=%d message=%s",
+        type?type:"", id?id:"", request?request:"", rc, (int)error, message?message:"");
+
+    pthread_mutex_lock(&notifier->lock);
+    if ( type && id ) {
+        notifyDevice *dev = findNotifyDevice(notifier, type, id, 1);
+        if ( dev )
+            recordDeviceError(notifier, dev, error);
+    }
+    handler = notifier->cb;
+    pthread_mutex_unlock(&notifier->lock);
+
+    if ( handler != NULL ) {
+        LOG(TRACE, "Calling registered gateway notification callback");
+        (*handler)(type, id, error, rc, request, message);
+    }
+
+exit:
+    if ( json )
+        cJSON_Delete(json);
+    freePtr(pl);
+
+    LOG(TRACE, "exit::");
+    return 1;
+}
+
+/*
+ * Check if publishes on behalf of the device are suspended.
+ * Returns 1 if the device is backed off.
+ */
+int gatewayDeviceBackedOff(iotfclient *client, char *deviceType, char *deviceId)
+{
+    gatewayNotifier *notifier = (gatewayNotifier *)client->notifier;
+    notifyDevice *dev;
+    int backedOff = 0;
+
+    if ( notifier == NULL )
+        return 0;
+
+    pthread_mutex_lock(&notifier->lock);
+    if ( notifier->backoffMin != 0 && notifier->count != 0 ) {
+        dev = findNotifyDevice(notifier, deviceType, deviceId, 0);
+        if ( dev && time(NULL) < dev->backoffUntil )
+            backedOff = 1;
+    }
+    pthread_mutex_unlock(&notifier->lock);
+
+    return backedOff;
+}
+
+/**
+ * Function used to set the gateway notification callback.
+ */
+void setGatewayNotificationHandler(iotfclient *client, gatewayNotificationCallback handler)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayNotifier *notifier = getNotifier(client);
+
+    if ( notifier != NULL ) {
+        pthread_mutex_lock(&notifier->lock);
+        notifier->cb = handler;
+        pthread_mutex_unlock(&notifier->lock);
+    }
+
+    if (handler != NULL){
+        LOG(INFO, "Client ID %s : Registered callabck to process gateway notifications", client->cfg.id);
+    } else {
+        LOG(INFO, "Client ID %s : Callabck not registered to process gateway notifications", client->cfg.id);
+    }
+
+    LOG(TRACE, "exit::");
+}
+
+/**
+ * Function used to enable back off of attached devices rejected by the platform.
+ */
+int setGatewayDeviceBackoff(iotfclient *client, int minSecs, int maxSecs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayNotifier *notifier;
+
+    if ( minSecs < 0 || (minSecs > 0 && maxSecs < minSecs) ) {
+        LOG(WARN, "Invalid back off interval: min=%d max=%d", minSecs, maxSecs);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (notifier = getNotifier(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&notifier->lock);
+    notifier->backoffMin = minSecs;
+    notifier->backoffMax = maxSecs;
+    pthread_mutex_unlock(&notifier->lock);
+
+    LOG(INFO, "Gateway device back off: min=%d max=%d", minSecs, maxSecs);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get error statistics of an attached device
+ */
+int getDeviceErrorStats(iotfclient *client, char *deviceType, char *deviceId, GatewayDeviceErrorStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = -1;
+    gatewayNotifier *notifier = (gatewayNotifier *)client->notifier;
+    notifyDevice *dev;
+
+    if ( notifier == NULL || !deviceType || !deviceId || !stats )
+        goto exit;
+
+    pthread_mutex_lock(&notifier->lock);
+    dev = findNotifyDevice(notifier, deviceType, deviceId, 0);
+    if ( dev ) {
+        time_t now = time(NULL);
+        *stats = dev->stats;
+        stats->backoffRemaining = (dev->backoffUntil > now) ? (long)(dev->backoffUntil - now) : 0;
+        if ( stats->backoffRemaining == 0 )
+            stats->backoffSecs = 0;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&notifier->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Free gateway notifier
+ */
+void freeGatewayNotifier(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayNotifier *notifier = (gatewayNotifier *)client->notifier;
+    int i;
+
+    if ( notifier != NULL ) {
+        for (i = 0; i < notifier->count; i++) {
+            free(notifier->devices[i].deviceType);
+            free(notifier->devices[i].deviceId);
+        }
+        free(notifier->devices);
+        pthread_mutex_destroy(&notifier->lock);
+        free(notifier);
+        client->notifier = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
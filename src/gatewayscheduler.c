@@ -0,0 +1,461 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Deficit round robin scheduler for events published by a gateway on behalf of
+ * attached devices. Each device has its own bounded queue. On every round a
+ * backlogged device is credited with quantum * weight bytes and may publish
+ * queued events as long as the credit covers the payload size.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define SCHED_DEFAULT_QUANTUM    1024
+#define SCHED_DEFAULT_WEIGHT     1
+#define SCHED_DEFAULT_QUEUECAP   64
+
+/* Queued event - topic parts and payload are stored after the header */
+typedef struct schedEvent {
+    struct schedEvent *next;
+    struct timespec enqueued;
+    int qos;
+    int size;
+    char *eventType;
+    char *eventFormat;
+    char *data;
+} schedEvent;
+
+/* Per device queue */
+typedef struct {
+    unsigned long hash;
+    char *deviceType;
+    char *deviceId;
+    int weight;
+    int queueCap;
+    long deficit;
+    schedEvent *head;
+    schedEvent *tail;
+    GatewaySchedulerStats stats;
+    double totalQueueDelayMs;
+} schedDevice;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int quantum;
+    int defaultWeight;
+    int defaultQueueCap;
+    int nextDevice;
+    int credited;
+    int count;
+    int size;
+    schedDevice *devices;
+} gatewayScheduler;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Hash of device type and id - used to avoid string compare on lookup */
+static unsigned long deviceHash(const char *deviceType, const char *deviceId)
+{
+    unsigned long h = 5381;
+    const char *p;
+
+    for (p = deviceType; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+    h = (h << 5) + h + '/';
+    for (p = deviceId; *p; p++)
+        h = (h << 5) + h + (unsigned char)*p;
+
+    return h;
+}
+
+static double elapsedMs(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1000000.0;
+}
+
+/* Get scheduler of the client, create if not set */
+static gatewayScheduler * getScheduler(iotfclient *client)
+{
+    gatewayScheduler *sched;
+
+    pthread_mutex_lock(&createLock);
+    sched = (gatewayScheduler *)client->scheduler;
+    if ( sched == NULL ) {
+        sched = (gatewayScheduler *)calloc(1, sizeof(gatewayScheduler));
+        if ( sched != NULL ) {
+            pthread_mutex_init(&sched->lock, NULL);
+            sched->quantum = SCHED_DEFAULT_QUANTUM;
+            sched->defaultWeight = SCHED_DEFAULT_WEIGHT;
+            sched->defaultQueueCap = SCHED_DEFAULT_QUEUECAP;
+            client->scheduler = sched;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    if ( sched == NULL )
+        LOG(ERROR, "Failed to allocate gateway scheduler");
+
+    return sched;
+}
+
+/* Find device queue, add it if create is set. Called with scheduler lock held. */
+static schedDevice * findDevice(gatewayScheduler *sched, char *deviceType, char *deviceId, int create)
+{
+    unsigned long hash = deviceHash(deviceType, deviceId);
+    schedDevice *dev;
+    int i;
+
+    for (i = 0; i < sched->count; i++) {
+        dev = &sched->devices[i];
+        if ( dev->hash == hash && !strcmp(dev->deviceId, deviceId) && !strcmp(dev->deviceType, deviceType) )
+            return dev;
+    }
+
+    if ( !create )
+        return NULL;
+
+    if ( sched->count == sched->size ) {
+        int newSize = sched->size ? sched->size * 2 : 16;
+        schedDevice *tmp = (schedDevice *)realloc(sched->devices, newSize * sizeof(schedDevice));
+        if ( tmp == NULL ) {
+            LOG(ERROR, "Failed to grow scheduler device table: size=%d", newSize);
+            return NULL;
+        }
+        sched->devices = tmp;
+        sched->size = newSize;
+    }
+
+    dev = &sched->devices[sched->count];
+    memset((void *)dev, 0, sizeof(schedDevice));
+    dev->hash = hash;
+    dev->deviceType = strdup(deviceType);
+    dev->deviceId = strdup(deviceId);
+    dev->weight = sched->defaultWeight;
+    dev->queueCap = sched->defaultQueueCap;
+    sched->count++;
+
+    LOG(DEBUG, "Added scheduler queue for device type=%s id=%s", deviceType, deviceId);
+
+    return dev;
+}
+
+/**
+ * Function used to set the gateway uplink scheduler options.
+ */
+int setGatewaySchedulerOptions(iotfclient *client, int quantum, int defaultWeight, int defaultQueueCap)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayScheduler *sched;
+
+    if ( quantum <= 0 || defaultWeight <= 0 || defaultQueueCap <= 0 ) {
+        LOG(WARN, "Invalid scheduler options: quantum=%d weight=%d queueCap=%d", quantum, defaultWeight, defaultQueueCap);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (sched = getScheduler(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    sched->quantum = quantum;
+    sched->defaultWeight = defaultWeight;
+    sched->defaultQueueCap = defaultQueueCap;
+    pthread_mutex_unlock(&sched->lock);
+
+    LOG(INFO, "Gateway scheduler: quantum=%d defaultWeight=%d defaultQueueCap=%d", quantum, defaultWeight, defaultQueueCap);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the scheduling weight and queue cap of an attached device.
+ */
+int setDeviceSchedulerWeight(iotfclient *client, char *deviceType, char *deviceId, int weight, int queueCap)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayScheduler *sched;
+    schedDevice *dev;
+
+    if ( !deviceType || !deviceId || weight <= 0 || queueCap < 0 ) {
+        LOG(WARN, "Invalid or NULL arguments");
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (sched = getScheduler(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&sched->lock);
+    dev = findDevice(sched, deviceType, deviceId, 1);
+    if ( dev ) {
+        dev->weight = weight;
+        dev->queueCap = queueCap ? queueCap : sched->defaultQueueCap;
+    } else {
+        rc = -1;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    LOG(DEBUG, "Device type=%s id=%s weight=%d queueCap=%d", deviceType, deviceId, weight, queueCap);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to queue an event on behalf of a device.
+ */
+int queueDeviceEvent(iotfclient *client, char *deviceType, char *deviceId, char *eventType, char *eventFormat, char* data, QoS qos)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    gatewayScheduler *sched;
+    schedDevice *dev;
+    schedEvent *evt;
+    size_t typeLen, fmtLen, dataLen;
+
+    if ( !deviceType || !deviceId || !eventType || !eventFormat || !data ) {
+        LOG(WARN, "Invalid or NULL arguments");
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (sched = getScheduler(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    typeLen = strlen(eventType) + 1;
+    fmtLen = strlen(eventFormat) + 1;
+    dataLen = strlen(data) + 1;
+
+    evt = (schedEvent *)malloc(sizeof(schedEvent) + typeLen + fmtLen + dataLen);
+    if ( evt == NULL ) {
+        LOG(ERROR, "Failed to allocate queued event");
+        rc = -1;
+        goto exit;
+    }
+    evt->next = NULL;
+    evt->qos = qos;
+    evt->size = (int)dataLen - 1;
+    evt->eventType = (char *)(evt + 1);
+    evt->eventFormat = evt->eventType + typeLen;
+    evt->data = evt->eventFormat + fmtLen;
+    memcpy(evt->eventType, eventType, typeLen);
+    memcpy(evt->eventFormat, eventFormat, fmtLen);
+    memcpy(evt->data, data, dataLen);
+    clock_gettime(CLOCK_MONOTONIC, &evt->enqueued);
+
+    pthread_mutex_lock(&sched->lock);
+    dev = findDevice(sched, deviceType, deviceId, 1);
+    if ( dev == NULL ) {
+        rc = -1;
+    } else if ( dev->stats.depth >= dev->queueCap ) {
+        dev->stats.dropped++;
+        rc = QUEUE_FULL;
+    } else {
+        if ( dev->tail )
+            dev->tail->next = evt;
+        else
+            dev->head = evt;
+        dev->tail = evt;
+        dev->stats.depth++;
+        dev->stats.queued++;
+        evt = NULL;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+    if ( evt ) {
+        LOG(DEBUG, "Event dropped for device type=%s id=%s rc=%d", deviceType, deviceId, rc);
+        free(evt);
+    }
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/* Pick next event in deficit round robin order. Called with scheduler lock held. */
+static schedEvent * nextEvent(gatewayScheduler *sched, schedDevice **owner)
+{
+    int idle = 0;
+
+    while ( idle < sched->count ) {
+        schedDevice *dev = &sched->devices[sched->nextDevice];
+
+        if ( dev->head == NULL ) {
+            dev->deficit = 0;
+            idle++;
+        } else {
+            idle = 0;
+
+            /* credit device once per visit */
+            if ( !sched->credited ) {
+                dev->deficit += (long)sched->quantum * dev->weight;
+                sched->credited = 1;
+            }
+
+            if ( dev->head->size <= dev->deficit ) {
+                schedEvent *evt = dev->head;
+                dev->head = evt->next;
+                if ( dev->head == NULL )
+                    dev->tail = NULL;
+                dev->deficit -= evt->size;
+                dev->stats.depth--;
+                *owner = dev;
+                return evt;
+            }
+        }
+
+        sched->nextDevice = (sched->nextDevice + 1) % sched->count;
+        sched->credited = 0;
+    }
+
+    return NULL;
+}
+
+/**
+ * Function used to publish queued device events in deficit round robin order.
+ */
+int dispatchDeviceEvents(iotfclient *client, int maxEvents)
+{
+    LOG(TRACE, "entry::");
+
+    int sent = 0;
+    gatewayScheduler *sched = (gatewayScheduler *)client->scheduler;
+
+    if ( sched == NULL )
+        goto exit;
+
+    while ( maxEvents <= 0 || sent < maxEvents ) {
+        schedDevice *dev = NULL;
+        schedEvent *evt;
+        char *deviceType;
+        char *deviceId;
+        struct timespec now;
+        double delay;
+        int rc;
+
+        pthread_mutex_lock(&sched->lock);
+        evt = (sched->count > 0) ? nextEvent(sched, &dev) : NULL;
+        if ( evt == NULL ) {
+            pthread_mutex_unlock(&sched->lock);
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        delay = elapsedMs(&evt->enqueued, &now);
+        dev->totalQueueDelayMs += delay;
+        if ( delay > dev->stats.maxQueueDelayMs )
+            dev->stats.maxQueueDelayMs = delay;
+        deviceType = dev->deviceType;
+        deviceId = dev->deviceId;
+        pthread_mutex_unlock(&sched->lock);
+
+        /* Publish without holding the lock - device entries are never removed, but
+         * the table may be reallocated, so look up the entry again to account result */
+        rc = publishDeviceEvent(client, deviceType, deviceId, evt->eventType, evt->eventFormat, evt->data, evt->qos);
+
+        pthread_mutex_lock(&sched->lock);
+        dev = findDevice(sched, deviceType, deviceId, 0);
+        if ( dev ) {
+            if ( rc == 0 ) {
+                dev->stats.sent++;
+            } else {
+                dev->stats.failed++;
+            }
+        }
+        pthread_mutex_unlock(&sched->lock);
+
+        free(evt);
+        sent++;
+    }
+
+exit:
+    LOG(TRACE, "exit:: sent=%d", sent);
+    return sent;
+}
+
+/**
+ * Function used to get the uplink scheduler statistics of an attached device.
+ */
+int getDeviceSchedulerStats(iotfclient *client, char *deviceType, char *deviceId, GatewaySchedulerStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = -1;
+    gatewayScheduler *sched = (gatewayScheduler *)client->scheduler;
+    schedDevice *dev;
+
+    if ( sched == NULL || !deviceType || !deviceId || !stats )
+        goto exit;
+
+    pthread_mutex_lock(&sched->lock);
+    dev = findDevice(sched, deviceType, deviceId, 0);
+    if ( dev ) {
+        unsigned long done = dev->stats.sent + dev->stats.failed;
+        *stats = dev->stats;
+        stats->avgQueueDelayMs = done ? dev->totalQueueDelayMs / done : 0.0;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&sched->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Free gateway scheduler and all queued events
+ */
+void freeGatewayScheduler(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    gatewayScheduler *sched = (gatewayScheduler *)client->scheduler;
+    int i;
+
+    if ( sched != NULL ) {
+        for (i = 0; i < sched->count; i++) {
+            schedDevice *dev = &sched->devices[i];
+            while ( dev->head ) {
+                schedEvent *evt = dev->head;
+                dev->head = evt->next;
+                free(evt);
+            }
+            free(dev->deviceType);
+            free(dev->deviceId);
+        }
+        free(sched->devices);
+        pthread_mutex_destroy(&sched->lock);
+        free(sched);
+        client->scheduler = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -238,6 +238,15 @@ int reconnect_delay(int i)
 }
 
 
+/* Milliseconds of monotonic clock */
+long long monotonicMs(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 /* generate UUID */
 void generateUUID(char* uuid_str)
 {
@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <signal.h>
 #include <ctype.h>
+#include <time.h>
 
 #define LOG(sev, fmts...) \
         logInvoke((LOGLEVEL_##sev), __FUNCTION__, __FILE__, __LINE__, fmts);
@@ -52,5 +53,6 @@ void strCopy(char **dest, char *src);
 int reconnect_delay(int i);
 void freePtr(char* p);
 void generateUUID(char* uuid_str);
+long long monotonicMs(void);
 
  #endif
@@ -25,6 +25,7 @@
  *******************************************************************************/
 
 #include <MQTTClient.h>
+#include <arpa/inet.h>
 
 #include "iotfclient.h"
 #include "iotf_utils.h"
@@ -32,8 +33,48 @@
 static int  messageArrived(void *context, char *topicName, int topicLen, MQTTClient_message * message);
 static void messageDelivered(void *context, MQTTClient_deliveryToken dt);
 extern void freeGatewaySubscriptionList(iotfclient *client);
+extern void freeGatewayScheduler(iotfclient *client);
 extern void freeConfig(Config *cfg);
 extern int messageArrived_dm(void *context, char *topicName, int topicLen, void *payload, size_t payloadlen);
+extern int messageArrived_notify(iotfclient *client, char *topic, void *payload, size_t payloadlen);
+extern void freeGatewayNotifier(iotfclient *client);
+extern int stopGatewayIngest(iotfclient *client);
+extern void freeGatewayEnvelope(iotfclient *client);
+extern void freeAggregator(iotfclient *client);
+extern int triggerReconnect(iotfclient *client);
+extern void freeReconnectSupervisor(iotfclient *client);
+extern int queuePublish(iotfclient *client, char *topic, char *payload, int qos, int *rc);
+extern int flushPublishQueue(iotfclient *client);
+extern void setPublishQueueOnline(iotfclient *client, int online);
+extern void freePublishQueue(iotfclient *client);
+extern void startBrokerResolver(iotfclient *client, char *host, int port);
+extern int getBrokerURIs(iotfclient *client, char *scheme, char uris[][INET6_ADDRSTRLEN + 16], int maxUris);
+extern void setBrokerConnected(iotfclient *client, const char *serverURI);
+extern void freeBrokerResolver(iotfclient *client);
+extern int getBrokerEndpoints(iotfclient *client, char *defaultHost, int defaultPort, int *order, int maxOrder);
+extern void getEndpointAddress(iotfclient *client, int index, char *host, int hostLen, int *port);
+extern void recordEndpointConnect(iotfclient *client, int index, int rc, long connectMs, long failoverMs);
+extern void recordEndpointLost(iotfclient *client);
+extern void freeBrokerEndpoints(iotfclient *client);
+extern void keepAliveConnected(iotfclient *client);
+extern void keepAliveActivity(iotfclient *client);
+extern void keepAliveLost(iotfclient *client);
+extern void freeKeepAlive(iotfclient *client);
+extern void statsConnect(iotfclient *client, int rc);
+extern void statsConnectionLost(iotfclient *client);
+extern void statsPublish(iotfclient *client, int rc, int bytes, int qos, int token, long long sentMs);
+extern void statsDelivered(iotfclient *client, int token);
+extern void stopConnectionReport(iotfclient *client);
+extern void freeFirmwareDownload(iotfclient *client);
+extern void freeDiagLog(iotfclient *client);
+extern void freeDMObserve(iotfclient *client);
+extern void freeConnectionStats(iotfclient *client);
+extern void freeDMRequests(iotfclient *client);
+extern void freeLocationReport(iotfclient *client);
+extern void freeGatewayDM(iotfclient *client);
+extern void connectedGatewayDM(iotfclient *client);
+extern void stopDMRenewal(iotfclient *client);
+extern void freeDMRenewal(iotfclient *client);
 
 /* Command Callback */
 commandCallback cb;
@@ -48,9 +89,26 @@ void connlost(void *context, char *cause)
 {
     LOG(TRACE, "entry::");
     LOG(WARN, "IoTF client connection is lost. Context=%x Cause=%s", context, cause);
+    if ( context ) {
+        statsConnectionLost((iotfclient *)context);
+        recordEndpointLost((iotfclient *)context);
+        keepAliveLost((iotfclient *)context);
+        triggerReconnect((iotfclient *)context);
+    }
     LOG(TRACE, "exit::");
 }
 
+/* Build server URI of host and port */
+static void buildServerURI(char *uri, char *host, int port)
+{
+    char *scheme = (port == 1883) ? "tcp" : "ssl";
+
+    if ( strchr(host, ':') )
+        sprintf(uri, "%s://[%s]:%d", scheme, host, port);
+    else
+        sprintf(uri, "%s://%s:%d", scheme, host, port);
+}
+
 /**
  * Function used to connect to the IBM Watson IoT client
  * @param client - Reference to the Iotfclient
@@ -62,7 +120,16 @@ int connectiotf(iotfclient  *client)
     LOG(TRACE, "entry::");
 
     int rc = 0;
+    int reconnect = 0;
     char *seUID = NULL;
+    long long start, phaseStart, failStart = -1;
+    char brokerURIs[8][INET6_ADDRSTRLEN + 16];
+    char *serverURIs[9];
+    int uriCount, i;
+    int order[8], endpointCount, e;
+    char epHost[256];
+    int epPort;
+    long attemptMs;
 
     MQTTClient mqttClient;
     MQTTClient_connectOptions conn_opts = MQTTClient_connectOptions_initializer;
@@ -80,6 +147,19 @@ int connectiotf(iotfclient  *client)
     char hostname[strlen(client->cfg.org) + strlen(messagingUrl) + 1];
     sprintf(hostname, "%s%s", client->cfg.org, messagingUrl);
 
+    /* Broker endpoints, healthiest first. Resolve the host name of the first one while
+     * the secure element is read and the OpenSSL engine is loaded.
+     */
+    start = monotonicMs();
+    endpointCount = getBrokerEndpoints(client, hostname, port, order, 8);
+    if ( endpointCount <= 0 ) {
+        rc = -1;
+        LOG(TRACE, "exit:: rc=%d", rc);
+        return rc;
+    }
+    getEndpointAddress(client, order[0], epHost, sizeof(epHost), &epPort);
+    startBrokerResolver(client, epHost, epPort);
+
     /* If useNXPEngine is enabled set environment variable to load NXP engine */
     if ( client->cfg.useNXPEngine ) {
         char * envval;
@@ -102,7 +182,10 @@ int connectiotf(iotfclient  *client)
                 certDir = dirname(client->cfg.clientCertPath);
             }
             if ( certDir == NULL ) certDir = "/opt/iotnxpimxclient/certs";
+            phaseStart = monotonicMs();
             seUID = a71ch_retrieveCertificatesFromSE(certDir);
+            client->timings.seCertMs = (long)(monotonicMs() - phaseStart);
+            LOG(INFO, "Secure Element certificate retrieval took %ld ms", client->timings.seCertMs);
             if ( seUID == NULL ) {
                 LOG(ERROR, "Failed to retrieve client certificate and key from Secure Element");
                 rc = SE_CERT_ERROR;
@@ -173,24 +256,33 @@ int connectiotf(iotfclient  *client)
     LOG(INFO, "clientId=%s", clientId);
 
     /* create MQTT Client */
-    char connectionUrl[strlen(hostname) + 14];
-    if ( port == 1883 )
-       sprintf(connectionUrl, "tcp://%s:%d", hostname, port);
-    else
-       sprintf(connectionUrl, "ssl://%s:%d", hostname, port);
+    char connectionUrl[sizeof(epHost) + 16];
+    buildServerURI(connectionUrl, epHost, epPort);
 
     LOG(INFO, "connectionUrl=%s", connectionUrl);
 
-    rc = MQTTClient_create(&mqttClient, connectionUrl, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL);
-    if ( rc != 0 ) {
-        LOG(WARN, "RC from MQTTClient_create:%d",rc);
-        return rc;
-    }
+    /* MQTT client is created once and reconnects in place until disconnect().
+     * Paho also keeps the TLS session of the last connection in the client and
+     * offers it for resumption, which skips the full handshake and its signing
+     * operation on the secure element.
+     */
+    reconnect = (client->c != NULL);
+    if ( !reconnect ) {
+        phaseStart = monotonicMs();
+        rc = MQTTClient_create(&mqttClient, connectionUrl, clientId, MQTTCLIENT_PERSISTENCE_NONE, NULL);
+        client->timings.clientCreateMs = (long)(monotonicMs() - phaseStart);
+        if ( rc != 0 ) {
+            LOG(WARN, "RC from MQTTClient_create:%d",rc);
+            free(clientId);
+                return rc;
+        }
 
-    client->c = (void *)mqttClient;
+        client->c = (void *)mqttClient;
+    }
+    free(clientId);
 
     /* set connection options */
-    conn_opts.keepAliveInterval = keepAliveInterval;
+    conn_opts.keepAliveInterval = getClientKeepAliveInterval(client);
     conn_opts.reliable = 0;
     conn_opts.cleansession = 1;
     ssl_opts.enableServerCertAuth = 0;
@@ -200,27 +292,79 @@ int connectiotf(iotfclient  *client)
         conn_opts.password = client->cfg.authtoken;
     }
 
-    if ( port != 1883 ) {
-        conn_opts.ssl = &ssl_opts;
-        if (useCerts) {
-            conn_opts.ssl->enableServerCertAuth = 1;
-            conn_opts.ssl->trustStore = client->cfg.rootCACertPath;
-            conn_opts.ssl->keyStore = client->cfg.clientCertPath;
-            conn_opts.ssl->privateKey = client->cfg.clientKeyPath;
-        }
+    if (useCerts) {
+        ssl_opts.enableServerCertAuth = 1;
+        ssl_opts.trustStore = client->cfg.rootCACertPath;
+        ssl_opts.keyStore = client->cfg.clientCertPath;
+        ssl_opts.privateKey = client->cfg.clientKeyPath;
     }
 
     /* Set callbacks */
-    MQTTClient_setCallbacks((MQTTClient *)client->c, NULL, connlost, messageArrived, messageDelivered);
+    MQTTClient_setCallbacks((MQTTClient *)client->c, client, connlost, messageArrived, messageDelivered);
            
-    if ((rc = MQTTClient_connect((MQTTClient *)client->c, &conn_opts)) == MQTTCLIENT_SUCCESS) {
+    /* Try the endpoints in turn, without a reconnect delay between them */
+    phaseStart = monotonicMs();
+    for (e = 0; e < endpointCount; e++) {
+        long long attemptStart = monotonicMs();
+
+        getEndpointAddress(client, order[e], epHost, sizeof(epHost), &epPort);
+        buildServerURI(connectionUrl, epHost, epPort);
+        conn_opts.ssl = (epPort != 1883) ? &ssl_opts : NULL;
+
+        /* Connect to resolved addresses of the first endpoint, then fall back to the host name.
+         * TLS always connects to the host name, for server name indication and the identity
+         * of the server, the resolver then only warms DNS.
+         */
+        uriCount = 0;
+        if ( e == 0 && conn_opts.ssl == NULL ) {
+            uriCount = getBrokerURIs(client, "tcp", brokerURIs, 8);
+            for (i = 0; i < uriCount; i++)
+                serverURIs[i] = brokerURIs[i];
+        }
+        serverURIs[uriCount++] = connectionUrl;
+        conn_opts.serverURIs = serverURIs;
+        conn_opts.serverURIcount = uriCount;
+
+        rc = MQTTClient_connect((MQTTClient *)client->c, &conn_opts);
+        attemptMs = (long)(monotonicMs() - attemptStart);
+        LOG(INFO, "MQTTClient_connect to %s rc=%d in %ld ms (%s)", connectionUrl, rc, attemptMs,
+            (reconnect && epPort != 1883) ? "reconnect, TLS session offered for resumption" : "new connection");
+        recordEndpointConnect(client, order[e], rc, attemptMs,
+            (rc == MQTTCLIENT_SUCCESS && failStart >= 0) ? (long)(monotonicMs() - failStart) : -1);
+
+        if ( rc == MQTTCLIENT_SUCCESS )
+            break;
+        if ( failStart < 0 )
+            failStart = attemptStart;
+    }
+    client->timings.connectMs = (long)(monotonicMs() - phaseStart);
+    client->timings.totalConnectMs = (long)(monotonicMs() - start);
+    statsConnect(client, rc);
+
+    if (rc == MQTTCLIENT_SUCCESS) {
+        keepAliveConnected(client);
+
         if (qsMode) {
-            LOG(INFO, "Device Client Connected to %s Platform in QuickStart Mode\n",hostname);
+            LOG(INFO, "Device Client Connected to %s Platform in QuickStart Mode\n",epHost);
         } else {
             char *clientType = (isGateway)?"Gateway Client":"Device Client";
             char *connType = (useCerts)?"Client Side Certificates":"Secure Connection";
-            LOG(INFO, "%s Connected to %s using %s\n", clientType, hostname, connType);
+            LOG(INFO, "%s Connected to %s using %s\n", clientType, epHost, connType);
         }
+
+        if ( e == 0 && uriCount > 1 ) {
+            LOG(INFO, "Connected to server URI %s", conn_opts.returned.serverURI ? conn_opts.returned.serverURI : "");
+            setBrokerConnected(client, conn_opts.returned.serverURI);
+        }
+
+        /* subscriptions of the previous connection are gone with its session */
+        connectedGatewayDM(client);
+
+        /* Publish messages queued while not connected. The reconnect supervisor
+         * retries a failed flush, else later messages are published directly.
+         */
+        if ( flushPublishQueue(client) != 0 && client->reconnect == NULL )
+            setPublishQueueOnline(client, 1);
     }
 
     LOG(TRACE, "exit:: rc=%d", rc);
@@ -228,6 +372,39 @@ int connectiotf(iotfclient  *client)
 }
 
 
+/*
+ * Publish a message on the connection, with the accounting of the connection
+ * statistics, keepalive and startup timings. Used by publishData() and to
+ * publish queued messages.
+ */
+int sendPublish(iotfclient *client, char *topic, void *payload, int payloadlen, int qos)
+{
+    MQTTClient_message pubmsg = MQTTClient_message_initializer;
+    MQTTClient_deliveryToken token = 0;
+    long long sentMs;
+    int rc;
+
+    pubmsg.payload = payload;
+    pubmsg.payloadlen = payloadlen;
+    pubmsg.qos = qos;
+    pubmsg.retained = 0;
+
+    sentMs = monotonicMs();
+    rc = MQTTClient_publishMessage((MQTTClient *)client->c, topic, &pubmsg, &token);
+    LOG(DEBUG, "Message with delivery token %d delivered\n", token);
+    statsPublish(client, rc, strlen(topic) + payloadlen, qos, token, sentMs);
+
+    if ( rc == MQTTCLIENT_SUCCESS )
+        keepAliveActivity(client);
+
+    if ( rc == MQTTCLIENT_SUCCESS && client->timings.firstPublishMs < 0 ) {
+        client->timings.firstPublishMs = (long)(monotonicMs() - client->initMs);
+        LOG(INFO, "First publish %ld ms after initialize", client->timings.firstPublishMs);
+    }
+
+    return rc;
+}
+
 /**
 * Function used to publish the given data to the topic with the given QoS
 * @Param client - Address of MQTT Client
@@ -242,20 +419,15 @@ int publishData(iotfclient *client, char *topic, char *payload, int qos)
     LOG(TRACE, "entry::");
 
     int rc = -1;
-    MQTTClient_message pubmsg = MQTTClient_message_initializer;
-    MQTTClient_deliveryToken token;
-    int payloadlen = strlen(payload);
-
-    pubmsg.payload = payload;
-    pubmsg.payloadlen = payloadlen;
-    pubmsg.qos = qos;
-    pubmsg.retained = 0;
 
-    LOG(DEBUG, "Publish Message: qos=%d retained=%d payloadlen=%d payload: %s",
-                    pubmsg.qos, pubmsg.retained, pubmsg.payloadlen, payload);
+    /* Queue or reject without blocking while not connected */
+    if ( queuePublish(client, topic, payload, qos, &rc) ) {
+        LOG(TRACE, "exit:: rc=%d", rc);
+        return rc;
+    }
 
-    rc = MQTTClient_publishMessage((MQTTClient *)client->c, topic, &pubmsg, &token);
-    LOG(DEBUG, "Message with delivery token %d delivered\n", token);
+    LOG(DEBUG, "Publish Message: qos=%d retained=0 payloadlen=%d payload: %s", qos, (int)strlen(payload), payload);
+    rc = sendPublish(client, topic, payload, strlen(payload), qos);
 
     LOG(TRACE, "exit:: rc=%d", rc);
     return rc;
@@ -337,6 +509,8 @@ static void messageDelivered(void *context, MQTTClient_deliveryToken dt)
 {
     LOG(TRACE, "entry::");
     LOG(DEBUG, "Message delivery confirmed. context=%x token=%d", context, dt);
+    if ( context )
+        statsDelivered((iotfclient *)context, dt);
     LOG(TRACE, "exit::");
 }
 
@@ -345,6 +519,10 @@ static int messageArrived(void *context, char *topicName, int topicLen, MQTTClie
 {
     LOG(TRACE, "entry::");
 
+    /* Incoming traffic also ends an idle period of the connection */
+    if ( context )
+        keepAliveActivity((iotfclient *)context);
+
     /* Check if the topic is device management topic */
     if ( topicName && strncmp(topicName, "iotdm-1/", 8) == 0 ) {
         void *payload = message->payload;
@@ -356,6 +534,16 @@ static int messageArrived(void *context, char *topicName, int topicLen, MQTTClie
         return rc;
     }
 
+    /* Check if the topic is gateway notification topic */
+    topicLen = strlen(topicName);
+    if ( context && strncmp(topicName, "iot-2/type/", 11) == 0 &&
+         topicLen > 7 && strcmp(topicName + topicLen - 7, "/notify") == 0 ) {
+        int rc = messageArrived_notify((iotfclient *)context, topicName, message->payload, message->payloadlen);
+        MQTTClient_freeMessage(&message);
+        MQTTClient_free(topicName);
+        return rc;
+    }
+
     /* Process incoming message if callback is defined */
     if (cb != 0) {
         char topic[4096];
@@ -419,20 +607,69 @@ int disconnect(iotfclient  *client)
     LOG(TRACE, "entry::");
 
     int rc = 0;
+
+    /* Do not reconnect behind the back of an explicit disconnect */
+    freeReconnectSupervisor(client);
+    stopConnectionReport(client);
+    stopDMRenewal(client);
+    freeFirmwareDownload(client);
+    freeDiagLog(client);
+    freeDMObserve(client);
+
+    /* Stop ingest server, publish pending summaries and envelope before the connection goes away */
+    stopGatewayIngest(client);
+    freeAggregator(client);
+    freeGatewayEnvelope(client);
+
     if (isConnected(client)) {
+        /* an idle period up to now confirms the keepalive interval */
+        keepAliveActivity(client);
         rc = MQTTClient_disconnect((MQTTClient *)client->c, 10000);
 
         /* Free gateway subscription list if set */
         freeGatewaySubscriptionList(client);
     }
 
-    // MQTTClient_destroy(client->c);
+    if ( client->c != NULL ) {
+        MQTTClient_destroy((MQTTClient *)&client->c);
+        client->c = NULL;
+    }
+    freeGatewayScheduler(client);
+    freeGatewayNotifier(client);
+    freePublishQueue(client);
+    freeBrokerResolver(client);
+    freeBrokerEndpoints(client);
+    freeKeepAlive(client);
+    freeConnectionStats(client);
+    freeDMRequests(client);
+    freeGatewayDM(client);
+    freeDMRenewal(client);
+    freeLocationReport(client);
     freeConfig(&(client->cfg));
 
     LOG(TRACE, "exit:: %d", rc);
     return rc;
 }
 
+/**
+ * Function used to get the timings of the startup phases
+ */
+int getStartupTimings(iotfclient *client, StartupTimings *timings)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+
+    if ( timings == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+    } else {
+        *timings = client->timings;
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
 /**
 * Function used to set the time to keep the connection alive with IBM Watson IoT service
 * @param keepAlive - time in secs
@@ -455,6 +692,13 @@ int retry_connection(iotfclient  *client)
     int retry = 1;
     int rc = -1;
 
+    /* Reconnect supervisor reconnects in background */
+    if ( triggerReconnect(client) ) {
+        rc = CLIENT_DISCONNECTED;
+        LOG(TRACE, "exit:: %d", rc);
+        return rc;
+    }
+
     while((rc = connectiotf(client)) != MQTTCLIENT_SUCCESS)
     {
         LOG(DEBUG, "Retry Attempt #%d ", retry);
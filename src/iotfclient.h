@@ -55,7 +55,36 @@ typedef enum LOGLEVEL {
     LOGLEVEL_TRACE   = 5
 } LOGLEVEL;
 
-enum errorCodes { CONFIG_FILE_ERROR = -3, MISSING_INPUT_PARAM = -4, QUICKSTART_NOT_SUPPORTED = -5, SE_CERT_ERROR = -6 };
+enum errorCodes { CONFIG_FILE_ERROR = -3, MISSING_INPUT_PARAM = -4, QUICKSTART_NOT_SUPPORTED = -5, SE_CERT_ERROR = -6,
+                  QUEUE_FULL = -7, DEVICE_BACKOFF = -8, CLIENT_DISCONNECTED = -9,
+                  DM_REQUEST_TIMEOUT = -10 };
+
+/* Firmware states and update status of device management, also used by the firmware download */
+#define FIRMWARESTATE_IDLE          0
+#define FIRMWARESTATE_DOWNLOADING   1
+#define FIRMWARESTATE_DOWNLOADED    2
+
+#define FIRMWAREUPDATE_SUCCESS             0
+#define FIRMWAREUPDATE_INPROGRESS          1
+#define FIRMWAREUPDATE_OUTOFMEMORY         2
+#define FIRMWAREUPDATE_CONNECTIONLOST      3
+#define FIRMWAREUPDATE_VERIFICATIONFAILED  4
+#define FIRMWAREUPDATE_UNSUPPORTEDIMAGE    5
+#define FIRMWAREUPDATE_INVALIDURL          6
+
+/* Device management requests, also used outside of the managed device */
+#define MANAGE               "iotdevice-1/mgmt/manage"
+#define NOTIFY               "iotdevice-1/notify"
+#define UPDATE_LOCATION      "iotdevice-1/device/update/location"
+#define CREATE_DIAG_ERRCODES "iotdevice-1/add/diag/errorCodes"
+#define CLEAR_DIAG_ERRCODES  "iotdevice-1/clear/diag/errorCodes"
+#define ADD_DIAG_LOG         "iotdevice-1/add/diag/log"
+#define CLEAR_DIAG_LOG       "iotdevice-1/clear/diag/log"
+
+/* Severity of diagnostic log entries */
+#define DIAG_SEVERITY_INFO      0
+#define DIAG_SEVERITY_WARNING   1
+#define DIAG_SEVERITY_ERROR     2
 
 typedef enum { QoS0, QoS1, QoS2 } QoS;
 
@@ -75,6 +104,7 @@ struct iotf_config
     char* rootCACertPath;
     char* clientCertPath;
     char* clientKeyPath;
+    char* endpoints;
     int port;
     int useClientCertificates;
     int useNXPEngine;
@@ -84,6 +114,100 @@ struct iotf_config
 typedef struct iotf_config Config;
 
 
+/* Startup phase timings in milliseconds, -1 if the phase did not run */
+typedef struct
+{
+    long configMs;              /* Configuration in initialize                          */
+    long seCertMs;              /* Certificate retrieval from Secure Element            */
+    long clientCreateMs;        /* MQTT client creation, loads the OpenSSL engine       */
+    long dnsMs;                 /* Host name resolution, overlaps the two phases above  */
+    long connectMs;             /* TCP, TLS and MQTT connect                            */
+    long totalConnectMs;        /* Last connectiotf call                                */
+    long firstPublishMs;        /* From initialize until the first successful publish   */
+} StartupTimings;
+
+/* Statistics of a broker endpoint */
+typedef struct
+{
+    char host[256];
+    int port;
+    unsigned long attempts;     /* Connect attempts                                  */
+    unsigned long failures;     /* Failed connect attempts and lost connections     */
+    unsigned long failovers;    /* Connects after another endpoint failed           */
+    int consecutiveFailures;    /* Failures since the last successful connect       */
+    long lastConnectMs;         /* Latency of the last successful connect, -1 if none */
+    double avgConnectMs;        /* Moving average of the connect latency            */
+    int connected;              /* 1 for the endpoint of the current connection     */
+} EndpointStats;
+
+/* Connection quality statistics */
+typedef struct
+{
+    unsigned long connects;         /* Successful connects                                  */
+    unsigned long connectFailures;  /* Failed connects                                      */
+    unsigned long disconnects;      /* Connections lost                                     */
+    unsigned long flaps;            /* Connections lost within a minute of connecting       */
+    unsigned long reconnects;       /* Connects after a lost connection                     */
+    long lastOutageMs;              /* From connection lost to reconnected, -1 if none      */
+    long maxOutageMs;
+    double avgOutageMs;
+    long uptimeSecs;                /* Uptime of the current connection, 0 if not connected */
+    long totalUptimeSecs;
+    long lastRttMs;                 /* Round trip of the last QoS 1/2 publish, -1 if none   */
+    double avgRttMs;                /* Moving average of the round trip                     */
+    long minRttMs;
+    long maxRttMs;
+    unsigned long rttSamples;
+    unsigned long messagesSent;
+    unsigned long publishFailures;
+    unsigned long long bytesSent;   /* Topic and payload bytes published                    */
+    double uplinkBytesPerSec;       /* Throughput of the current connection                 */
+} ConnectionStats;
+
+/* Progress of the firmware download */
+typedef struct
+{
+    int active;                 /* Download in progress                                 */
+    long long received;         /* Bytes in the staging file                            */
+    long long total;            /* Image size, -1 if not known                          */
+    unsigned long resumes;      /* Transfers resumed after a lost link                  */
+    double bytesPerSec;         /* Throughput of the current or last transfer           */
+    int error;                  /* FIRMWAREUPDATE_* status of a failed download, 0 if none */
+    int verified;               /* Digest of the image matched the verifier             */
+} FirmwareDownloadStats;
+
+/* Statistics of the diagnostic log and error codes */
+typedef struct
+{
+    unsigned long added;        /* Entries added                                        */
+    unsigned long coalesced;    /* Entries merged into an equal pending entry           */
+    unsigned long dropped;      /* Entries dropped because the ring was full            */
+    unsigned long sent;         /* Requests sent, including notes on dropped entries    */
+    unsigned long failed;       /* Flushes stopped by a failed publish                  */
+    int pending;                /* Entries waiting in the ring                          */
+} DiagStats;
+
+/* Statistics of the location reporter */
+typedef struct
+{
+    unsigned long fixes;        /* Locations reported by the device                     */
+    unsigned long published;    /* Location updates sent to the platform                */
+    unsigned long suppressed;   /* Locations within the distance or time thresholds     */
+    double lastDistanceMeters;  /* From the last published location to the last fix     */
+} LocationReportStats;
+
+/* Statistics of the manage lifetime renewal */
+typedef struct
+{
+    unsigned long renewals;     /* Renewal requests sent                                */
+    unsigned long failed;       /* Renewals failed or timed out, retried with backoff   */
+    unsigned long deferred;     /* Renewals moved to a later second by the rate limit   */
+    int scheduled;              /* Lifetimes scheduled for renewal                      */
+    double avgLatencyMs;        /* Average time from renewal request to response        */
+    double maxLatencyMs;        /* Maximum time from renewal request to response        */
+    double lastLatencyMs;       /* Time from request to response of the last renewal    */
+} DMRenewalStats;
+
 /* iotfclient */
 typedef struct
 {
@@ -94,17 +218,94 @@ typedef struct
     int isQuickstart;
     int isGateway;
     int managed;
+    void *scheduler;
+    void *notifier;
+    void *ingest;
+    void *envelope;
+    void *aggregator;
+    void *reconnect;
+    void *pubqueue;
+    void *resolver;
+    void *endpoints;
+    void *keepalive;
+    void *connstats;
+    void *dmrequests;
+    void *fwdownload;
+    void *diaglog;
+    void *location;
+    void *observe;
+    void *gatewaydm;
+    void *dmrenewal;
+    StartupTimings timings;
+    long long initMs;
 } iotfclient;
 
+/* Per device statistics of the gateway uplink scheduler */
+typedef struct
+{
+    unsigned long queued;       /* Events accepted into the device queue       */
+    unsigned long sent;         /* Events published                            */
+    unsigned long dropped;      /* Events rejected because the queue was full  */
+    unsigned long failed;       /* Events for which the publish call failed    */
+    int depth;                  /* Events currently waiting in the queue       */
+    double avgQueueDelayMs;     /* Average time spent in the queue             */
+    double maxQueueDelayMs;     /* Maximum time spent in the queue             */
+} GatewaySchedulerStats;
+
 /* Callback used to process commands */
 typedef void (*commandCallback)(char* type, char* id, char* commandName, char *format, void* payload, size_t payloadlen);
 
+/* Classes of platform errors reported in gateway notifications */
+typedef enum { GWNOTIFY_OTHER = 0, GWNOTIFY_UNAUTHORIZED = 1, GWNOTIFY_INVALID_TOPIC = 2, GWNOTIFY_THROTTLED = 3 } GatewayNotifyError;
+
+/* Per device error statistics from gateway notifications */
+typedef struct
+{
+    unsigned long unauthorized;
+    unsigned long invalidTopic;
+    unsigned long throttled;
+    unsigned long other;
+    int backoffSecs;            /* Current back off interval, 0 if not backed off */
+    long backoffRemaining;      /* Seconds until publishes are allowed again      */
+} GatewayDeviceErrorStats;
+
+/* Statistics of the gateway local ingest server */
+typedef struct
+{
+    unsigned long frames;       /* Valid frames received      */
+    unsigned long bytes;        /* Bytes of valid frames      */
+    unsigned long forwarded;    /* Frames published           */
+    unsigned long failed;       /* Frames failed to publish   */
+    unsigned long malformed;    /* Frames or datagrams dropped */
+} GatewayIngestStats;
+
+/* Callback used to process records of a decoded gateway envelope */
+typedef void (*envelopeRecordCallback)(void* context, char* deviceType, char* deviceId, char* eventType, long offsetMs, char* payload, int payloadlen);
+
+/* Callback used to process gateway notifications */
+typedef void (*gatewayNotificationCallback)(char* type, char* id, GatewayNotifyError error, int rc, char* request, char* message);
+
+/* Reconnect policy, returns delay in milliseconds before reconnect attempt (starting at 1) */
+typedef int (*reconnectPolicyCallback)(void* context, int attempt);
+
 /* Callback used to process device management commands */
 typedef void (*dmCommandCallback)(char* status, char* requestId, void* payload, size_t payloadlen);
 
 /* Action callback */
 typedef void (*dmActionCallback)();
 
+/* Callback used to complete a device management request. rc is the return code of the response,
+ * DM_REQUEST_TIMEOUT or CLIENT_DISCONNECTED. payload is NULL without response. */
+typedef void (*dmResponseCallback)(void* context, char* reqId, int rc, char* payload, size_t payloadlen);
+
+/* DM state of a device attached to a gateway */
+#define GATEWAYDM_UNMANAGED     0
+#define GATEWAYDM_MANAGING      1
+#define GATEWAYDM_MANAGED       2
+
+/* Callback for DM requests of attached devices, like request "mgmt/initiate/device/reboot" */
+typedef void (*gatewayDMCommandCallback)(char* deviceType, char* deviceId, char* request, char* reqId, char* payload, size_t payloadlen);
+
 /**
 * Function used to initialize the Watson IoT client
 * @param client - Reference to the Iotfclient
@@ -211,6 +412,37 @@ DLLExport int disconnect(iotfclient *client);
 */
 DLLExport void setKeepAliveInterval(unsigned int keepAlive);
 
+/**
+* Function used to set the keepalive interval of a client, instead of the interval of setKeepAliveInterval()
+* @param client - Reference to the Iotfclient
+* @param keepAlive - time in secs
+*
+* @return int return code
+*/
+DLLExport int setClientKeepAliveInterval(iotfclient *client, int keepAlive);
+
+/**
+* Function used to enable the adaptive keepalive of a client. The client learns the largest interval
+* between minSecs and maxSecs the network path tolerates: an interval held over idle periods is raised
+* on the next connection, a connection dropped while idle falls back to the last good interval. On
+* battery and cellular devices, a longer interval means fewer wakeups to send pings.
+* @param client - Reference to the Iotfclient
+* @param minSecs - Smallest and first interval in secs
+* @param maxSecs - Largest interval in secs
+* @param statePath - File to persist the learned interval, NULL to learn again after restart
+*
+* @return int return code
+*/
+DLLExport int setAdaptiveKeepAlive(iotfclient *client, int minSecs, int maxSecs, char *statePath);
+
+/**
+* Function used to get the keepalive interval the next connection of a client uses
+* @param client - Reference to the Iotfclient
+*
+* @return int - keepalive interval in secs
+*/
+DLLExport int getClientKeepAliveInterval(iotfclient *client);
+
 
 /**
  * Function used to subscribe to device command.
@@ -284,6 +516,67 @@ DLLExport int subscribeToGatewayCommands(iotfclient  *client);
 */
 DLLExport int subscribeToDeviceCommands(iotfclient  *client, char* deviceType, char* deviceId, char* command, char* format, int qos) ;
 
+/**
+* Function used to set the gateway uplink scheduler options. The scheduler shares the
+* gateway connection between attached devices using deficit round robin, so that a
+* chatty device can not starve the others.
+* @param client - Reference to the GatewayClient
+* @param quantum - Bytes credited to a device of weight 1 in each round (default 1024)
+* @param defaultWeight - Weight of devices without explicit weight (default 1)
+* @param defaultQueueCap - Queue cap of devices without explicit cap (default 64)
+*
+* @return int return code
+*/
+DLLExport int setGatewaySchedulerOptions(iotfclient *client, int quantum, int defaultWeight, int defaultQueueCap);
+
+/**
+* Function used to set the scheduling weight and queue cap of an attached device.
+* @param client - Reference to the GatewayClient
+* @param deviceType - The type of your device
+* @param deviceId - The ID of your device
+* @param weight - Relative share of the uplink, 1 or more
+* @param queueCap - Maximum number of queued events, 0 to use the default cap
+*
+* @return int return code
+*/
+DLLExport int setDeviceSchedulerWeight(iotfclient *client, char *deviceType, char *deviceId, int weight, int queueCap);
+
+/**
+* Function used to queue an event on behalf of a device. Queued events are published
+* by dispatchDeviceEvents().
+* @param client - Reference to the GatewayClient
+* @param deviceType - The type of your device
+* @param deviceId - The ID of your device
+* @param eventType - Type of event to be published e.g status, gps
+* @param eventFormat - Format of the event e.g json
+* @param data - Payload of the event
+* @param QoS - qos for the publish event. Supported values : QoS0, QoS1, QoS2
+*
+* @return int return code
+* QUEUE_FULL -7 - Device queue is at its cap, event is dropped
+*/
+DLLExport int queueDeviceEvent(iotfclient *client, char *deviceType, char *deviceId, char *eventType, char *eventFormat, char* data, QoS qos);
+
+/**
+* Function used to publish queued device events in deficit round robin order.
+* @param client - Reference to the GatewayClient
+* @param maxEvents - Maximum number of events to publish, 0 to drain all queues
+*
+* @return int number of events published
+*/
+DLLExport int dispatchDeviceEvents(iotfclient *client, int maxEvents);
+
+/**
+* Function used to get the uplink scheduler statistics of an attached device.
+* @param client - Reference to the GatewayClient
+* @param deviceType - The type of your device
+* @param deviceId - The ID of your device
+* @param stats - Returns the device statistics
+*
+* @return int return code
+*/
+DLLExport int getDeviceSchedulerStats(iotfclient *client, char *deviceType, char *deviceId, GatewaySchedulerStats *stats);
+
 
 /**
 * <p>Send a device manage request to Watson IoT Platform</p>
@@ -406,6 +699,571 @@ DLLExport int reconnect_delay(int i);
 
 DLLExport int subscribeToGatewayNotification(iotfclient  *client);
 
+/**
+ * Function used to enable the resolver cache of the broker host name. The last good addresses are
+ * kept in memory and in cachePath. Without TLS, connectiotf() connects to cached addresses right away,
+ * also after their TTL expired, while the host name is resolved again in background. Addresses are
+ * tried in turn, and finally the host name itself. TLS connections always use the host name, the
+ * host name is then only resolved in background while the client starts up.
+ * @param client - Reference to the Iotfclient
+ * @param cachePath - File to persist addresses, NULL to keep them in memory only
+ * @param defaultTtlSecs - TTL of addresses without DNS TTL, and maximum TTL. 0 for 300 seconds.
+ * @param maxStaleSecs - Time after expiry cached addresses are used without waiting for
+ *                       resolution, 0 for no limit
+ *
+ * @return int return code
+ */
+DLLExport int setResolverCache(iotfclient *client, char *cachePath, int defaultTtlSecs, int maxStaleSecs);
+
+/**
+ * Function used to set the broker endpoints, instead of the broker host of the organization.
+ * connectiotf() tries all endpoints in one call, healthiest first by connect latency and recent
+ * failures, so it fails over without waiting for a reconnect delay. Must be called before connectiotf().
+ * The endpoints can also be set with the "endpoints" property of the configuration file.
+ * @param client - Reference to the Iotfclient
+ * @param endpoints - Comma separated list of host, host:port or [address]:port in order of preference.
+ *                    Port defaults to the port of the configuration. NULL for the default broker host.
+ *
+ * @return int return code
+ */
+DLLExport int setBrokerEndpoints(iotfclient *client, char *endpoints);
+
+/**
+ * Function used to get the statistics of the broker endpoints.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the statistics of each endpoint, in configured order
+ * @param count - Size of stats on input, number of endpoints returned on output
+ * @param lastFailoverMs - Returns the time from the first failed connect attempt to the connect to
+ *                         another endpoint in the last failover, -1 if none. May be NULL.
+ *
+ * @return int return code
+ */
+DLLExport int getEndpointStats(iotfclient *client, EndpointStats *stats, int *count, long *lastFailoverMs);
+
+/**
+ * Function used to get the connection quality statistics: connects, lost connections and outages,
+ * uptime, uplink throughput, and the round trip time of QoS 1 and 2 publishes.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the statistics
+ *
+ * @return int return code
+ */
+DLLExport int getConnectionStats(iotfclient *client, ConnectionStats *stats);
+
+/**
+ * Function used to publish the connection quality statistics periodically, as a json event of the
+ * device or gateway. Reports are only published while connected.
+ * @param client - Reference to the Iotfclient
+ * @param intervalSecs - Report interval in seconds, 0 to stop reporting
+ * @param eventType - Event type of the report
+ *
+ * @return int return code
+ */
+DLLExport int setConnectionReport(iotfclient *client, int intervalSecs, char *eventType);
+
+/**
+ * Function used to send a device management request. Requests are correlated with their response
+ * by reqId, so several requests can be pending at once.
+ * @param client - Reference to the Iotfclient
+ * @param topic - Device management topic of the request, like "iotdevice-1/device/update/location"
+ * @param data - Json of the "d" object of the request, NULL if none
+ * @param timeoutSecs - Time to wait for the response, 0 for the default timeout
+ * @param cb - Callback called with the response, on timeout or on disconnect. NULL to ignore the response.
+ * @param context - Context passed to the callback
+ * @param reqId - Returns the reqId of the request, at least 40 bytes. May be NULL.
+ *
+ * @return int return code
+ */
+DLLExport int sendDMRequest(iotfclient *client, char *topic, char *data, int timeoutSecs, dmResponseCallback cb, void *context, char *reqId);
+
+/**
+ * Function used to set the default timeout of device management requests. Default is 30 seconds.
+ * @param client - Reference to the Iotfclient
+ * @param timeoutSecs - Timeout in seconds
+ *
+ * @return int return code
+ */
+DLLExport int setDMRequestTimeout(iotfclient *client, int timeoutSecs);
+
+/**
+ * Function used to enable the firmware download. A firmware download request of the platform is
+ * then served by the client, instead of the firmware download callback: the image is streamed to
+ * the staging file, resumed with range requests after a lost link, and the firmware state of the
+ * device is updated to downloading, downloaded, or idle with the update status on failure.
+ * @param client - Reference to the Iotfclient
+ * @param stagingPath - File of the downloaded image, NULL to disable the firmware download.
+ *                      stagingPath.part and stagingPath.meta hold a partial image.
+ * @param maxBytesPerSec - Bandwidth limit of the download, 0 for no limit
+ * @param maxRetries - Retries without progress before the download fails, 0 for 10
+ *
+ * @return int return code
+ */
+DLLExport int setFirmwareDownloadOptions(iotfclient *client, char *stagingPath, int maxBytesPerSec, int maxRetries);
+
+/**
+ * Function used to set the installed firmware image, the base of firmware deltas. A downloaded
+ * delta, created with the firmwareDelta sample, is applied to the base image, and the image
+ * rebuilt from it is stored in the staging file.
+ * @param client - Reference to the Iotfclient
+ * @param basePath - File of the installed image, NULL if deltas are not supported
+ *
+ * @return int return code
+ */
+DLLExport int setFirmwareBaseImage(iotfclient *client, char *basePath);
+
+/**
+ * Function used to rebuild a firmware image from the base image and a delta, with fixed buffers.
+ * The rebuilt image is verified with the digest of the delta.
+ * @param basePath - File of the installed image
+ * @param deltaPath - File of the delta
+ * @param imagePath - File of the rebuilt image
+ *
+ * @return int return code, a FIRMWAREUPDATE_* status on failure
+ */
+DLLExport int applyFirmwareDelta(char *basePath, char *deltaPath, char *imagePath);
+
+/**
+ * Function used to start a firmware download, in background. Called on a firmware download request
+ * of the platform when the firmware download is enabled.
+ * @param client - Reference to the Iotfclient
+ * @param url - http or https URL of the image
+ * @param verifier - Hex digest of the image, verified while the image is downloaded. The digest is
+ *                   MD5, SHA-1, SHA-256, SHA-384 or SHA-512 by its length, or named like
+ *                   "sha256:<hex>". NULL or empty for no verification. A verifier that is not such a
+ *                   digest fails the update with FIRMWAREUPDATE_VERIFICATIONFAILED.
+ *
+ * @return int return code, FIRMWAREUPDATE_VERIFICATIONFAILED if the verifier is not a digest
+ */
+DLLExport int startFirmwareDownload(iotfclient *client, char *url, char *verifier);
+
+/**
+ * Function used to get the progress of the firmware download.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the progress
+ *
+ * @return int return code
+ */
+DLLExport int getFirmwareDownloadStats(iotfclient *client, FirmwareDownloadStats *stats);
+
+/**
+ * Function used to add an entry to the diagnostic log of the device. Entries are sent in batches at
+ * the flush rate, an entry equal to a pending entry is sent once with its repeat count.
+ * @param client - Reference to the Iotfclient
+ * @param message - Message of the entry, up to 127 bytes
+ * @param data - Base64 encoded diagnostic data, up to 255 bytes. May be NULL.
+ * @param severity - DIAG_SEVERITY_INFO, DIAG_SEVERITY_WARNING or DIAG_SEVERITY_ERROR
+ *
+ * @return int return code
+ */
+DLLExport int addDiagLog(iotfclient *client, char *message, char *data, int severity);
+
+/**
+ * Function used to add an error code of the device. Error codes are sent like diagnostic log entries.
+ * @param client - Reference to the Iotfclient
+ * @param errorCode - Error code
+ *
+ * @return int return code
+ */
+DLLExport int addErrorCode(iotfclient *client, int errorCode);
+
+/**
+ * Function used to clear the diagnostic log of the device, with the pending entries.
+ * @param client - Reference to the Iotfclient
+ *
+ * @return int return code
+ */
+DLLExport int clearDiagLog(iotfclient *client);
+
+/**
+ * Function used to clear the error codes of the device, with the pending error codes.
+ * @param client - Reference to the Iotfclient
+ *
+ * @return int return code
+ */
+DLLExport int clearErrorCodes(iotfclient *client);
+
+/**
+ * Function used to set the flush rate of diagnostic log entries and error codes. Default is 5 entries
+ * every 10 seconds.
+ * @param client - Reference to the Iotfclient
+ * @param intervalSecs - Interval between flushes
+ * @param maxPerFlush - Entries sent per flush, 1 to 20
+ *
+ * @return int return code
+ */
+DLLExport int setDiagFlushRate(iotfclient *client, int intervalSecs, int maxPerFlush);
+
+/**
+ * Function used to get the statistics of diagnostic log entries and error codes.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the statistics
+ *
+ * @return int return code
+ */
+DLLExport int getDiagStats(iotfclient *client, DiagStats *stats);
+
+/**
+ * Function used to set the thresholds of the location reporter. A location is published when the
+ * device moved minDistanceMeters from the last published location and minIntervalSecs passed since,
+ * or when maxIntervalSecs passed. Default is 25 meters and 10 seconds, without maximum interval.
+ * @param client - Reference to the Iotfclient
+ * @param minDistanceMeters - Distance to move, 0 to publish every fix after minIntervalSecs
+ * @param minIntervalSecs - Time between updates
+ * @param maxIntervalSecs - Time after which the location is published even if the device did not
+ *                          move, 0 for none
+ *
+ * @return int return code
+ */
+DLLExport int setLocationReportOptions(iotfclient *client, double minDistanceMeters, int minIntervalSecs, int maxIntervalSecs);
+
+/**
+ * Function used to report a location fix of the device, for example from a GPS. The location is
+ * sent to the platform as a location update when it passes the thresholds of the location reporter,
+ * other fixes are suppressed.
+ * @param client - Reference to the Iotfclient
+ * @param latitude - Latitude in degrees
+ * @param longitude - Longitude in degrees
+ * @param elevation - Elevation in meters
+ * @param accuracy - Accuracy of the fix in meters
+ *
+ * @return int return code
+ */
+DLLExport int reportLocation(iotfclient *client, double latitude, double longitude, double elevation, double accuracy);
+
+/**
+ * Function used to get the statistics of the location reporter.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the statistics
+ *
+ * @return int return code
+ */
+DLLExport int getLocationReportStats(iotfclient *client, LocationReportStats *stats);
+
+/**
+ * Function used to set the value of a device management attribute. When the platform observes the
+ * attribute, a change is notified, with the members of the value that changed.
+ * @param client - Reference to the Iotfclient
+ * @param field - Attribute: "mgmt.firmware", "location", "deviceInfo" or "metadata"
+ * @param value - Json value of the attribute, like {"fwVersion":"1.2"} for deviceInfo
+ *
+ * @return int return code
+ */
+DLLExport int setDMAttribute(iotfclient *client, char *field, char *value);
+
+/**
+ * Function used to set the minimum interval between notifications of observed attributes. Changes
+ * within the interval are sent in one notification. Default is 1000 milliseconds.
+ * @param client - Reference to the Iotfclient
+ * @param minIntervalMs - Minimum interval in milliseconds
+ *
+ * @return int return code
+ */
+DLLExport int setObserveInterval(iotfclient *client, int minIntervalMs);
+
+/**
+ * Function used to set the options of the manage lifetime renewal. A device managed with a lifetime,
+ * by manage() or manageGatewayDevice(), is managed again between 75% and 85% of the lifetime, at a
+ * random point so that devices do not renew together. Renewal is enabled by default.
+ * @param client - Reference to the Iotfclient
+ * @param enabled - 0 to stop renewing lifetimes, including the lifetimes managed later
+ * @param maxPerSecond - Maximum renewals sent in a second, later renewals are spread over the next
+ *        seconds. 0 for the default of 5.
+ *
+ * @return int return code
+ */
+DLLExport int setDMRenewalOptions(iotfclient *client, int enabled, int maxPerSecond);
+
+/**
+ * Function used to get the statistics of the manage lifetime renewal, like the latency of renewals.
+ * @param client - Reference to the Iotfclient
+ * @param stats - Returns the statistics
+ *
+ * @return int return code
+ */
+DLLExport int getDMRenewalStats(iotfclient *client, DMRenewalStats *stats);
+
+/**
+ * Function used to get the timings of the startup phases, from initialize to the first publish.
+ * @param client - Reference to the Iotfclient
+ * @param timings - Returns the phase timings
+ *
+ * @return int return code
+ */
+DLLExport int getStartupTimings(iotfclient *client, StartupTimings *timings);
+
+/**
+ * Function used to enable the reconnect supervisor. When the connection is lost, the client
+ * reconnects in a background thread with exponential backoff and jitter, instead of blocking
+ * the publishing thread in retry_connection(). While reconnecting, published messages go to
+ * the offline publish queue. Can be called again to change the options.
+ * @param client - Reference to the Iotfclient
+ * @param baseMs - Delay before first reconnect attempt in milliseconds, 0 for 1 second
+ * @param capMs - Maximum delay between reconnect attempts in milliseconds, 0 for 5 minutes
+ * @param queueSize - Size of the offline publish queue, see setPublishQueueSize()
+ *
+ * @return int return code
+ */
+DLLExport int setReconnectOptions(iotfclient *client, int baseMs, int capMs, int queueSize);
+
+/**
+ * Function used to set the size of the offline publish queue. Messages published after initialize
+ * and before connectiotf(), or while the reconnect supervisor reconnects, are queued in memory and
+ * published in order once connected. The default size is 100 messages.
+ * @param client - Reference to the Iotfclient
+ * @param queueSize - Messages queued while not connected. Publishes beyond it return QUEUE_FULL.
+ *                    0 to disable the queue, publishes while reconnecting return CLIENT_DISCONNECTED.
+ *
+ * @return int return code
+ */
+DLLExport int setPublishQueueSize(iotfclient *client, int queueSize);
+
+/**
+ * Function used to replace the default backoff of the reconnect supervisor.
+ * @param client - Reference to the Iotfclient
+ * @param policy - Returns the delay before each reconnect attempt, NULL for the default backoff
+ * @param context - Passed to the policy
+ *
+ * @return int return code
+ */
+DLLExport int setReconnectPolicy(iotfclient *client, reconnectPolicyCallback policy, void *context);
+
+/**
+ * Function used to start the local ingest server of a gateway. Co-located processes can
+ * submit device events, encoded with encodeIngestFrame(), on a UNIX domain datagram socket,
+ * a UNIX domain stream socket or UDP on loopback. Received events are forwarded using
+ * publishDeviceEvent().
+ * @param client - Reference to the GatewayClient
+ * @param dgramPath - Path of UNIX domain datagram socket, NULL to disable
+ * @param streamPath - Path of UNIX domain stream socket, NULL to disable
+ * @param udpPort - UDP port on loopback interface, 0 to disable
+ *
+ * @return int return code
+ */
+DLLExport int startGatewayIngest(iotfclient *client, char *dgramPath, char *streamPath, int udpPort);
+
+/**
+ * Function used to stop the local ingest server of a gateway.
+ * @param client - Reference to the GatewayClient
+ *
+ * @return int return code
+ */
+DLLExport int stopGatewayIngest(iotfclient *client);
+
+/**
+ * Function used to get statistics of the local ingest server.
+ * @param client - Reference to the GatewayClient
+ * @param stats - Returns the ingest statistics
+ *
+ * @return int return code
+ */
+DLLExport int getGatewayIngestStats(iotfclient *client, GatewayIngestStats *stats);
+
+/**
+ * Function used to encode a device event into a local ingest frame.
+ * @param buf - Buffer for the frame
+ * @param bufLen - Size of the buffer
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param eventType - Type of event to be published e.g status, gps
+ * @param eventFormat - Format of the event e.g json
+ * @param data - Payload of the event, may be empty
+ * @param QoS - qos for the publish event. Supported values : QoS0, QoS1, QoS2
+ *
+ * @return int length of the frame, or negative return code
+ */
+DLLExport int encodeIngestFrame(char *buf, int bufLen, char *deviceType, char *deviceId, char *eventType, char *eventFormat, char *data, QoS qos);
+
+/**
+ * Function used to enable envelope publishing. Events added with publishEnvelopeEvent() are
+ * packed into a single gateway event of format "wenv", which is published when it reaches
+ * maxBytes or when the first event in it is maxDelayMs old.
+ * @param client - Reference to the GatewayClient
+ * @param eventType - Event type of the envelope gateway event
+ * @param maxBytes - Size limit of the envelope, 256 or more
+ * @param maxDelayMs - Time limit in milliseconds, 0 to flush on size or flushGatewayEnvelope() only
+ * @param QoS - qos for the envelope publish. Supported values : QoS0, QoS1, QoS2
+ *
+ * @return int return code
+ */
+DLLExport int setGatewayEnvelopeOptions(iotfclient *client, char *eventType, int maxBytes, int maxDelayMs, QoS qos);
+
+/**
+ * Function used to add an event of an attached device to the envelope.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param eventType - Type of event e.g status, gps
+ * @param data - Payload of the event
+ *
+ * @return int return code, or return code from the publish if the envelope was flushed
+ */
+DLLExport int publishEnvelopeEvent(iotfclient *client, char *deviceType, char *deviceId, char *eventType, char* data);
+
+/**
+ * Function used to publish the pending envelope now.
+ * @param client - Reference to the GatewayClient
+ *
+ * @return int return code from the publish
+ */
+DLLExport int flushGatewayEnvelope(iotfclient *client);
+
+/**
+ * Function used to decode an envelope published by a gateway. Does not need a client and
+ * can be used by backend applications.
+ * @param envelope - Envelope payload
+ * @param len - Envelope length
+ * @param cb - Callback invoked for each record, payload is not NUL terminated
+ * @param context - Passed to the callback
+ *
+ * @return int number of records, -1 if the envelope is malformed
+ */
+DLLExport int decodeGatewayEnvelope(char *envelope, int len, envelopeRecordCallback cb, void *context);
+
+/**
+ * Function used to enable windowed aggregation of samples of attached devices. Instead of
+ * publishing every sample, one summary event per device is published with publishDeviceEvent()
+ * at the end of each window, with count, min, max, mean and last value of each metric, and
+ * optionally p50, p90 and p99 percentiles.
+ * @param client - Reference to the GatewayClient
+ * @param eventType - Event type of summary events, NULL for "aggregate"
+ * @param windowMs - Window length in milliseconds
+ * @param slideMs - Interval between summaries of a sliding window, 0 for a tumbling window.
+ *                  windowMs must be a multiple of slideMs.
+ * @param percentileSamples - Samples kept per metric and window to estimate percentiles, 0 to disable
+ *
+ * @return int return code
+ */
+DLLExport int setAggregationOptions(iotfclient *client, char *eventType, int windowMs, int slideMs, int percentileSamples);
+
+/**
+ * Function used to get the handle of a device metric, for use with addAggregateSamples().
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param metric - Name of the metric e.g temperature, at most 256 characters
+ *
+ * @return int handle of the metric, -1 on error
+ */
+DLLExport int getAggregateMetric(iotfclient *client, char *deviceType, char *deviceId, char *metric);
+
+/**
+ * Function used to add a batch of samples.
+ * @param client - Reference to the GatewayClient
+ * @param metrics - Metric handles returned by getAggregateMetric()
+ * @param values - Sample values
+ * @param count - Number of samples
+ *
+ * @return int return code
+ */
+DLLExport int addAggregateSamples(iotfclient *client, int *metrics, double *values, int count);
+
+/**
+ * Function used to add a sample of a device metric.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param metric - Name of the metric e.g temperature, at most 256 characters
+ * @param value - Sample value
+ *
+ * @return int return code
+ */
+DLLExport int addDeviceSample(iotfclient *client, char *deviceType, char *deviceId, char *metric, double value);
+
+/**
+ * Function used to set the gateway notification callback. The callback is invoked for each
+ * notification received on the gateway notify topic, after the error is classified and
+ * accounted to the attached device.
+ * @param client - Reference to the GatewayClient
+ * @param cb - A Function pointer to the gatewayNotificationCallback
+ */
+DLLExport void setGatewayNotificationHandler(iotfclient *client, gatewayNotificationCallback cb);
+
+/**
+ * Function used to enable back off of attached devices rejected by the platform. While
+ * a device is backed off, publishDeviceEvent() returns DEVICE_BACKOFF without publishing.
+ * The interval doubles on each error, starting at minSecs and capped at maxSecs.
+ * @param client - Reference to the GatewayClient
+ * @param minSecs - Initial back off interval in seconds, 0 to disable back off
+ * @param maxSecs - Maximum back off interval in seconds
+ *
+ * @return int return code
+ */
+DLLExport int setGatewayDeviceBackoff(iotfclient *client, int minSecs, int maxSecs);
+
+/**
+ * Function used to get error statistics of an attached device
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param stats - Returns the error statistics
+ *
+ * @return int return code, -1 if no notification was received for the device
+ */
+DLLExport int getDeviceErrorStats(iotfclient *client, char *deviceType, char *deviceId, GatewayDeviceErrorStats *stats);
+
+/**
+ * Function used to send a manage request of an attached device. The responses of all attached
+ * devices are correlated by reqId, on one subscription of the gateway.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param lifetime - Time in seconds within which the device must be managed again, 0 for none
+ * @param supportDeviceActions - Device supports reboot and factory reset requests
+ * @param supportFirmwareActions - Device supports firmware requests
+ * @param cb - Callback called with the response, on timeout or on disconnect. May be NULL.
+ * @param context - Context passed to the callback
+ * @param reqId - Returns the reqId of the request, at least 40 bytes. May be NULL.
+ *
+ * @return int return code
+ */
+DLLExport int manageGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, long lifetime,
+    int supportDeviceActions, int supportFirmwareActions, dmResponseCallback cb, void *context, char *reqId);
+
+/**
+ * Function used to send an unmanage request of an attached device. The device is removed from the
+ * DM state of the gateway.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param cb - Callback called with the response, on timeout or on disconnect. May be NULL.
+ * @param context - Context passed to the callback
+ * @param reqId - Returns the reqId of the request, at least 40 bytes. May be NULL.
+ *
+ * @return int return code
+ */
+DLLExport int unmanageGatewayDevice(iotfclient *client, char *deviceType, char *deviceId, dmResponseCallback cb, void *context, char *reqId);
+
+/**
+ * Function used to send the response to a DM request of an attached device.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ * @param reqId - reqId of the request
+ * @param rc - Response code, like 202 for an initiated reboot
+ *
+ * @return int return code
+ */
+DLLExport int respondGatewayDeviceDM(iotfclient *client, char *deviceType, char *deviceId, char *reqId, int rc);
+
+/**
+ * Function used to get the DM state of an attached device.
+ * @param client - Reference to the GatewayClient
+ * @param deviceType - The type of your device
+ * @param deviceId - The ID of your device
+ *
+ * @return int GATEWAYDM_MANAGING or GATEWAYDM_MANAGED, -1 if the device is not known. A device is
+ *         removed by unmanageGatewayDevice(), and when its manage request fails or is rejected.
+ */
+DLLExport int getGatewayDeviceDMState(iotfclient *client, char *deviceType, char *deviceId);
+
+/**
+ * Function used to set the handler of DM requests of attached devices, like reboot or firmware
+ * requests. The handler answers with respondGatewayDeviceDM().
+ * @param client - Reference to the GatewayClient
+ * @param cb - A Function pointer to the gatewayDMCommandCallback
+ */
+DLLExport void setGatewayDMCommandHandler(iotfclient *client, gatewayDMCommandCallback cb);
+
 /** Retrieve certificates and key from Secure Element using NXP A71CH APIs */
 DLLExport char * a71ch_retrieveCertificatesFromSE(char * certDir);
 
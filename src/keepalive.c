@@ -0,0 +1,342 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Per client keepalive. Without it, clients use the process wide
+ * keepAliveInterval of setKeepAliveInterval().
+ *
+ * The adaptive keepalive learns the largest interval the network path, with
+ * its NAT and firewall timeouts, tolerates. MQTT pings are only sent while
+ * there is no other traffic, so the interval is judged on idle gaps:
+ *
+ * - a gap of more than KEEPALIVE_CONFIRM_FACTOR intervals without traffic,
+ *   after which the connection is still up, confirms the interval - pings
+ *   kept the path open. The next connection probes a larger interval.
+ * - a connection lost after an idle gap of one to KEEPALIVE_CONFIRM_FACTOR
+ *   intervals means the path dropped the idle connection. The interval is
+ *   the ceiling, the next connection goes back to the last confirmed one.
+ *
+ * Probing doubles the interval up to the maximum, and bisects between the
+ * confirmed interval and the ceiling once one is known. The ceiling expires
+ * after a day, as the path may change. Keepalive can only change with a new
+ * connection, so probing never reconnects by itself.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define KEEPALIVE_CONFIRM_FACTOR    2.5
+#define KEEPALIVE_CEILING_SECS      86400
+
+typedef struct {
+    pthread_mutex_t lock;
+    int minSecs;
+    int maxSecs;
+    int adaptive;
+    char *statePath;
+    int current;                /* interval of the next connection             */
+    int confirmed;              /* largest interval confirmed, 0 if none       */
+    int ceiling;                /* smallest interval that failed, 0 if none    */
+    time_t ceilingExpires;
+    int connected;
+    int active;                 /* interval of the connection                  */
+    long long lastActivityMs;
+} keepAliveState;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+extern unsigned short keepAliveInterval;
+
+
+/* Persist learned intervals. Called with lock held. */
+static void saveKeepAlive(keepAliveState *ka)
+{
+    char tmpPath[strlen(ka->statePath) + 5];
+    FILE *fp;
+
+    sprintf(tmpPath, "%s.tmp", ka->statePath);
+    fp = fopen(tmpPath, "w");
+    if ( fp == NULL ) {
+        LOG(WARN, "Failed to write keepalive state %s: errno=%d", tmpPath, errno);
+        return;
+    }
+    fprintf(fp, "KEEPALIVE1 %d %d %d %ld\n", ka->current, ka->confirmed, ka->ceiling, (long)ka->ceilingExpires);
+    if ( fclose(fp) == 0 )
+        rename(tmpPath, ka->statePath);
+    else
+        unlink(tmpPath);
+}
+
+/* Load learned intervals, ignoring values out of the current range. Called with lock held. */
+static void loadKeepAlive(keepAliveState *ka)
+{
+    int current, confirmed, ceiling;
+    long expires;
+    FILE *fp;
+
+    if ( (fp = fopen(ka->statePath, "r")) == NULL )
+        return;
+
+    if ( fscanf(fp, "KEEPALIVE1 %d %d %d %ld", &current, &confirmed, &ceiling, &expires) == 4 ) {
+        if ( current >= ka->minSecs && current <= ka->maxSecs )
+            ka->current = current;
+        if ( confirmed >= ka->minSecs && confirmed <= ka->maxSecs )
+            ka->confirmed = confirmed;
+        if ( ceiling > ka->minSecs && ceiling <= ka->maxSecs && time(NULL) < (time_t)expires ) {
+            ka->ceiling = ceiling;
+            ka->ceilingExpires = (time_t)expires;
+            if ( ka->current >= ceiling )
+                ka->current = ka->confirmed ? ka->confirmed : ka->minSecs;
+        }
+        LOG(INFO, "Loaded keepalive state: current=%d confirmed=%d ceiling=%d", ka->current, ka->confirmed, ka->ceiling);
+    }
+    fclose(fp);
+}
+
+/* Interval to probe after the current one is confirmed. Called with lock held. */
+static int nextProbe(keepAliveState *ka)
+{
+    int next = ka->confirmed * 2;
+
+    if ( ka->ceiling && time(NULL) >= ka->ceilingExpires )
+        ka->ceiling = 0;
+    if ( ka->ceiling )
+        next = (ka->confirmed + ka->ceiling) / 2;
+    if ( next > ka->maxSecs )
+        next = ka->maxSecs;
+    /* stop probing once within a tenth of the ceiling */
+    if ( next - ka->confirmed < ka->confirmed / 10 + 1 )
+        next = ka->confirmed;
+
+    return next;
+}
+
+/*
+ * The interval of the connection held an idle gap. A connection at the
+ * confirmed interval probes again, to bisect toward the ceiling or double
+ * once it expired. Returns 1 if the state changed. Called with lock held.
+ */
+static int confirmKeepAlive(keepAliveState *ka)
+{
+    int changed = 0;
+    int next;
+
+    if ( ka->active > ka->confirmed ) {
+        ka->confirmed = ka->active;
+        changed = 1;
+    }
+    next = nextProbe(ka);
+    if ( next != ka->current ) {
+        ka->current = next;
+        changed = 1;
+    }
+
+    return changed;
+}
+
+static keepAliveState * getKeepAliveState(iotfclient *client)
+{
+    keepAliveState *ka;
+
+    pthread_mutex_lock(&createLock);
+    ka = (keepAliveState *)client->keepalive;
+    if ( ka == NULL ) {
+        ka = (keepAliveState *)calloc(1, sizeof(keepAliveState));
+        if ( ka != NULL ) {
+            pthread_mutex_init(&ka->lock, NULL);
+            client->keepalive = ka;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return ka;
+}
+
+/**
+ * Function used to set the keepalive interval of a client.
+ */
+int setClientKeepAliveInterval(iotfclient *client, int keepAlive)
+{
+    return setAdaptiveKeepAlive(client, keepAlive, keepAlive, NULL);
+}
+
+/**
+ * Function used to enable the adaptive keepalive of a client.
+ */
+int setAdaptiveKeepAlive(iotfclient *client, int minSecs, int maxSecs, char *statePath)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    keepAliveState *ka;
+
+    if ( minSecs <= 0 || maxSecs < minSecs || maxSecs > 65535 ) {
+        LOG(WARN, "Invalid keepalive interval: minSecs=%d maxSecs=%d", minSecs, maxSecs);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (ka = getKeepAliveState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&ka->lock);
+    ka->minSecs = minSecs;
+    ka->maxSecs = maxSecs;
+    ka->adaptive = (maxSecs > minSecs);
+    ka->current = minSecs;
+    ka->confirmed = 0;
+    ka->ceiling = 0;
+    freePtr(ka->statePath);
+    ka->statePath = (ka->adaptive && statePath && *statePath) ? strdup(statePath) : NULL;
+    if ( ka->statePath )
+        loadKeepAlive(ka);
+    pthread_mutex_unlock(&ka->lock);
+
+    LOG(INFO, "Keepalive: minSecs=%d maxSecs=%d statePath=%s", minSecs, maxSecs, statePath ? statePath : "");
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the keepalive interval of the next connection.
+ */
+int getClientKeepAliveInterval(iotfclient *client)
+{
+    keepAliveState *ka = (keepAliveState *)client->keepalive;
+    int keepAlive = keepAliveInterval;
+
+    if ( ka != NULL ) {
+        pthread_mutex_lock(&ka->lock);
+        keepAlive = ka->current;
+        pthread_mutex_unlock(&ka->lock);
+    }
+
+    return keepAlive;
+}
+
+/*
+ * Start tracking idle gaps of a new connection
+ */
+void keepAliveConnected(iotfclient *client)
+{
+    keepAliveState *ka = (keepAliveState *)client->keepalive;
+
+    if ( ka == NULL || !ka->adaptive )
+        return;
+
+    pthread_mutex_lock(&ka->lock);
+    ka->connected = 1;
+    ka->active = ka->current;
+    ka->lastActivityMs = monotonicMs();
+    pthread_mutex_unlock(&ka->lock);
+}
+
+/*
+ * Note traffic on the connection. A long enough idle gap before it confirms
+ * the keepalive interval.
+ */
+void keepAliveActivity(iotfclient *client)
+{
+    keepAliveState *ka = (keepAliveState *)client->keepalive;
+    long long now;
+
+    if ( ka == NULL || !ka->adaptive )
+        return;
+
+    now = monotonicMs();
+    pthread_mutex_lock(&ka->lock);
+    if ( ka->connected && ka->active >= ka->confirmed &&
+         now - ka->lastActivityMs >= (long long)(KEEPALIVE_CONFIRM_FACTOR * ka->active * 1000) &&
+         confirmKeepAlive(ka) ) {
+        LOG(INFO, "Keepalive %d secs confirmed, next connection uses %d secs", ka->confirmed, ka->current);
+        if ( ka->statePath )
+            saveKeepAlive(ka);
+    }
+    ka->lastActivityMs = now;
+    pthread_mutex_unlock(&ka->lock);
+}
+
+/*
+ * Connection lost. If it was lost after an idle gap the keepalive interval
+ * should have covered, the path does not tolerate the interval.
+ */
+void keepAliveLost(iotfclient *client)
+{
+    keepAliveState *ka = (keepAliveState *)client->keepalive;
+    long long idleMs;
+    int failed;
+
+    if ( ka == NULL || !ka->adaptive )
+        return;
+
+    pthread_mutex_lock(&ka->lock);
+    if ( !ka->connected )
+        goto unlock;
+    ka->connected = 0;
+
+    idleMs = monotonicMs() - ka->lastActivityMs;
+    if ( idleMs < (long long)ka->active * 1000 )
+        goto unlock;
+
+    /* Pings of the interval did not keep the path open */
+    if ( idleMs < (long long)(KEEPALIVE_CONFIRM_FACTOR * ka->active * 1000) ) {
+        if ( ka->active <= ka->minSecs )
+            goto unlock;
+        failed = ka->active;
+        ka->ceiling = failed;
+        ka->ceilingExpires = time(NULL) + KEEPALIVE_CEILING_SECS;
+        if ( ka->confirmed && ka->confirmed < failed )
+            ka->current = ka->confirmed;
+        else
+            ka->current = (failed / 2 > ka->minSecs) ? failed / 2 : ka->minSecs;
+        if ( ka->confirmed >= failed )
+            ka->confirmed = 0;
+        LOG(WARN, "Connection lost after %lld ms idle, keepalive %d secs is too long, next connection uses %d secs",
+            idleMs, failed, ka->current);
+    } else if ( ka->active >= ka->confirmed ) {
+        /* lost for another reason after the interval was held */
+        confirmKeepAlive(ka);
+    }
+    if ( ka->statePath )
+        saveKeepAlive(ka);
+
+unlock:
+    pthread_mutex_unlock(&ka->lock);
+}
+
+/*
+ * Free keepalive state
+ */
+void freeKeepAlive(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    keepAliveState *ka = (keepAliveState *)client->keepalive;
+
+    if ( ka != NULL ) {
+        pthread_mutex_destroy(&ka->lock);
+        freePtr(ka->statePath);
+        free(ka);
+        client->keepalive = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
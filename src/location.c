@@ -0,0 +1,308 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Location reporter. reportLocation() takes every fix of the device, and
+ * publishes a location update only when the device moved at least
+ * minDistanceMeters from the last published location, by the haversine
+ * great circle distance, and minIntervalSecs passed since. With
+ * maxIntervalSecs, a device that does not move still reports at that
+ * interval. Other fixes are suppressed, without a publish.
+ *
+ * Location updates are serialized with their reqId into a buffer of the
+ * client, reused by all updates. The location sent is the value of the
+ * location attribute for observers.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+#include "cJSON.h"
+
+#define LOCATION_PAYLOAD_SIZE       512
+#define LOCATION_MIN_DISTANCE       25.0
+#define LOCATION_MIN_INTERVAL_SECS  10
+#define EARTH_RADIUS_METERS         6371008.8
+
+extern int addDMRequest(iotfclient *client, char *reqId, int timeoutSecs, dmResponseCallback cb, void *context);
+extern void cancelDMRequest(iotfclient *client, char *reqId);
+extern int storeDMAttribute(iotfclient *client, char *field, cJSON *value, int notify);
+
+typedef struct {
+    pthread_mutex_t lock;       /* thresholds, last location and stats      */
+    pthread_mutex_t sendLock;   /* payload, held across the publish          */
+    double minDistanceMeters;
+    int minIntervalSecs;
+    int maxIntervalSecs;
+    int reported;               /* a location was published */
+    double latitude;            /* of the last published location */
+    double longitude;
+    long long reportedMs;
+    LocationReportStats stats;
+    char payload[LOCATION_PAYLOAD_SIZE];
+} locationReport;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static locationReport * getLocationReportState(iotfclient *client)
+{
+    locationReport *lr;
+
+    pthread_mutex_lock(&createLock);
+    lr = (locationReport *)client->location;
+    if ( lr == NULL ) {
+        lr = (locationReport *)calloc(1, sizeof(locationReport));
+        if ( lr != NULL ) {
+            lr->minDistanceMeters = LOCATION_MIN_DISTANCE;
+            lr->minIntervalSecs = LOCATION_MIN_INTERVAL_SECS;
+            pthread_mutex_init(&lr->lock, NULL);
+            pthread_mutex_init(&lr->sendLock, NULL);
+            client->location = lr;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return lr;
+}
+
+/* Great circle distance in meters */
+static double haversine(double lat1, double lon1, double lat2, double lon2)
+{
+    double rad = M_PI / 180.0;
+    double dlat = (lat2 - lat1) * rad;
+    double dlon = (lon2 - lon1) * rad;
+    double a = sin(dlat / 2) * sin(dlat / 2) + cos(lat1 * rad) * cos(lat2 * rad) * sin(dlon / 2) * sin(dlon / 2);
+
+    return 2 * EARTH_RADIUS_METERS * asin(sqrt(a < 1.0 ? a : 1.0));
+}
+
+/* Location attribute of device management, as sent in the update */
+static cJSON * locationValue(double latitude, double longitude, double elevation,
+    char *measuredDateTime, char *updatedDateTime, double accuracy)
+{
+    cJSON *value = cJSON_CreateObject();
+
+    if ( value == NULL )
+        return NULL;
+    cJSON_AddNumberToObject(value, "longitude", longitude);
+    cJSON_AddNumberToObject(value, "latitude", latitude);
+    cJSON_AddNumberToObject(value, "elevation", elevation);
+    cJSON_AddStringToObject(value, "measuredDateTime", measuredDateTime ? measuredDateTime : "");
+    cJSON_AddStringToObject(value, "updatedDateTime", updatedDateTime ? updatedDateTime : "");
+    cJSON_AddNumberToObject(value, "accuracy", accuracy);
+
+    return value;
+}
+
+/* Serialize and send a location update request. Called with sendLock held. */
+static int sendLocation(iotfclient *client, locationReport *lr, double latitude, double longitude, double elevation,
+    char *measuredDateTime, char *updatedDateTime, double accuracy)
+{
+    char uuid_str[40];
+    int rc;
+
+    generateUUID(uuid_str);
+    if ( snprintf(lr->payload, sizeof(lr->payload),
+             "{\"d\":{\"longitude\":%f,\"latitude\":%f,\"elevation\":%f,\"measuredDateTime\":\"%s\","
+             "\"updatedDateTime\":\"%s\",\"accuracy\":%f},\"reqId\":\"%s\"}",
+             longitude, latitude, elevation, measuredDateTime ? measuredDateTime : "",
+             updatedDateTime ? updatedDateTime : "", accuracy, uuid_str) >= (int)sizeof(lr->payload) )
+        return MISSING_INPUT_PARAM;
+
+    /* register first, the response can arrive before publishData() returns */
+    if ( addDMRequest(client, uuid_str, 0, NULL, NULL) != 0 )
+        return -1;
+
+    LOG(DEBUG, "Send location update: payload=%s", lr->payload);
+    if ( (rc = publishData(client, UPDATE_LOCATION, lr->payload, QoS1)) != 0 ) {
+        cancelDMRequest(client, uuid_str);
+        LOG(WARN, "Failed to send location update: rc=%d", rc);
+    } else {
+        /* the platform has the location, observers are not notified of it */
+        storeDMAttribute(client, "location",
+            locationValue(latitude, longitude, elevation, measuredDateTime, updatedDateTime, accuracy), 0);
+    }
+
+    return rc;
+}
+
+/*
+ * Send a location update, without thresholds
+ */
+int publishLocation(iotfclient *client, double latitude, double longitude, double elevation,
+    char *measuredDateTime, char *updatedDateTime, double accuracy)
+{
+    locationReport *lr = getLocationReportState(client);
+    int rc;
+
+    if ( lr == NULL )
+        return -1;
+
+    pthread_mutex_lock(&lr->sendLock);
+    rc = sendLocation(client, lr, latitude, longitude, elevation, measuredDateTime, updatedDateTime, accuracy);
+    pthread_mutex_unlock(&lr->sendLock);
+
+    return rc;
+}
+
+/**
+ * Function used to set the thresholds of the location reporter.
+ */
+int setLocationReportOptions(iotfclient *client, double minDistanceMeters, int minIntervalSecs, int maxIntervalSecs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    locationReport *lr;
+
+    if ( minDistanceMeters < 0 || minIntervalSecs < 0 || maxIntervalSecs < 0 ||
+         (maxIntervalSecs > 0 && maxIntervalSecs < minIntervalSecs) ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (lr = getLocationReportState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&lr->lock);
+    lr->minDistanceMeters = minDistanceMeters;
+    lr->minIntervalSecs = minIntervalSecs;
+    lr->maxIntervalSecs = maxIntervalSecs;
+    pthread_mutex_unlock(&lr->lock);
+
+    LOG(INFO, "Location report: minDistanceMeters=%.1f minIntervalSecs=%d maxIntervalSecs=%d",
+        minDistanceMeters, minIntervalSecs, maxIntervalSecs);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to report a location fix of the device.
+ */
+int reportLocation(iotfclient *client, double latitude, double longitude, double elevation, double accuracy)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    locationReport *lr;
+    long long now = monotonicMs();
+    double distance = 0;
+    char dateTime[32];
+    struct tm tm;
+    time_t t;
+
+    if ( isnan(latitude) || isnan(longitude) || latitude < -90 || latitude > 90 || longitude < -180 || longitude > 180 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (lr = getLocationReportState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    /* reports are sent one at a time, the lock is not held across the publish */
+    pthread_mutex_lock(&lr->sendLock);
+    pthread_mutex_lock(&lr->lock);
+    lr->stats.fixes++;
+    if ( lr->reported ) {
+        long long elapsedMs = now - lr->reportedMs;
+
+        distance = haversine(lr->latitude, lr->longitude, latitude, longitude);
+        lr->stats.lastDistanceMeters = distance;
+        if ( elapsedMs < lr->minIntervalSecs * 1000LL ||
+             (distance < lr->minDistanceMeters &&
+              (lr->maxIntervalSecs == 0 || elapsedMs < lr->maxIntervalSecs * 1000LL)) ) {
+            lr->stats.suppressed++;
+            goto unlock;
+        }
+    }
+
+    pthread_mutex_unlock(&lr->lock);
+
+    t = time(NULL);
+    gmtime_r(&t, &tm);
+    strftime(dateTime, sizeof(dateTime), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    rc = sendLocation(client, lr, latitude, longitude, elevation, dateTime, dateTime, accuracy);
+
+    pthread_mutex_lock(&lr->lock);
+    if ( rc == 0 ) {
+        lr->reported = 1;
+        lr->latitude = latitude;
+        lr->longitude = longitude;
+        lr->reportedMs = now;
+        lr->stats.published++;
+        LOG(DEBUG, "Location published after moving %.1f meters", distance);
+    }
+
+unlock:
+    pthread_mutex_unlock(&lr->lock);
+    pthread_mutex_unlock(&lr->sendLock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to get the statistics of the location reporter.
+ */
+int getLocationReportStats(iotfclient *client, LocationReportStats *stats)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    locationReport *lr;
+
+    if ( stats == NULL ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (lr = getLocationReportState(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&lr->lock);
+    *stats = lr->stats;
+    pthread_mutex_unlock(&lr->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Free the location reporter
+ */
+void freeLocationReport(iotfclient *client)
+{
+    locationReport *lr = (locationReport *)client->location;
+
+    if ( lr != NULL ) {
+        pthread_mutex_destroy(&lr->sendLock);
+        pthread_mutex_destroy(&lr->lock);
+        free(lr);
+        client->location = NULL;
+    }
+}
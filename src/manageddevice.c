@@ -1,12 +1,80 @@
 #include "manageddevice.h"
 #include "cJSON.h"
 
-static char currentRequestID[40];
+/* reqId of the last action request, for changeState() */
+static char actionRequestID[40];
 volatile int interrupt = 0;
 
+extern int addDMRequest(iotfclient *client, char *reqId, int timeoutSecs, dmResponseCallback cb, void *context);
+extern void cancelDMRequest(iotfclient *client, char *reqId);
+extern int completeDMRequest(iotfclient *client, char *reqId, int rc, char *payload, size_t payloadlen);
+extern int firmwareDownloadEnabled(iotfclient *client);
+extern int publishLocation(iotfclient *client, double latitude, double longitude, double elevation,
+    char *measuredDateTime, char *updatedDateTime, double accuracy);
+extern int storeDMAttribute(iotfclient *client, char *field, cJSON *value, int notify);
+extern int observeDMAttribute(iotfclient *client, char *field, cJSON **value);
+extern int cancelDMAttribute(iotfclient *client, char *field);
+extern int isDMAttributeObserved(iotfclient *client, char *field);
+extern int messageArrived_gatewaydm(iotfclient *client, char *topic, void *payload, size_t len);
+extern int scheduleDMRenewal(iotfclient *client, char *deviceType, char *deviceId, long lifetime,
+    int supportDeviceActions, int supportFirmwareActions);
+extern void cancelDMRenewal(iotfclient *client, char *deviceType, char *deviceId);
+
 /* Device Management Command Callback */
 dmCommandCallback dmcb;
 
+/* Store the firmware state for observers, notified if changed */
+static int storeFirmwareAttribute(int notify)
+{
+    cJSON *value = cJSON_CreateObject();
+
+    if ( value == NULL )
+        return -1;
+    cJSON_AddNumberToObject(value, "state", dmClient.DeviceData.mgmt.firmware.state);
+    cJSON_AddNumberToObject(value, "updateStatus", dmClient.DeviceData.mgmt.firmware.updateStatus);
+
+    return storeDMAttribute(dmClient.client, "mgmt.firmware", value, notify);
+}
+
+/* Copy reqId of a request of the platform */
+static void getRequestId(cJSON *jsonPayload, char *reqId, size_t len)
+{
+    cJSON *jreqId = cJSON_GetObjectItem(jsonPayload, "reqId");
+
+    if ( jreqId && jreqId->valuestring )
+        snprintf(reqId, len, "%s", jreqId->valuestring);
+    else
+        reqId[0] = '\0';
+}
+
+/* Lifetime and supports of a manage request, renewed once accepted */
+typedef struct {
+    iotfclient *client;
+    long lifetime;
+    int supportDeviceActions;
+    int supportFirmwareActions;
+} manageRequest;
+
+/* Response of a manage request, or its timeout */
+static void manageResponse(void *context, char *reqId, int rc, char *payload, size_t payloadlen)
+{
+    manageRequest *req = (manageRequest *)context;
+    char status[12];
+
+    /* manage again before the accepted lifetime runs out */
+    if ( rc == 200 )
+        scheduleDMRenewal(req->client, NULL, NULL, req->lifetime, req->supportDeviceActions, req->supportFirmwareActions);
+
+    /* Response is passed to the DM command callback */
+    if ( payload != NULL && dmcb != 0 ) {
+        sprintf(status, "%d", rc);
+        interrupt = 1;
+        (*dmcb)(status, reqId, payload, payloadlen);
+    }
+
+    free(req);
+}
+
 /**
 * <p>Send a device manage request to Watson IoT Platform</p>
 *
@@ -38,6 +106,7 @@ void manage(iotfclient *client, long lifetime, int supportDeviceActions, int sup
     int rc = -1;
     char uuid_str[40];
     char payload[1500];
+    manageRequest *req;
 
     if ( client->managed == 1 ) {
         LOG(ERROR, "Managed device is already initialized.");
@@ -48,7 +117,6 @@ void manage(iotfclient *client, long lifetime, int supportDeviceActions, int sup
     char *plFormat = "{\"d\": {\"lifetime\":%ld ,\"supports\": {\"deviceActions\":%d,\"firmwareActions\":%d},\"deviceInfo\": {}},\"reqId\": \"%s\"}";
 
     generateUUID(uuid_str);
-    strcpy(currentRequestID,uuid_str);
 
 //     sprintf(payload, plFormat, dmClient.DeviceData.metadata.metadata, 
     sprintf(payload, plFormat, 
@@ -66,6 +134,19 @@ void manage(iotfclient *client, long lifetime, int supportDeviceActions, int sup
     LOG(DEBUG, "Send MANAGE request: %s", payload);
     rc = subscribeTopic(client, "iotdm-1/#", QoS0);
 
+    /* Renewal starts once the platform accepts the request */
+    if ( (req = (manageRequest *)calloc(1, sizeof(manageRequest))) == NULL ) {
+        LOG(ERROR, "Failed to allocate Managed Device request");
+        return;
+    }
+    req->client = client;
+    req->lifetime = lifetime;
+    req->supportDeviceActions = supportDeviceActions;
+    req->supportFirmwareActions = supportFirmwareActions;
+    if ( addDMRequest(client, uuid_str, 0, manageResponse, req) != 0 ) {
+        free(req);
+        req = NULL;
+    }
     rc = publishData(client, MANAGE, payload, QoS1);
     if (rc == 0) {
         strcpy(reqId, uuid_str);
@@ -78,6 +159,8 @@ void manage(iotfclient *client, long lifetime, int supportDeviceActions, int sup
         memset((void *)&dmClient, 0, sizeof(dmClient));
         dmClient.client = client;
     } else {
+        cancelDMRequest(client, uuid_str);
+        free(req);
         LOG(INFO, "Failed to send Managed Device request: rc=%d", rc);
     }
 
@@ -108,16 +191,19 @@ void unmanage(iotfclient *client, char* reqId)
     }
 
     generateUUID(uuid_str);
-    strcpy(currentRequestID,uuid_str);
 
     sprintf(data,"{\"reqId\":\"%s\"}",uuid_str);
 
+    addDMRequest(client, uuid_str, 0, NULL, NULL);
     rc = publishData(client, UNMANAGE, data, QoS0);
     if(rc == 0){
         strcpy(reqId, uuid_str);
         LOG(DEBUG, "reqId = %s",reqId);
         memset((void *)&dmClient, 0, sizeof(dmClient));
         client->managed = 0;
+        cancelDMRenewal(client, NULL, NULL);
+    } else {
+        cancelDMRequest(client, uuid_str);
     }
 
     LOG(DEBUG, "exit:: rc = %d",rc);
@@ -151,11 +237,13 @@ void messageFirmwareDownload(void *payload)
 
     int rc = RESPONSE_ACCEPTED;
     char respmsg[300];
+    char reqId[40];
 
     cJSON * jsonPayload = cJSON_Parse(payload);
-    strcpy(currentRequestID, cJSON_GetObjectItem(jsonPayload, "reqId")->valuestring);
+    getRequestId(jsonPayload, reqId, sizeof(reqId));
+    cJSON_Delete(jsonPayload);
 
-    LOG(DEBUG,"messageFirmwareDownload with reqId:%s",currentRequestID);
+    LOG(DEBUG,"messageFirmwareDownload with reqId:%s",reqId);
 
     if (dmClient.DeviceData.mgmt.firmware.state != FIRMWARESTATE_IDLE)
     {
@@ -163,6 +251,12 @@ void messageFirmwareDownload(void *payload)
 
         LOG(DEBUG,"Cannot download as the device is not in the idle state");
     }
+    else if (firmwareDownloadEnabled(dmClient.client) && dmClient.DeviceData.mgmt.firmware.url[0] == '\0')
+    {
+        rc = BAD_REQUEST;
+
+        LOG(DEBUG,"Cannot download as the firmware URI is not set");
+    }
     else
     {
         rc = RESPONSE_ACCEPTED;
@@ -170,12 +264,21 @@ void messageFirmwareDownload(void *payload)
         LOG(DEBUG,"Firmware Download Initiated");
     }
 
-    sprintf(respmsg,"{\"rc\":%d,\"reqId\":%s}",rc,currentRequestID);
+    sprintf(respmsg,"{\"rc\":%d,\"reqId\":\"%s\"}",rc,reqId);
 
     publishData(dmClient.client, RESPONSE, respmsg, QoS1);
 
     if (rc == RESPONSE_ACCEPTED) {
-        if ( dmcbFirmwareDownload != 0 ) {
+        if ( firmwareDownloadEnabled(dmClient.client) ) {
+            /* the download thread updates the firmware state */
+            rc = startFirmwareDownload(dmClient.client, dmClient.DeviceData.mgmt.firmware.url,
+                    dmClient.DeviceData.mgmt.firmware.verifier);
+            /* a verifier that is not a digest already set the update status */
+            if ( rc != 0 && rc != FIRMWAREUPDATE_VERIFICATIONFAILED ) {
+                changeFirmwareDownloadState(FIRMWARESTATE_IDLE);
+                changeFirmwareUpdateState(FIRMWAREUPDATE_OUTOFMEMORY);
+            }
+        } else if ( dmcbFirmwareDownload != 0 ) {
             LOG(DEBUG,"Calling Firmware Download callback");
             (*dmcbFirmwareDownload)();
         } else {
@@ -187,12 +290,17 @@ void messageFirmwareDownload(void *payload)
 }
 
 //Handler for Firmware update request
-void messageFirmwareUpdate()
+void messageFirmwareUpdate(void *payload)
 {
     LOG(DEBUG, "entry::");
 
     int rc;
     char respmsg[300];
+    char reqId[40];
+
+    cJSON * jsonPayload = cJSON_Parse(payload);
+    getRequestId(jsonPayload, reqId, sizeof(reqId));
+    cJSON_Delete(jsonPayload);
 
     LOG(DEBUG,"Update Firmware Request, Firmware State: %d", dmClient.DeviceData.mgmt.firmware.state);
 
@@ -205,7 +313,7 @@ void messageFirmwareUpdate()
         LOG(DEBUG,"Firmware Update Initiated");
     }
 
-    sprintf(respmsg, "{\"rc\":%d,\"reqId\":%s}", rc, currentRequestID);
+    sprintf(respmsg, "{\"rc\":%d,\"reqId\":\"%s\"}", rc, reqId);
     
     publishData(dmClient.client, RESPONSE, respmsg, QoS1);
 
@@ -222,21 +330,67 @@ void messageFirmwareUpdate()
 }
 
 //Handler for Observe request
-void messageObserve(void)
+void messageObserve(void *payload)
 {
     LOG(DEBUG, "entry::");
 
-    LOG(DEBUG,"Observe reqId: %s", currentRequestID);
+    int i = 0;
+    int rc = RESPONSE_SUCCESS;
+    char reqId[40];
+    char *respMsg = NULL;
+    cJSON *jsonPayload = cJSON_Parse(payload);
+    cJSON *fields = cJSON_GetObjectItem(cJSON_GetObjectItem(jsonPayload, "d"), "fields");
+    cJSON *response = cJSON_CreateObject();
+    cJSON *values = cJSON_CreateArray();
+
+    getRequestId(jsonPayload, reqId, sizeof(reqId));
+    LOG(DEBUG,"Observe reqId: %s", reqId);
+
+    if ( !cJSON_IsArray(fields) )
+        rc = BAD_REQUEST;
 
-    int rc = 200;
-    char respMsg[256];
-    char *plFormat = "{\"rc\":%d,\"reqId\":\"%s\",\"d\":{\"fields\":[{\"field\":\"mgmt.firmware\",\"value\":{\"state\":0,\"updateStatus\":0}}]}}";
-    sprintf(respMsg, plFormat, rc, currentRequestID);
+    /* observe the fields, the response carries their current values */
+    for (i = 0; rc == RESPONSE_SUCCESS && i < cJSON_GetArraySize(fields); i++) {
+        cJSON *fieldName = cJSON_GetObjectItem(cJSON_GetArrayItem(fields, i), "field");
+        cJSON *value = NULL;
+
+        if ( !cJSON_IsString(fieldName) )
+            continue;
+        if ( !strcmp(fieldName->valuestring, "mgmt.firmware") )
+            storeFirmwareAttribute(0);
+        if ( observeDMAttribute(dmClient.client, fieldName->valuestring, &value) != 0 ) {
+            LOG(DEBUG,"Observe of %s not supported", fieldName->valuestring);
+            continue;
+        }
+        if ( value ) {
+            cJSON *field = cJSON_CreateObject();
+            cJSON_AddStringToObject(field, "field", fieldName->valuestring);
+            cJSON_AddItemToObject(field, "value", value);
+            cJSON_AddItemToArray(values, field);
+        }
+    }
+    dmClient.bObserve = isDMAttributeObserved(dmClient.client, "mgmt.firmware");
+
+    cJSON_AddNumberToObject(response, "rc", rc);
+    cJSON_AddStringToObject(response, "reqId", reqId);
+    if ( rc == RESPONSE_SUCCESS ) {
+        cJSON *d = cJSON_CreateObject();
+        cJSON_AddItemToObject(d, "fields", values);
+        cJSON_AddItemToObject(response, "d", d);
+        values = NULL;
+    }
+    respMsg = cJSON_PrintUnformatted(response);
 
-    LOG(INFO,"Response Message:%s", respMsg);
+    LOG(INFO,"Response Message:%s", respMsg ? respMsg : "");
 
     //Publish the response to the IoTF
-    publishData(dmClient.client, RESPONSE, respMsg, QoS1);
+    if ( respMsg )
+        publishData(dmClient.client, RESPONSE, respMsg, QoS1);
+
+    free(respMsg);
+    cJSON_Delete(values);
+    cJSON_Delete(response);
+    cJSON_Delete(jsonPayload);
 
     LOG(DEBUG, "exit::");
 }
@@ -247,34 +401,41 @@ void messageCancel(void *payload)
     LOG(DEBUG, "entry::");
 
     int i = 0;
+    int rc = RESPONSE_SUCCESS;
     char respMsg[100];
+    char reqId[40];
     cJSON * jsonPayload = cJSON_Parse(payload);
-    cJSON* jreqId = cJSON_GetObjectItem(jsonPayload, "reqId");
-    strcpy(currentRequestID, jreqId->valuestring);
+    getRequestId(jsonPayload, reqId, sizeof(reqId));
 
-    LOG(DEBUG,"Cancel reqId: %s", currentRequestID);
+    LOG(DEBUG,"Cancel reqId: %s", reqId);
 
     cJSON *d = cJSON_GetObjectItem(jsonPayload, "d");
     cJSON *fields = cJSON_GetObjectItem(d, "fields");
-    //cJSON *fields = cJSON_GetObjectItem(jsonPayload,"fields");
-    for (i = 0; i < cJSON_GetArraySize(fields); i++) {
+
+    if ( !cJSON_IsArray(fields) )
+        rc = BAD_REQUEST;
+
+    /* pending changes of the fields are dropped, one response for all fields */
+    for (i = 0; rc == RESPONSE_SUCCESS && i < cJSON_GetArraySize(fields); i++) {
         cJSON * field = cJSON_GetArrayItem(fields, i);
         cJSON* fieldName = cJSON_GetObjectItem(field, "field");
 
-        // cJSON * value = cJSON_GetArrayItem(fields, i);
+        if ( !cJSON_IsString(fieldName) )
+            continue;
 
         LOG(DEBUG,"Cancel called for fieldName:%s", fieldName->valuestring);
+        cancelDMAttribute(dmClient.client, fieldName->valuestring);
+    }
+    dmClient.bObserve = isDMAttributeObserved(dmClient.client, "mgmt.firmware");
 
-        if (!strcmp(fieldName->valuestring, "mgmt.firmware")) {
-            dmClient.bObserve = 0;
-            sprintf(respMsg,"{\"rc\":%d,\"reqId\":%s}",RESPONSE_SUCCESS,currentRequestID);
+    sprintf(respMsg,"{\"rc\":%d,\"reqId\":\"%s\"}",rc,reqId);
 
-            LOG(DEBUG,"Response Message:%s", respMsg);
+    LOG(DEBUG,"Response Message:%s", respMsg);
 
-            //Publish the response to the IoTF
-            publishData(dmClient.client, RESPONSE, respMsg, QoS1);
-        }
-    }
+    //Publish the response to the IoTF
+    publishData(dmClient.client, RESPONSE, respMsg, QoS1);
+
+    cJSON_Delete(jsonPayload);
 
     LOG(DEBUG, "exit::");
 }
@@ -285,11 +446,9 @@ void updateLocationHandler(double latitude, double longitude, double elevation,
     LOG(DEBUG, "entry::");
 
     int rc = -1;
-    char data[500];
-    sprintf(data,"{\"d\":{\"longitude\":%f,\"latitude\":%f,\"elevation\":%f,\"measuredDateTime\":\"%s\",\"updatedDateTime\":\"%s\",\"accuracy\":%f},\"reqId\":\"%s\"}",
-        latitude, longitude, elevation, measuredDateTime, updatedDateTime, accuracy, currentRequestID);
 
-    rc = publishData(dmClient.client, UPDATE_LOCATION, data, QoS1);
+    /* the location update is a request of its own, pipelined with others */
+    rc = publishLocation(dmClient.client, latitude, longitude, elevation, measuredDateTime, updatedDateTime, accuracy);
 
     LOG(DEBUG, "exit:: rc = %d", rc);
 }
@@ -319,22 +478,32 @@ void updateLocationRequest(cJSON* value)
 }
 
 //Handler for update Firmware request
-void updateFirmwareRequest(cJSON* value) 
+void updateFirmwareRequest(cJSON* value, char* reqId)
 {
     LOG(DEBUG, "entry::");
 
     char response[100];
+    char *verifier = cJSON_GetObjectItem(value, "verifier")->valuestring;
+
+    /* a cut verifier could not be verified, or verify the wrong digest */
+    if ( strlen(verifier) >= sizeof(dmClient.DeviceData.mgmt.firmware.verifier) ) {
+        LOG(ERROR, "Firmware verifier is too long: length=%d", (int)strlen(verifier));
+        sprintf(response, "{\"rc\":%d,\"reqId\":\"%s\"}", BAD_REQUEST, reqId);
+        publishData(dmClient.client, RESPONSE, response, QoS1);
+        LOG(DEBUG, "exit::");
+        return;
+    }
 
-    strcpy(dmClient.DeviceData.mgmt.firmware.version, cJSON_GetObjectItem(value, "version")->valuestring);
+    snprintf(dmClient.DeviceData.mgmt.firmware.version, sizeof(dmClient.DeviceData.mgmt.firmware.version), "%s", cJSON_GetObjectItem(value, "version")->valuestring);
     LOG(DEBUG,"Firmware Version: %s",dmClient.DeviceData.mgmt.firmware.version);
 
-    strcpy(dmClient.DeviceData.mgmt.firmware.name, cJSON_GetObjectItem(value, "name")->valuestring);
+    snprintf(dmClient.DeviceData.mgmt.firmware.name, sizeof(dmClient.DeviceData.mgmt.firmware.name), "%s", cJSON_GetObjectItem(value, "name")->valuestring);
     LOG(DEBUG,"Name: %s",dmClient.DeviceData.mgmt.firmware.name);
 
-    strcpy(dmClient.DeviceData.mgmt.firmware.url, cJSON_GetObjectItem(value, "uri")->valuestring);
+    snprintf(dmClient.DeviceData.mgmt.firmware.url, sizeof(dmClient.DeviceData.mgmt.firmware.url), "%s", cJSON_GetObjectItem(value, "uri")->valuestring);
     LOG(DEBUG,"URI: %s",dmClient.DeviceData.mgmt.firmware.url);
 
-    strcpy(dmClient.DeviceData.mgmt.firmware.verifier, cJSON_GetObjectItem(value, "verifier")->valuestring);
+    snprintf(dmClient.DeviceData.mgmt.firmware.verifier, sizeof(dmClient.DeviceData.mgmt.firmware.verifier), "%s", verifier);
     LOG(DEBUG,"Verifier: %s",dmClient.DeviceData.mgmt.firmware.verifier);
 
     dmClient.DeviceData.mgmt.firmware.state = cJSON_GetObjectItem(value,"state")->valueint;
@@ -343,10 +512,13 @@ void updateFirmwareRequest(cJSON* value)
     dmClient.DeviceData.mgmt.firmware.updateStatus = cJSON_GetObjectItem(value,"updateStatus")->valueint;
     LOG(DEBUG,"updateStatus: %d",dmClient.DeviceData.mgmt.firmware.updateStatus);
 
-    strcpy(dmClient.DeviceData.mgmt.firmware.updatedDateTime, cJSON_GetObjectItem(value, "updatedDateTime")->valuestring);
+    snprintf(dmClient.DeviceData.mgmt.firmware.updatedDateTime, sizeof(dmClient.DeviceData.mgmt.firmware.updatedDateTime), "%s", cJSON_GetObjectItem(value, "updatedDateTime")->valuestring);
     LOG(DEBUG,"updatedDateTime: %s",dmClient.DeviceData.mgmt.firmware.updatedDateTime);
 
-    sprintf(response, "{\"rc\":%d,\"reqId\":\"%s\"}", UPDATE_SUCCESS, currentRequestID);
+    /* set by the platform, not notified back */
+    storeFirmwareAttribute(0);
+
+    sprintf(response, "{\"rc\":%d,\"reqId\":\"%s\"}", UPDATE_SUCCESS, reqId);
     LOG(DEBUG,"Response: %s",response);
 
     publishData(dmClient.client, RESPONSE, response, QoS1);
@@ -362,11 +534,11 @@ void messageUpdate(void *payload)
     LOG(DEBUG, "entry::");
 
     int i = 0;
+    char reqId[40];
     cJSON * jsonPayload = cJSON_Parse(payload);
     if (jsonPayload) {
-        cJSON* jreqId = cJSON_GetObjectItem(jsonPayload, "reqId");
-        strcpy(currentRequestID, jreqId->valuestring);
-        LOG(DEBUG,"Update reqId: %s",currentRequestID);
+        getRequestId(jsonPayload, reqId, sizeof(reqId));
+        LOG(DEBUG,"Update reqId: %s",reqId);
         cJSON *d = cJSON_GetObjectItem(jsonPayload, "d");
         cJSON *fields = cJSON_GetObjectItem(d, "fields");
 
@@ -382,13 +554,11 @@ void messageUpdate(void *payload)
             }
             else if (!strcmp(fieldName->valuestring, "mgmt.firmware")){
                 LOG(DEBUG,"Calling updateFirmwareRequest");
-                updateFirmwareRequest(value);
+                updateFirmwareRequest(value, reqId);
             }
-            else if (!strcmp(fieldName->valuestring, "metadata")){
-                LOG(DEBUG,"METADATA not supported");
-            }
-            else if (!strcmp(fieldName->valuestring, "deviceInfo")){
-                LOG(DEBUG,"deviceInfo not supported");
+            else if (!strcmp(fieldName->valuestring, "metadata") || !strcmp(fieldName->valuestring, "deviceInfo")){
+                LOG(DEBUG,"Storing %s set by the platform", fieldName->valuestring);
+                storeDMAttribute(dmClient.client, fieldName->valuestring, cJSON_Duplicate(value, 1), 0);
             }
             else{
                 LOG(DEBUG, "Fieldname = %s",fieldName->valuestring);
@@ -402,43 +572,128 @@ void messageUpdate(void *payload)
     LOG(DEBUG, "exit::");
 }
 
-//Handler for responses from the server . Invoke the callback for the response.
-//Callback needs to be invoked only if the request Id is matched. While yielding we
-//receives the response for old request Ids from the platform. But we are interested only
-//with the request Id action was initiated.
-void messageResponse(void *payload, size_t sz)
-{
-    LOG(DEBUG, "entry::");
-
-    if (dmcb != 0) {
-        char *pl = (char*) malloc(sizeof(char)*sz+1);
-        strcpy(pl,payload);
-        char *reqID;
-        char *status;
+/* rc stops growing past this, longer digit runs are not a valid rc */
+#define DM_RC_MAX 100000
 
-        reqID = strtok(pl, ",");
-        status= strtok(NULL, ",");
+/*
+ * Scan rc and reqId of a response in one pass, in any order, without
+ * allocation. The payload needs no NUL termination, nested objects and
+ * escaped strings are skipped. Returns 0 if reqId is found. Also used for
+ * the reqId of requests of attached devices.
+ */
+int scanDMResponse(const char *p, size_t len, int *rc, char *reqId, size_t reqIdLen)
+{
+    const char *end = p + len;
+    int depth = 0, isKey = 0, found = -1;
+    enum { KEY_OTHER, KEY_RC, KEY_REQID } key = KEY_OTHER;
 
-        reqID = strtok(reqID, ":\"");
-        reqID = strtok(NULL, ":\"");
-        reqID = strtok(NULL, ":\"");
+    *rc = 0;
+    reqId[0] = '\0';
 
-        status= strtok(status, "}");
-        status= strtok(status, ":");
-        status= strtok(NULL, ":");
+    while (p < end) {
+        char ch = *p++;
 
-        LOG(INFO, "DMResponse: Status:%s reqID:%s payload:%s", status, reqID, pl);
-        if(!strcmp(currentRequestID,reqID))
-        {
-            LOG(DEBUG, "%s == %s, Calling the callback",currentRequestID,reqID);
-            interrupt = 1;
-            (*dmcb)(status, reqID, payload, sz);
+        switch (ch) {
+        case '{':
+        case '[':
+            if (++depth == 1)
+                isKey = 1;
+            break;
+        case '}':
+        case ']':
+            depth--;
+            break;
+        case ',':
+            if (depth == 1) {
+                isKey = 1;
+                key = KEY_OTHER;
+            }
+            break;
+        case ':':
+            if (depth == 1)
+                isKey = 0;
+            break;
+        case '"': {
+            const char *start = p, *q;
+            /* closing quote is the first one after an even number of backslashes */
+            for (;;) {
+                if ((p = memchr(p, '"', end - p)) == NULL)
+                    return found;
+                for (q = p; q > start && q[-1] == '\\'; q--)
+                    ;
+                if (((p - q) & 1) == 0)
+                    break;
+                p++;
+            }
+            if (depth == 1 && isKey) {
+                size_t n = p - start;
+                key = (n == 2 && !memcmp(start, "rc", 2)) ? KEY_RC :
+                      (n == 5 && !memcmp(start, "reqId", 5)) ? KEY_REQID : KEY_OTHER;
+            } else if (depth == 1 && key == KEY_REQID) {
+                size_t n = p - start;
+                if (n >= reqIdLen)
+                    n = reqIdLen - 1;
+                memcpy(reqId, start, n);
+                reqId[n] = '\0';
+                found = 0;
+            } else if (depth == 1 && key == KEY_RC) {
+                /* some responses quote rc */
+                const char *q = start;
+                int neg = (q < p && *q == '-');
+                int v = 0;
+                for (q += neg; q < p && *q >= '0' && *q <= '9'; q++) {
+                    if (v < DM_RC_MAX)
+                        v = v * 10 + (*q - '0');
+                }
+                *rc = neg ? -v : v;
+            }
+            p++;
+            break;
         }
-        else
-        {
-            LOG(DEBUG, "%s != %s, Calling the callback",currentRequestID,reqID);
+        default:
+            if (depth == 1 && !isKey && key == KEY_RC && (ch == '-' || (ch >= '0' && ch <= '9'))) {
+                int neg = (ch == '-');
+                int v = neg ? 0 : ch - '0';
+                for (; p < end && *p >= '0' && *p <= '9'; p++) {
+                    if (v < DM_RC_MAX)
+                        v = v * 10 + (*p - '0');
+                }
+                *rc = neg ? -v : v;
+                key = KEY_OTHER;
+            }
+            break;
         }
-        free(pl);
+    }
+
+    return found;
+}
+
+//Handler for responses from the server. Complete the request of the reqId,
+//with its own callback or with the DM command callback. Responses of requests
+//not pending, like old requests answered after their timeout, are ignored.
+void messageResponse(iotfclient *client, char *payload, size_t sz)
+{
+    LOG(DEBUG, "entry::");
+
+    char reqID[40];
+    char status[12];
+    int rc = 0;
+    int ret;
+
+    if (scanDMResponse(payload, sz, &rc, reqID, sizeof(reqID)) != 0) {
+        LOG(DEBUG, "No reqId in response");
+        return;
+    }
+    sprintf(status, "%d", rc);
+
+    LOG(INFO, "DMResponse: Status:%s reqID:%s payload:%.*s", status, reqID, (int)sz, payload);
+    ret = completeDMRequest(client, reqID, rc, payload, sz);
+    if (ret < 0) {
+        LOG(DEBUG, "No pending request for reqId %s", reqID);
+    } else if (ret > 0 && dmcb != 0) {
+        LOG(DEBUG, "Calling the callback for reqId %s", reqID);
+        interrupt = 1;
+        (*dmcb)(status, reqID, payload, sz);
     }
 
     LOG(DEBUG, "exit::");
@@ -471,7 +726,7 @@ void messageForAction(char *topicName, void *payload, size_t sz, int isReboot)
         reqID = strtok(NULL, ":\"");
         reqID = strtok(NULL, ":\"");
 
-        strcpy(currentRequestID,reqID);
+        snprintf(actionRequestID, sizeof(actionRequestID), "%s", reqID ? reqID : "");
         LOG(INFO, "DMAction: reqId:%s action:%s", reqID, action);
 
         if (isReboot && dmcbReboot != 0) {
@@ -492,29 +747,54 @@ void messageForAction(char *topicName, void *payload, size_t sz, int isReboot)
 
 
 /* Process device management messages */
-int messageArrived_dm(void *context, char *topic, void *payload, size_t len) 
+int messageArrived_dm(void *context, char *topic, int topicLen, void *payload, size_t len)
 {
     LOG(DEBUG, "entry:: ");
 
-    LOG(INFO, "DM Message. Context=%x Topic=%s", context, topic);
+    iotfclient *client = context ? (iotfclient *)context : dmClient.client;
+    char *pl;
+
+    LOG(INFO, "DM Message. Context=%p Topic=%s", context, topic);
+    (void)topicLen;
+
+    /* Requests and responses of devices attached to a gateway */
+    if (client && !strncmp(topic, "iotdm-1/type/", 13)) {
+        int rc = messageArrived_gatewaydm(client, topic, payload, len);
+        LOG(DEBUG, "exit:: ");
+        return rc;
+    }
 
+    /* Responses are the most frequent, and scanned in place */
     if(!strcmp(topic, DMRESPONSE)){
-        messageResponse(payload, len);
-    } else if (!strcmp(topic, DMUPDATE)) {
-        messageUpdate(payload);
+        messageResponse(client, (char *)payload, len);
+        LOG(DEBUG, "exit:: ");
+        return 1;
+    }
+
+    /* Message payload is not NUL terminated */
+    if ((pl = (char *)malloc(len + 1)) == NULL) {
+        LOG(ERROR, "Failed to allocate DM message payload");
+        return 1;
+    }
+    memcpy(pl, payload, len);
+    pl[len] = '\0';
+
+    if (!strcmp(topic, DMUPDATE)) {
+        messageUpdate(pl);
     } else if (!strcmp(topic, DMOBSERVE)) {
-        messageObserve();
+        messageObserve(pl);
     } else if (!strcmp(topic, DMCANCEL)) {
-        messageCancel(payload);
+        messageCancel(pl);
     } else if (!strcmp(topic, DMREBOOT)) {
-        messageForAction(topic, payload, len, 1);
+        messageForAction(topic, pl, len, 1);
     } else if (!strcmp(topic, DMFACTORYRESET)) {
-        messageForAction(topic, payload, len, 0);
+        messageForAction(topic, pl, len, 0);
     } else if (!strcmp(topic, DMFIRMWAREDOWNLOAD)) {
-        messageFirmwareDownload(payload);
+        messageFirmwareDownload(pl);
     } else if (!strcmp(topic, DMFIRMWAREUPDATE)) {
-        messageFirmwareUpdate();
+        messageFirmwareUpdate(pl);
     }
+    free(pl);
 
     LOG(DEBUG, "exit:: ");
 
@@ -562,16 +842,16 @@ int changeState(int rc)
     switch(rc)
     {
         case 202:
-            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action is initiated.\",\"reqId\":\"%s\"}", rc, currentRequestID);
+            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action is initiated.\",\"reqId\":\"%s\"}", rc, actionRequestID);
             break;
         case 500:
-            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action attempt failed.\",\"reqId\":\"%s\"}", rc, currentRequestID);
+            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action attempt failed.\",\"reqId\":\"%s\"}", rc, actionRequestID);
             break;
         case 501:
-            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action is not supported.\",\"reqId\":\"%s\"}", rc, currentRequestID);
+            sprintf(response, "{\"rc\":\"%d\",\"message\":\"Device action is not supported.\",\"reqId\":\"%s\"}", rc, actionRequestID);
             break;
         default:
-            sprintf(response, "{\"rc\":\"%d\",\"message\":\"\",\"reqId\":\"%s\"}", rc, currentRequestID);
+            sprintf(response, "{\"rc\":\"%d\",\"message\":\"\",\"reqId\":\"%s\"}", rc, actionRequestID);
             break;
     }
 
@@ -594,16 +874,11 @@ int changeFirmwareDownloadState(int state)
 {
     LOG(TRACE, "entry::");
 
-    char firmwareMsg[300];
-    int rc = -1;
-    if (dmClient.bObserve) {
-        dmClient.DeviceData.mgmt.firmware.state = state;
-        sprintf(firmwareMsg, "{\"d\":{\"fields\":[{\"field\" : \"mgmt.firmware\",\"value\":{\"state\":%d}}]}}", state);
-        rc = publishActionResponse(NOTIFY, firmwareMsg);
-        LOG(TRACE, "publishActionResponse = %d",rc);
-    } else{
-        LOG(TRACE, "mgmt.firmware is not in observe state");
-    }
+    int rc;
+    dmClient.DeviceData.mgmt.firmware.state = state;
+
+    /* notified with other changes if observed */
+    rc = storeFirmwareAttribute(1);
 
     LOG(TRACE, "exit:: rc = %d",rc);
     return rc;
@@ -623,18 +898,11 @@ int changeFirmwareUpdateState(int state)
 {
     LOG(TRACE, "entry::");
 
-    char firmwareMsg[300];
-    int rc = -1;
-    if (dmClient.bObserve) {
-        dmClient.DeviceData.mgmt.firmware.updateStatus = state;
-        sprintf(firmwareMsg,
-            "{\"d\":{\"fields\":[{\"field\" : \"mgmt.firmware\",\"value\":{\"state\":%d,\"updateStatus\":%d}}]}}",
-            dmClient.DeviceData.mgmt.firmware.state,state);
-        rc = publishActionResponse(NOTIFY, firmwareMsg);
-        LOG(TRACE, "publishActionResponse = %d",rc);
-    } else{
-        LOG(TRACE, "mgmt.firmware is not in observe state");
-    }
+    int rc;
+    dmClient.DeviceData.mgmt.firmware.updateStatus = state;
+
+    /* notified with other changes if observed */
+    rc = storeFirmwareAttribute(1);
 
     LOG(TRACE, "exit:: rc = %d",rc);
 
@@ -33,15 +33,8 @@
 
 
 /* Device Management requests */
-#define MANAGE               "iotdevice-1/mgmt/manage"
 #define UNMANAGE             "iotdevice-1/mgmt/unmanage"
-#define NOTIFY               "iotdevice-1/notify"
 #define RESPONSE             "iotdevice-1/response"
-#define UPDATE_LOCATION      "iotdevice-1/device/update/location"
-#define CREATE_DIAG_ERRCODES "iotdevice-1/add/diag/errorCodes"
-#define CLEAR_DIAG_ERRCODES  "iotdevice-1/clear/diag/errorCodes"
-#define ADD_DIAG_LOG         "iotdevice-1/add/diag/log"
-#define CLEAR_DIAG_LOG       "iotdevice-1/clear/diag/log"
 
 #define DMRESPONSE           "iotdm-1/response"
 #define DMUPDATE             "iotdm-1/device/update"
@@ -64,18 +57,6 @@
 #define UPDATE_SUCCESS              204
 #define RESPONSE_SUCCESS            200
 
-#define FIRMWARESTATE_IDLE          0
-#define FIRMWARESTATE_DOWNLOADING   1
-#define FIRMWARESTATE_DOWNLOADED    2
-
-#define FIRMWAREUPDATE_SUCCESS             0
-#define FIRMWAREUPDATE_INPROGRESS          1
-#define FIRMWAREUPDATE_OUTOFMEMORY         2
-#define FIRMWAREUPDATE_CONNECTIONLOST      3
-#define FIRMWAREUPDATE_VERIFICATIONFAILED  4
-#define FIRMWAREUPDATE_UNSUPPORTEDIMAGE    5
-#define FIRMWAREUPDATE_INVALIDURL          6
-
 #define RESPONSE_ACCEPTED                  202
 #define BAD_REQUEST                        400
 
@@ -130,8 +111,8 @@ struct DeviceAction{
 struct DeviceFirmware{
     char version[10];
     char name[20];
-    char url[100];
-    char verifier[20];
+    char url[1024];
+    char verifier[140];
     int state;
     int updateStatus;
     char deviceId[40];
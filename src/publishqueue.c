@@ -0,0 +1,269 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Offline publish queue. Messages published while the client is not
+ * connected - after initialize and before connectiotf(), or while the
+ * reconnect supervisor reconnects - are queued in memory and published in
+ * order once connected. Messages published while the queue is being flushed
+ * are queued behind it, so order is kept.
+ */
+
+#include <pthread.h>
+
+#include <MQTTClient.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+extern int sendPublish(iotfclient *client, char *topic, void *payload, int payloadlen, int qos);
+
+#define PUBLISH_QUEUE_SIZE      100
+
+typedef struct queuedPublish {
+    struct queuedPublish *next;
+    char *topic;
+    char *payload;
+    int payloadlen;
+    int qos;
+} queuedPublish;
+
+typedef struct {
+    pthread_mutex_t lock;
+    int online;
+    int queueSize;
+    int queued;
+    queuedPublish *head;
+    queuedPublish *tail;
+} publishQueue;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+static void freeQueued(queuedPublish *p)
+{
+    free(p->topic);
+    free(p->payload);
+    free(p);
+}
+
+static publishQueue * getPublishQueue(iotfclient *client)
+{
+    publishQueue *queue;
+
+    pthread_mutex_lock(&createLock);
+    queue = (publishQueue *)client->pubqueue;
+    if ( queue == NULL ) {
+        queue = (publishQueue *)calloc(1, sizeof(publishQueue));
+        if ( queue != NULL ) {
+            pthread_mutex_init(&queue->lock, NULL);
+            queue->online = (client->c != NULL);
+            queue->queueSize = PUBLISH_QUEUE_SIZE;
+            client->pubqueue = queue;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return queue;
+}
+
+/**
+ * Function used to set the size of the offline publish queue.
+ */
+int setPublishQueueSize(iotfclient *client, int queueSize)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    publishQueue *queue;
+
+    if ( queueSize < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (queue = getPublishQueue(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    queue->queueSize = queueSize;
+    pthread_mutex_unlock(&queue->lock);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Queue or reject a publish while the client is offline. Returns 0 if the
+ * client is online and the message should be published, else 1 with the
+ * publish return code in rc.
+ */
+int queuePublish(iotfclient *client, char *topic, char *payload, int qos, int *rc)
+{
+    publishQueue *queue = (publishQueue *)client->pubqueue;
+    queuedPublish *p;
+    int handled = 0;
+
+    /* not connected yet - queue with default size */
+    if ( queue == NULL && client->c == NULL )
+        queue = getPublishQueue(client);
+    if ( queue == NULL )
+        return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if ( queue->online )
+        goto unlock;
+
+    /* With queue size 0, a publish before connect goes to the MQTT client as before */
+    if ( queue->queueSize == 0 && client->c == NULL )
+        goto unlock;
+
+    handled = 1;
+    if ( queue->queueSize == 0 ) {
+        *rc = CLIENT_DISCONNECTED;
+        goto unlock;
+    }
+    if ( queue->queued >= queue->queueSize ) {
+        LOG(DEBUG, "Publish queue is full: topic=%s", topic);
+        *rc = QUEUE_FULL;
+        goto unlock;
+    }
+
+    p = (queuedPublish *)calloc(1, sizeof(queuedPublish));
+    if ( p == NULL || (p->topic = strdup(topic)) == NULL || (p->payload = strdup(payload)) == NULL ) {
+        if ( p )
+            freeQueued(p);
+        *rc = -1;
+        goto unlock;
+    }
+    p->payloadlen = strlen(payload);
+    p->qos = qos;
+    if ( queue->tail )
+        queue->tail->next = p;
+    else
+        queue->head = p;
+    queue->tail = p;
+    queue->queued++;
+    *rc = 0;
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+    return handled;
+}
+
+/*
+ * Queue publishes from now on when the connection is lost, or publish
+ * directly again leaving queued messages to the next flush
+ */
+void setPublishQueueOnline(iotfclient *client, int online)
+{
+    publishQueue *queue = getPublishQueue(client);
+
+    if ( queue != NULL ) {
+        pthread_mutex_lock(&queue->lock);
+        queue->online = online;
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+/*
+ * Publish queued messages in order, called once connected. Returns 0 if the
+ * queue is drained and the client is online, -1 if a publish failed.
+ */
+int flushPublishQueue(iotfclient *client)
+{
+    publishQueue *queue = (publishQueue *)client->pubqueue;
+    int rc = 0;
+
+    if ( queue == NULL )
+        return 0;
+
+    pthread_mutex_lock(&queue->lock);
+    if ( queue->queued )
+        LOG(INFO, "Publishing %d queued messages", queue->queued);
+
+    while ( queue->head ) {
+        queuedPublish *p = queue->head;
+
+        queue->head = p->next;
+        if ( queue->head == NULL )
+            queue->tail = NULL;
+        queue->queued--;
+
+        pthread_mutex_unlock(&queue->lock);
+        rc = sendPublish(client, p->topic, p->payload, p->payloadlen, p->qos);
+        pthread_mutex_lock(&queue->lock);
+
+        if ( rc != MQTTCLIENT_SUCCESS ) {
+            LOG(WARN, "Failed to publish queued message: topic=%s rc=%d", p->topic, rc);
+            p->next = queue->head;
+            queue->head = p;
+            if ( queue->tail == NULL )
+                queue->tail = p;
+            queue->queued++;
+            rc = -1;
+            goto unlock;
+        }
+        freeQueued(p);
+    }
+    queue->online = 1;
+
+unlock:
+    pthread_mutex_unlock(&queue->lock);
+    return rc;
+}
+
+/*
+ * Returns 1 if publishes are not queued
+ */
+int isPublishQueueOnline(iotfclient *client)
+{
+    publishQueue *queue = (publishQueue *)client->pubqueue;
+    int online = 1;
+
+    if ( queue != NULL ) {
+        pthread_mutex_lock(&queue->lock);
+        online = queue->online;
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    return online;
+}
+
+/*
+ * Drop queued messages and free the queue
+ */
+void freePublishQueue(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    publishQueue *queue = (publishQueue *)client->pubqueue;
+
+    if ( queue != NULL ) {
+        if ( queue->queued )
+            LOG(WARN, "Dropping %d queued messages", queue->queued);
+        while ( queue->head ) {
+            queuedPublish *p = queue->head;
+            queue->head = p->next;
+            freeQueued(p);
+        }
+        pthread_mutex_destroy(&queue->lock);
+        free(queue);
+        client->pubqueue = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
@@ -0,0 +1,307 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Reconnect supervisor. When the connection is lost, a supervisor thread
+ * reconnects in the background, waiting between attempts for the delay
+ * returned by the reconnect policy. The default policy is exponential
+ * backoff with jitter, so a fleet that lost its connections at the same
+ * time does not reconnect in lockstep.
+ *
+ * While the supervisor reconnects, publishData() does not block: messages
+ * go to the offline publish queue, which connectiotf() flushes once the
+ * client is connected again.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#include <MQTTClient.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define RECONNECT_BASE_MS       1000
+#define RECONNECT_CAP_MS        300000
+
+typedef enum { SUPERVISOR_CONNECTED, SUPERVISOR_RECONNECTING } supervisorState;
+
+typedef struct {
+    iotfclient *client;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stop;
+    supervisorState state;
+    int attempt;
+    int baseMs;
+    int capMs;
+    reconnectPolicyCallback policy;
+    void *policyContext;
+    unsigned long long seed;    /* xorshift state of the default policy jitter */
+} reconnectSupervisor;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+extern int connectiotf(iotfclient *client);
+extern int setPublishQueueSize(iotfclient *client, int queueSize);
+extern void setPublishQueueOnline(iotfclient *client, int online);
+extern int flushPublishQueue(iotfclient *client);
+extern int isPublishQueueOnline(iotfclient *client);
+
+
+static unsigned int nextRandom(reconnectSupervisor *sup)
+{
+    sup->seed ^= sup->seed << 13;
+    sup->seed ^= sup->seed >> 7;
+    sup->seed ^= sup->seed << 17;
+    return (unsigned int)(sup->seed >> 32);
+}
+
+/*
+ * Seed jitter from time, process and client id - devices of a fleet booted at
+ * the same time must not draw the same delays.
+ */
+static void seedRandom(reconnectSupervisor *sup)
+{
+    struct timespec now;
+    const char *id = sup->client->cfg.id ? sup->client->cfg.id : "";
+    unsigned long long x;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    x = (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    x ^= (unsigned long long)getpid() << 32;
+    while ( *id )
+        x = x * 31 + (unsigned char)*id++;
+
+    /* splitmix64 */
+    x += 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+    sup->seed = (x ^ (x >> 31)) | 1;
+}
+
+/*
+ * Default policy - exponential backoff with equal jitter: the delay is drawn
+ * from the upper half of min(cap, base * 2^(attempt-1)).
+ */
+static int defaultPolicy(reconnectSupervisor *sup, int attempt)
+{
+    long delay = sup->baseMs;
+    int i;
+
+    for (i = 1; i < attempt && delay < sup->capMs; i++)
+        delay *= 2;
+    if ( delay > sup->capMs )
+        delay = sup->capMs;
+
+    return (int)(delay / 2 + nextRandom(sup) % (delay / 2 + 1));
+}
+
+static void * supervisorThread(void *arg)
+{
+    reconnectSupervisor *sup = (reconnectSupervisor *)arg;
+
+    pthread_mutex_lock(&sup->lock);
+    while ( !sup->stop ) {
+        struct timespec deadline;
+        int delay, rc;
+
+        if ( sup->state == SUPERVISOR_CONNECTED ) {
+            pthread_cond_wait(&sup->cond, &sup->lock);
+            continue;
+        }
+
+        sup->attempt++;
+        if ( sup->policy )
+            delay = sup->policy(sup->policyContext, sup->attempt);
+        else
+            delay = defaultPolicy(sup, sup->attempt);
+        if ( delay < 0 )
+            delay = 0;
+
+        LOG(INFO, "Reconnect attempt #%d in %d ms", sup->attempt, delay);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += delay / 1000;
+        deadline.tv_nsec += (delay % 1000) * 1000000L;
+        if ( deadline.tv_nsec >= 1000000000L ) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while ( !sup->stop && pthread_cond_timedwait(&sup->cond, &sup->lock, &deadline) != ETIMEDOUT )
+            ;
+        if ( sup->stop )
+            break;
+
+        pthread_mutex_unlock(&sup->lock);
+        /* connectiotf() flushes the publish queue. If the connection is up but
+         * the flush failed, only retry the flush.
+         */
+        if ( isConnected(sup->client) )
+            rc = flushPublishQueue(sup->client);
+        else
+            rc = connectiotf(sup->client);
+        pthread_mutex_lock(&sup->lock);
+
+        if ( rc != MQTTCLIENT_SUCCESS || !isPublishQueueOnline(sup->client) ) {
+            LOG(WARN, "Reconnect attempt #%d failed: rc=%d", sup->attempt, rc);
+            continue;
+        }
+
+        LOG(INFO, "Reconnected after %d attempts", sup->attempt);
+        sup->state = SUPERVISOR_CONNECTED;
+        sup->attempt = 0;
+    }
+    pthread_mutex_unlock(&sup->lock);
+
+    return NULL;
+}
+
+/**
+ * Function used to enable the reconnect supervisor.
+ */
+int setReconnectOptions(iotfclient *client, int baseMs, int capMs, int queueSize)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    reconnectSupervisor *sup;
+
+    if ( baseMs < 0 || capMs < 0 || queueSize < 0 ) {
+        LOG(WARN, "Invalid reconnect options: baseMs=%d capMs=%d queueSize=%d", baseMs, capMs, queueSize);
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&createLock);
+    sup = (reconnectSupervisor *)client->reconnect;
+    if ( sup == NULL ) {
+        pthread_condattr_t attr;
+
+        sup = (reconnectSupervisor *)calloc(1, sizeof(reconnectSupervisor));
+        if ( sup == NULL ) {
+            pthread_mutex_unlock(&createLock);
+            rc = -1;
+            goto exit;
+        }
+        sup->client = client;
+        sup->state = SUPERVISOR_CONNECTED;
+        seedRandom(sup);
+        pthread_mutex_init(&sup->lock, NULL);
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&sup->cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if ( pthread_create(&sup->thread, NULL, supervisorThread, sup) != 0 ) {
+            LOG(ERROR, "Failed to start reconnect supervisor thread");
+            pthread_cond_destroy(&sup->cond);
+            pthread_mutex_destroy(&sup->lock);
+            free(sup);
+            pthread_mutex_unlock(&createLock);
+            rc = -1;
+            goto exit;
+        }
+        client->reconnect = sup;
+    }
+    pthread_mutex_unlock(&createLock);
+
+    pthread_mutex_lock(&sup->lock);
+    sup->baseMs = baseMs ? baseMs : RECONNECT_BASE_MS;
+    sup->capMs = capMs ? capMs : RECONNECT_CAP_MS;
+    if ( sup->capMs < sup->baseMs )
+        sup->capMs = sup->baseMs;
+    pthread_mutex_unlock(&sup->lock);
+
+    rc = setPublishQueueSize(client, queueSize);
+
+    LOG(INFO, "Reconnect supervisor: baseMs=%d capMs=%d queueSize=%d", sup->baseMs, sup->capMs, queueSize);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/**
+ * Function used to set the reconnect policy.
+ */
+int setReconnectPolicy(iotfclient *client, reconnectPolicyCallback policy, void *context)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    reconnectSupervisor *sup = (reconnectSupervisor *)client->reconnect;
+
+    if ( sup == NULL ) {
+        LOG(WARN, "Reconnect supervisor is not enabled");
+        rc = -1;
+    } else {
+        pthread_mutex_lock(&sup->lock);
+        sup->policy = policy;
+        sup->policyContext = context;
+        pthread_mutex_unlock(&sup->lock);
+    }
+
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Wake up the supervisor to reconnect. Called from the connection lost
+ * callback, and when a publish fails. Returns 0 if supervisor is not enabled.
+ */
+int triggerReconnect(iotfclient *client)
+{
+    reconnectSupervisor *sup = (reconnectSupervisor *)client->reconnect;
+
+    if ( sup == NULL )
+        return 0;
+
+    pthread_mutex_lock(&sup->lock);
+    if ( sup->state == SUPERVISOR_CONNECTED ) {
+        LOG(INFO, "Connection lost, reconnecting in background");
+        setPublishQueueOnline(client, 0);
+        sup->state = SUPERVISOR_RECONNECTING;
+        pthread_cond_signal(&sup->cond);
+    }
+    pthread_mutex_unlock(&sup->lock);
+
+    return 1;
+}
+
+/*
+ * Stop the supervisor
+ */
+void freeReconnectSupervisor(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    reconnectSupervisor *sup = (reconnectSupervisor *)client->reconnect;
+
+    if ( sup != NULL ) {
+        pthread_mutex_lock(&sup->lock);
+        sup->stop = 1;
+        pthread_cond_signal(&sup->cond);
+        pthread_mutex_unlock(&sup->lock);
+        pthread_join(sup->thread, NULL);
+
+        pthread_cond_destroy(&sup->cond);
+        pthread_mutex_destroy(&sup->lock);
+        free(sup);
+        client->reconnect = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}
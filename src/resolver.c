@@ -0,0 +1,440 @@
+/*******************************************************************************
+ * Copyright (c) 2018 IBM Corp.
+ *
+ * All rights reserved. This program and the accompanying materials
+ * are made available under the terms of the Eclipse Public License v1.0
+ * and Eclipse Distribution License v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ *******************************************************************************/
+
+/*
+ * Resolution of the broker host name. connectiotf() starts resolution in a
+ * background thread, so it overlaps the other startup phases.
+ *
+ * With the resolver cache enabled, the last good addresses are kept with the
+ * TTL of the DNS answer, and persisted to a file. connectiotf() connects to
+ * the cached addresses right away, also when they are expired, while the
+ * host name is resolved again in the background (stale while revalidate).
+ * The addresses are passed to Paho as server URIs, followed by the host name
+ * URI, so Paho falls back across all of them. The address that connected is
+ * moved to the front.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+#include "iotfclient.h"
+#include "iotf_utils.h"
+
+#define RESOLVER_MAX_ADDRS      8
+#define RESOLVER_DEFAULT_TTL    300
+#define RESOLVER_MIN_TTL        30
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int running;                /* resolve thread started and not joined */
+    int done;                   /* resolve thread finished               */
+    int enabled;                /* connect to cached addresses           */
+    char *cachePath;
+    int defaultTtl;
+    int maxStale;
+    char host[256];
+    char port[8];
+    int count;
+    char addrs[RESOLVER_MAX_ADDRS][INET6_ADDRSTRLEN];
+    time_t expires;
+    long lastMs;
+    int lastRc;
+} brokerResolver;
+
+static pthread_mutex_t createLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Add address if not present yet */
+static void addAddress(char addrs[][INET6_ADDRSTRLEN], int *count, const char *addr)
+{
+    int i;
+
+    if ( *count >= RESOLVER_MAX_ADDRS )
+        return;
+    for (i = 0; i < *count; i++) {
+        if ( !strcmp(addrs[i], addr) )
+            return;
+    }
+    snprintf(addrs[(*count)++], INET6_ADDRSTRLEN, "%s", addr);
+}
+
+/* Query records of a type, returns lowest TTL or -1 if none */
+static int queryRecords(const char *host, int type, char addrs[][INET6_ADDRSTRLEN], int *count)
+{
+    unsigned char answer[NS_PACKETSZ * 4];
+    ns_msg msg;
+    ns_rr rr;
+    int len, i, ttl = -1;
+
+    len = res_query(host, ns_c_in, type, answer, sizeof(answer));
+    if ( len < 0 || ns_initparse(answer, len, &msg) < 0 )
+        return -1;
+
+    for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+        char addr[INET6_ADDRSTRLEN];
+
+        if ( ns_parserr(&msg, ns_s_an, i, &rr) < 0 || (int)ns_rr_type(rr) != type )
+            continue;
+        if ( (type == ns_t_a && ns_rr_rdlen(rr) != 4) || (type == ns_t_aaaa && ns_rr_rdlen(rr) != 16) )
+            continue;
+        if ( inet_ntop(type == ns_t_a ? AF_INET : AF_INET6, ns_rr_rdata(rr), addr, sizeof(addr)) == NULL )
+            continue;
+        addAddress(addrs, count, addr);
+        if ( ttl < 0 || (int)ns_rr_ttl(rr) < ttl )
+            ttl = (int)ns_rr_ttl(rr);
+    }
+
+    return ttl;
+}
+
+/*
+ * Resolve host, from DNS with the TTL of the answer, else with getaddrinfo()
+ * which also covers /etc/hosts. Returns TTL, -1 if TTL is unknown.
+ */
+static int resolveAddresses(const char *host, const char *port, char addrs[][INET6_ADDRSTRLEN], int *count, int *rc)
+{
+    struct addrinfo hints, *result = NULL, *ai;
+    int ttl, ttl6;
+
+    *count = 0;
+    *rc = 0;
+    ttl = queryRecords(host, ns_t_a, addrs, count);
+    ttl6 = queryRecords(host, ns_t_aaaa, addrs, count);
+    if ( ttl < 0 || (ttl6 >= 0 && ttl6 < ttl) )
+        ttl = ttl6;
+    if ( *count > 0 )
+        return ttl;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    *rc = getaddrinfo(host, port, &hints, &result);
+    for (ai = result; ai != NULL; ai = ai->ai_next) {
+        char addr[INET6_ADDRSTRLEN];
+        if ( getnameinfo(ai->ai_addr, ai->ai_addrlen, addr, sizeof(addr), NULL, 0, NI_NUMERICHOST) == 0 )
+            addAddress(addrs, count, addr);
+    }
+    if ( result )
+        freeaddrinfo(result);
+
+    return -1;
+}
+
+/* Persist cache. Called with lock held. */
+static void saveCache(brokerResolver *res)
+{
+    char tmpPath[strlen(res->cachePath) + 5];
+    FILE *fp;
+    int i;
+
+    sprintf(tmpPath, "%s.tmp", res->cachePath);
+    fp = fopen(tmpPath, "w");
+    if ( fp == NULL ) {
+        LOG(WARN, "Failed to write resolver cache %s: errno=%d", tmpPath, errno);
+        return;
+    }
+    fprintf(fp, "%s %s %ld\n", res->host, res->port, (long)res->expires);
+    for (i = 0; i < res->count; i++)
+        fprintf(fp, "%s\n", res->addrs[i]);
+    if ( fclose(fp) == 0 )
+        rename(tmpPath, res->cachePath);
+    else
+        unlink(tmpPath);
+}
+
+/* Load cache of host. Called with lock held. */
+static void loadCache(brokerResolver *res)
+{
+    char host[256], port[8], addr[INET6_ADDRSTRLEN + 2];
+    long expires;
+    FILE *fp;
+
+    if ( res->cachePath == NULL || (fp = fopen(res->cachePath, "r")) == NULL )
+        return;
+
+    if ( fscanf(fp, "%255s %7s %ld", host, port, &expires) == 3 &&
+         !strcmp(host, res->host) && !strcmp(port, res->port) ) {
+        res->count = 0;
+        while ( fscanf(fp, "%47s", addr) == 1 ) {
+            unsigned char buf[sizeof(struct in6_addr)];
+            if ( inet_pton(AF_INET, addr, buf) == 1 || inet_pton(AF_INET6, addr, buf) == 1 )
+                addAddress(res->addrs, &res->count, addr);
+        }
+        res->expires = (time_t)expires;
+        LOG(INFO, "Loaded %d cached addresses of %s", res->count, host);
+    }
+    fclose(fp);
+}
+
+static void * resolveThread(void *arg)
+{
+    brokerResolver *res = (brokerResolver *)arg;
+    char addrs[RESOLVER_MAX_ADDRS][INET6_ADDRSTRLEN];
+    char host[256], port[8];
+    long long start = monotonicMs();
+    int count, ttl, rc;
+
+    pthread_mutex_lock(&res->lock);
+    strcpy(host, res->host);
+    strcpy(port, res->port);
+    pthread_mutex_unlock(&res->lock);
+
+    ttl = resolveAddresses(host, port, addrs, &count, &rc);
+
+    pthread_mutex_lock(&res->lock);
+    res->lastMs = (long)(monotonicMs() - start);
+    res->lastRc = rc;
+    if ( count > 0 ) {
+        int i;
+
+        if ( ttl < 0 || ttl > res->defaultTtl )
+            ttl = res->defaultTtl;
+        if ( ttl < RESOLVER_MIN_TTL )
+            ttl = RESOLVER_MIN_TTL;
+
+        /* keep the address that connected last in front if still valid */
+        for (i = 0; i < count && res->count > 0; i++) {
+            if ( !strcmp(addrs[i], res->addrs[0]) ) {
+                strcpy(addrs[i], addrs[0]);
+                strcpy(addrs[0], res->addrs[0]);
+                break;
+            }
+        }
+        memcpy(res->addrs, addrs, sizeof(addrs));
+        res->count = count;
+        res->expires = time(NULL) + ttl;
+        if ( res->cachePath )
+            saveCache(res);
+    }
+    res->done = 1;
+    pthread_mutex_unlock(&res->lock);
+
+    if ( count > 0 ) {
+        LOG(DEBUG, "Resolved %s to %d addresses in %ld ms, ttl=%d", host, count, res->lastMs, ttl);
+    } else {
+        LOG(WARN, "Failed to resolve %s: %s", host, rc ? gai_strerror(rc) : "no address");
+    }
+
+    return NULL;
+}
+
+static brokerResolver * getResolver(iotfclient *client)
+{
+    brokerResolver *res;
+
+    pthread_mutex_lock(&createLock);
+    res = (brokerResolver *)client->resolver;
+    if ( res == NULL ) {
+        res = (brokerResolver *)calloc(1, sizeof(brokerResolver));
+        if ( res != NULL ) {
+            pthread_mutex_init(&res->lock, NULL);
+            res->defaultTtl = RESOLVER_DEFAULT_TTL;
+            client->resolver = res;
+        }
+    }
+    pthread_mutex_unlock(&createLock);
+
+    return res;
+}
+
+/* Join finished resolve thread. Called with lock held. */
+static void reapResolveThread(brokerResolver *res)
+{
+    if ( res->running && res->done ) {
+        pthread_join(res->thread, NULL);
+        res->running = 0;
+    }
+}
+
+/**
+ * Function used to enable the resolver cache.
+ */
+int setResolverCache(iotfclient *client, char *cachePath, int defaultTtlSecs, int maxStaleSecs)
+{
+    LOG(TRACE, "entry::");
+
+    int rc = 0;
+    brokerResolver *res;
+
+    if ( defaultTtlSecs < 0 || maxStaleSecs < 0 ) {
+        rc = MISSING_INPUT_PARAM;
+        goto exit;
+    }
+
+    if ( (res = getResolver(client)) == NULL ) {
+        rc = -1;
+        goto exit;
+    }
+
+    pthread_mutex_lock(&res->lock);
+    freePtr(res->cachePath);
+    res->cachePath = (cachePath && *cachePath) ? strdup(cachePath) : NULL;
+    res->defaultTtl = defaultTtlSecs ? defaultTtlSecs : RESOLVER_DEFAULT_TTL;
+    res->maxStale = maxStaleSecs;
+    res->enabled = 1;
+    pthread_mutex_unlock(&res->lock);
+
+    LOG(INFO, "Resolver cache: path=%s defaultTtl=%d maxStale=%d", cachePath ? cachePath : "", defaultTtlSecs, maxStaleSecs);
+
+exit:
+    LOG(TRACE, "exit:: rc=%d", rc);
+    return rc;
+}
+
+/*
+ * Start resolving the broker host in background, unless cached addresses are
+ * still fresh. Called at the start of connectiotf().
+ */
+void startBrokerResolver(iotfclient *client, char *host, int port)
+{
+    brokerResolver *res = getResolver(client);
+    char portStr[8];
+
+    if ( res == NULL )
+        return;
+
+    snprintf(portStr, sizeof(portStr), "%d", port);
+
+    pthread_mutex_lock(&res->lock);
+    reapResolveThread(res);
+    if ( strcmp(res->host, host) || strcmp(res->port, portStr) ) {
+        snprintf(res->host, sizeof(res->host), "%s", host);
+        strcpy(res->port, portStr);
+        res->count = 0;
+        res->expires = 0;
+        if ( res->enabled )
+            loadCache(res);
+    }
+
+    /* Without the cache, only the first connect resolves to overlap startup */
+    if ( !res->running && (res->enabled ? time(NULL) >= res->expires : client->c == NULL) ) {
+        res->done = 0;
+        if ( pthread_create(&res->thread, NULL, resolveThread, res) == 0 )
+            res->running = 1;
+    }
+    pthread_mutex_unlock(&res->lock);
+}
+
+/* host:port of a resolved address, with brackets for IPv6, without lock */
+static void getAddressToken(brokerResolver *res, int i, char *token)
+{
+    if ( strchr(res->addrs[i], ':') )
+        sprintf(token, "[%s]:%s", res->addrs[i], res->port);
+    else
+        sprintf(token, "%s:%s", res->addrs[i], res->port);
+}
+
+/*
+ * Get server URIs of cached addresses, waiting for resolution only if there
+ * are no usable cached addresses. Returns number of URIs, 0 to connect with
+ * the host name.
+ */
+int getBrokerURIs(iotfclient *client, char *scheme, char uris[][INET6_ADDRSTRLEN + 16], int maxUris)
+{
+    brokerResolver *res = (brokerResolver *)client->resolver;
+    int i, n = 0, stale;
+
+    if ( res == NULL )
+        return 0;
+
+    pthread_mutex_lock(&res->lock);
+    stale = res->count > 0 && res->maxStale > 0 && time(NULL) > res->expires + res->maxStale;
+    /* wait for the resolution started by startBrokerResolver() unless it
+     * is still running and the cached addresses are usable
+     */
+    if ( res->running && (res->done || !res->enabled || res->count == 0 || stale) ) {
+        /* clear running first so that no one else joins the thread */
+        pthread_t thread = res->thread;
+        res->running = 0;
+        pthread_mutex_unlock(&res->lock);
+        pthread_join(thread, NULL);
+        pthread_mutex_lock(&res->lock);
+        client->timings.dnsMs = res->lastMs;
+    }
+    if ( res->enabled ) {
+        for (i = 0; i < res->count && n < maxUris; i++) {
+            char token[INET6_ADDRSTRLEN + 12];
+            getAddressToken(res, i, token);
+            sprintf(uris[n++], "%s://%s", scheme, token);
+        }
+    }
+    pthread_mutex_unlock(&res->lock);
+
+    return n;
+}
+
+/*
+ * Move the address of the server URI that connected to the front
+ */
+void setBrokerConnected(iotfclient *client, const char *serverURI)
+{
+    brokerResolver *res = (brokerResolver *)client->resolver;
+    const char *hostPort;
+    int i;
+
+    if ( res == NULL || !res->enabled || serverURI == NULL )
+        return;
+
+    /* compare the whole host:port after the scheme */
+    hostPort = strstr(serverURI, "://");
+    hostPort = hostPort ? hostPort + 3 : serverURI;
+
+    pthread_mutex_lock(&res->lock);
+    for (i = 1; i < res->count; i++) {
+        char token[INET6_ADDRSTRLEN + 12];
+        getAddressToken(res, i, token);
+        if ( !strcmp(hostPort, token) ) {
+            char tmp[INET6_ADDRSTRLEN];
+            strcpy(tmp, res->addrs[i]);
+            memmove(res->addrs[1], res->addrs[0], i * INET6_ADDRSTRLEN);
+            strcpy(res->addrs[0], tmp);
+            if ( res->cachePath )
+                saveCache(res);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&res->lock);
+}
+
+/*
+ * Free resolver state
+ */
+void freeBrokerResolver(iotfclient *client)
+{
+    LOG(TRACE, "entry::");
+
+    brokerResolver *res = (brokerResolver *)client->resolver;
+
+    if ( res != NULL ) {
+        int running;
+
+        pthread_mutex_lock(&res->lock);
+        running = res->running;
+        res->running = 0;
+        pthread_mutex_unlock(&res->lock);
+        if ( running )
+            pthread_join(res->thread, NULL);
+        pthread_mutex_destroy(&res->lock);
+        freePtr(res->cachePath);
+        free(res);
+        client->resolver = NULL;
+    }
+
+    LOG(TRACE, "exit::");
+}